@@ -0,0 +1,191 @@
+#include "cache_hierarchy.hpp"
+#include "string.h"
+#include "stdio.h"
+
+void print_hierarchy_stats(const char *desc, HierarchyStats const &s) {
+  uint32_t lookups = s.l0_hits + s.l0_misses;
+  printf("L0 (%s): %u hits, %u misses (%.2f%% hit), %u fills, %u evictions, %u write-backs, %u back-invalidations\n",
+         desc, s.l0_hits, s.l0_misses, lookups ? 100.f*s.l0_hits/lookups : 0.f, s.l0_fills, s.l0_evictions,
+         s.l0_writebacks, s.back_invalidations);
+}
+
+template<unsigned int nl0, class L1, HierarchyMode mode>
+CacheHierarchy<nl0, L1, mode>::CacheHierarchy(L1 *l1)
+: m_l1{l1}
+, m_lru{}
+, m_stats{}
+{
+  m_tags.fill(INVALID_TAG);
+  m_valid.fill(0);
+  m_dirty.fill(0);
+  m_l1->set_evict_hook(&l1_evicted, this);
+}
+
+template<unsigned int nl0, class L1, HierarchyMode mode>
+CacheHierarchy<nl0, L1, mode>::~CacheHierarchy() {
+  flush();
+  m_l1->set_evict_hook(nullptr, nullptr);
+}
+
+template<unsigned int nl0, class L1, HierarchyMode mode>
+void CacheHierarchy<nl0, L1, mode>::read_data(uintptr_t addr, uint32_t nbytes, uint8_t *data) {
+  // Lines not in L0 go to L1 as one run, so L1 can still stream long ones.
+  // The run goes before an L0 line is used: what L1 evicts for it can take
+  // that line out of L0.
+  uintptr_t run_addr = addr;
+  uint32_t run_bytes = 0;
+  while (nbytes) {
+    unsigned int offset = addr&s_line_mask;
+    uint32_t n = nbytes < s_cache_line_size - offset ? nbytes : s_cache_line_size - offset;
+    if (run_bytes && lookup(addr&~uintptr_t(s_line_mask)) != NONE) {
+      m_l1->read_data(run_addr, run_bytes, data - run_bytes);
+      run_bytes = 0;
+    }
+    unsigned int i = l0_line(addr, n, false, false);
+    if (i == NONE) {
+      if (!run_bytes) run_addr = addr;
+      run_bytes += n;
+    } else {
+      memcpy(data, &m_lines[i][offset], n);
+    }
+    addr += n;
+    data += n;
+    nbytes -= n;
+  }
+  if (run_bytes) m_l1->read_data(run_addr, run_bytes, data - run_bytes);
+}
+
+template<unsigned int nl0, class L1, HierarchyMode mode>
+void CacheHierarchy<nl0, L1, mode>::write_data(uintptr_t addr, uint32_t nbytes, uint8_t const *data) {
+  uintptr_t run_addr = addr;
+  uint32_t run_bytes = 0;
+  while (nbytes) {
+    unsigned int offset = addr&s_line_mask;
+    uint32_t n = nbytes < s_cache_line_size - offset ? nbytes : s_cache_line_size - offset;
+    if (run_bytes && lookup(addr&~uintptr_t(s_line_mask)) != NONE) {
+      m_l1->write_data(run_addr, run_bytes, data - run_bytes);
+      run_bytes = 0;
+    }
+    unsigned int i = l0_line(addr, n, true, false);
+    if (i == NONE) {
+      if (!run_bytes) run_addr = addr;
+      run_bytes += n;
+    } else {
+      memcpy(&m_lines[i][offset], data, n);
+      sector_mask_t written = sector_mask(offset, n);
+      m_valid[i] |= written;
+      m_dirty[i] |= written;
+    }
+    addr += n;
+    data += n;
+    nbytes -= n;
+  }
+  if (run_bytes) m_l1->write_data(run_addr, run_bytes, data - run_bytes);
+}
+
+template<unsigned int nl0, class L1, HierarchyMode mode>
+void CacheHierarchy<nl0, L1, mode>::zero_data(uintptr_t addr, uint32_t nbytes) {
+  for (unsigned int i = 0; i < nl0; i++) {
+    uintptr_t tag = m_tags[i];
+    if (tag == INVALID_TAG || tag + s_cache_line_size <= addr || tag >= addr + nbytes) continue;
+    unsigned int lo = addr > tag ? addr - tag : 0;
+    unsigned int hi = addr + nbytes < tag + s_cache_line_size ? addr + nbytes - tag : s_cache_line_size;
+    memset(&m_lines[i][lo], 0, hi - lo);
+    // as in L1: sectors zeroed in full are clean once L1 has zeroed below
+    sector_mask_t covered = full_sector_mask(lo, hi - lo);
+    m_valid[i] |= covered;
+    m_dirty[i] &= ~covered;
+  }
+  m_l1->zero_data(addr, nbytes);
+}
+
+template<unsigned int nl0, class L1, HierarchyMode mode>
+void CacheHierarchy<nl0, L1, mode>::flush() {
+  for (unsigned int i = 0; i < nl0; i++) {
+    evict(i);
+  }
+  m_l1->flush();
+}
+
+template<unsigned int nl0, class L1, HierarchyMode mode>
+unsigned int CacheHierarchy<nl0, L1, mode>::allocate() {
+  unsigned int i = lookup(INVALID_TAG);
+  if (i == NONE) {
+    i = m_lru.victim();
+    evict(i);
+  }
+  return i;
+}
+
+template<unsigned int nl0, class L1, HierarchyMode mode>
+unsigned int CacheHierarchy<nl0, L1, mode>::fill(uintptr_t tag) {
+  unsigned int i = allocate();
+  // L1 may evict on the way, and back-invalidate other L0 lines, but not this one
+  m_l1->read_data(tag, s_cache_line_size, m_lines[i].data());
+  m_tags[i] = tag;
+  m_valid[i] = s_all_sectors;
+  m_dirty[i] = 0;
+  m_lru.touch(i);
+  EXTMEM_COUNT(m_stats.l0_fills++);
+  return i;
+}
+
+template<unsigned int nl0, class L1, HierarchyMode mode>
+void CacheHierarchy<nl0, L1, mode>::evict(unsigned int i) {
+  uintptr_t tag = m_tags[i];
+  if (tag == INVALID_TAG)
+    return;
+  // invalid first: writing into L1 can evict there and call back in
+  sector_mask_t dirty = m_dirty[i];
+  m_tags[i] = INVALID_TAG;
+  m_valid[i] = 0;
+  m_dirty[i] = 0;
+  EXTMEM_COUNT(m_stats.l0_evictions++);
+
+  IMemory *below = m_l1;
+  if constexpr (mode == HierarchyMode::EXCLUSIVE) {
+    // a stale copy L1 prefetched meanwhile mustn't outlive this one
+    m_l1->discard(tag);
+    below = m_l1->backing();
+  }
+  if (dirty) {
+    EXTMEM_COUNT(m_stats.l0_writebacks++);
+    uint8_t const *data = m_lines[i].data();
+    for_each_sector_run(dirty, [&](unsigned int first, unsigned int count) {
+      below->write_data(tag + (first<<s_sector_size_pow2), count<<s_sector_size_pow2, data + (first<<s_sector_size_pow2));
+    });
+  }
+}
+
+template<unsigned int nl0, class L1, HierarchyMode mode>
+bool CacheHierarchy<nl0, L1, mode>::l1_evicted(void *ctx, uintptr_t addr, uint8_t *data, sector_mask_t valid, sector_mask_t &dirty) {
+  auto *self = static_cast<CacheHierarchy*>(ctx);
+  unsigned int i = self->lookup(addr);
+  if constexpr (mode == HierarchyMode::INCLUSIVE) {
+    if (i == NONE)
+      return false;
+    // L0's dirty sectors are newer: they go out with L1's write-back
+    uint8_t const *line = self->m_lines[i].data();
+    for_each_sector_run(self->m_dirty[i], [&](unsigned int first, unsigned int count) {
+      memcpy(data + (first<<s_sector_size_pow2), line + (first<<s_sector_size_pow2), count<<s_sector_size_pow2);
+    });
+    dirty |= self->m_dirty[i];
+    self->m_tags[i] = INVALID_TAG;
+    self->m_valid[i] = 0;
+    self->m_dirty[i] = 0;
+    EXTMEM_COUNT(self->m_stats.back_invalidations++);
+    return false;
+  } else {
+    // L0 already holds a newer copy of a line L1 prefetched again
+    if (i != NONE)
+      return true;
+    i = self->allocate();
+    memcpy(self->m_lines[i].data(), data, s_cache_line_size);
+    self->m_tags[i] = addr;
+    self->m_valid[i] = valid;
+    self->m_dirty[i] = dirty;
+    self->m_lru.touch(i);
+    EXTMEM_COUNT(self->m_stats.l0_fills++);
+    return true;
+  }
+}
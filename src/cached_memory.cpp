@@ -1,7 +1,9 @@
 #include "cached_memory.hpp"
 #include "string.h"
 #include "stdio.h"
+#if !PICO_EXTMEM_HOST
 #include "pico/time.h"
+#endif
 
 
 #define SLEEP_MS(ms) {unsigned int _ms=(ms); while(_ms--) for (int i = 0; i < 1000'000; i++) tight_loop_contents();}
@@ -14,131 +16,493 @@
 #endif
 
 
-template<unsigned int u1, unsigned int u2>
-CachedMemory<u1, u2>::CachedMemory(IMemory *memory)
+void print_cache_stats(const char *desc, CacheStats const &s) {
+  uint32_t lookups = s.hits + s.misses;
+  printf("CACHE (%s): %u hits, %u misses (%.2f%% hit), %u evictions, %u write-backs, %u cleaned, %u bytes read, "
+         "%u bytes written, %u prefetches (%u useful, %u wasted)\n",
+         desc, s.hits, s.misses, lookups ? 100.f*s.hits/lookups : 0.f, s.evictions, s.writebacks, s.cleans,
+         s.bytes_read, s.bytes_written, s.prefetches, s.prefetch_useful, s.prefetch_wasted);
+}
+
+template<unsigned int u1, unsigned int u2, unsigned int u3, class P>
+CachedMemory<u1, u2, u3, P>::CachedMemory(IMemory *memory)
 : m_memory{memory}
-, m_next_evict{0}
+, m_replacement{}
+, m_stats{}
+, m_stream_threshold{s_default_stream_threshold}
+, m_evict_hook{nullptr}
+, m_evict_ctx{nullptr}
+, m_clean_set{0}
 {
+  m_cache_line_tags.fill(INVALID_TAG);
   for (auto &e : m_cache_line_lookups) {
-    e.masked_addr = -1;
+    e.valid = 0;
+    e.dirty = 0;
+    e.prefetched = false;
+    e.fill = -1;
+    e.pins = 0;
+  }
+  m_writeback.count = 0;
+  m_writeback.queued = false;
+}
+
+template<unsigned int u1, unsigned int u2, unsigned int u3, class P>
+CachedMemory<u1, u2, u3, P>::~CachedMemory() {
+  // outstanding transactions still point into this object, and dirty data
+  // must not be lost with it
+  flush_all();
+}
+
+template<unsigned int u1, unsigned int u2, unsigned int u3, class P>
+void CachedMemory<u1, u2, u3, P>::read_data(uintptr_t addr, uint32_t nbytes, uint8_t *data) {
+  if (nbytes >= m_stream_threshold) {
+    stream_read(addr, nbytes, data);
+    return;
+  }
+  while (nbytes) {
+    unsigned int offset = addr&s_cache_line_addr_mask;
+    uint32_t n = nbytes < s_cache_line_size - offset ? nbytes : s_cache_line_size - offset;
+    line_index_t line = cache_line_lookup_fetch(addr&~s_cache_line_addr_mask);
+    ASSERT(line != CACHE_MISS);
+    memcpy(data, &m_cache_lines[line][offset], n);
+    addr += n;
+    data += n;
+    nbytes -= n;
+  }
+}
+
+template<unsigned int u1, unsigned int u2, unsigned int u3, class P>
+void CachedMemory<u1, u2, u3, P>::write_data(uintptr_t addr, uint32_t nbytes, const uint8_t *data) {
+  if (nbytes >= m_stream_threshold) {
+    stream_write(addr, nbytes, data);
+    return;
+  }
+  while (nbytes) {
+    unsigned int offset = addr&s_cache_line_addr_mask;
+    uint32_t n = nbytes < s_cache_line_size - offset ? nbytes : s_cache_line_size - offset;
+    line_index_t line = cache_line_lookup_write(addr, n);
+    ASSERT(line != CACHE_MISS);
+    memcpy(&m_cache_lines[line][offset], data, n);
+    addr += n;
+    data += n;
+    nbytes -= n;
+  }
+}
+
+template<unsigned int u1, unsigned int u2, unsigned int u3, class P>
+uint8_t *CachedMemory<u1, u2, u3, P>::pin(uintptr_t addr, uint32_t nbytes) {
+  unsigned int offset = addr&s_cache_line_addr_mask;
+  if (nbytes == 0 || offset + nbytes > s_cache_line_size)
+    return nullptr;
+  uintptr_t tag = addr&~uintptr_t(s_cache_line_addr_mask);
+  line_index_t line = cache_line_lookup(tag);
+  if (line == CACHE_MISS || m_cache_line_lookups[line].pins == 0) {
+    // pinning another way of the set must leave one for everything else
+    line_index_t first = cache_set(addr)*s_num_ways;
+    unsigned int pinned = 0;
+    for (unsigned int way = 0; way < s_num_ways; way++) {
+      if (m_cache_line_lookups[first+way].pins) pinned++;
+    }
+    if (pinned + 1 >= s_num_ways)
+      return nullptr;
+  } else if (m_cache_line_lookups[line].pins == s_max_pins) {
+    return nullptr;
   }
+  line = cache_line_lookup_fetch(tag);
+  m_cache_line_lookups[line].pins++;
+  return &m_cache_lines[line][offset];
 }
 
-template<unsigned int u1, unsigned int u2>
-uint8_t CachedMemory<u1, u2>::read_byte(uintptr_t addr) {
-  PRINT("reading byte from %p\n", addr);
-  line_index_t line = cache_line_lookup_fetch(addr&~s_cache_line_addr_mask);
-  ASSERT(line != CACHE_MISS);
-  return *(uint8_t*)&m_cache_lines[line][addr&s_cache_line_addr_mask];
+template<unsigned int u1, unsigned int u2, unsigned int u3, class P>
+void CachedMemory<u1, u2, u3, P>::unpin(uintptr_t addr, uint32_t nbytes, bool written) {
+  line_index_t line = cache_line_lookup(addr&~uintptr_t(s_cache_line_addr_mask));
+  ASSERT(line != CACHE_MISS && m_cache_line_lookups[line].pins);
+  CacheLineData &data = m_cache_line_lookups[line];
+  if (written) data.dirty |= sector_mask(addr&s_cache_line_addr_mask, nbytes);
+  data.pins--;
 }
 
-template<unsigned int u1, unsigned int u2>
-uint16_t CachedMemory<u1, u2>::read_word(uintptr_t addr) {
-  PRINT("reading word from %p\n", addr);
-  line_index_t line = cache_line_lookup_fetch(addr&~s_cache_line_addr_mask);
-  ASSERT(line != CACHE_MISS);
-  return *(uint16_t*)&m_cache_lines[line][addr&s_cache_line_addr_mask];
+template<unsigned int u1, unsigned int u2, unsigned int u3, class P>
+void CachedMemory<u1, u2, u3, P>::discard(uintptr_t addr) {
+  line_index_t line = cache_line_lookup(addr&~uintptr_t(s_cache_line_addr_mask));
+  if (line == CACHE_MISS)
+    return;
+  ASSERT(m_cache_line_lookups[line].pins == 0);
+  cache_line_settle(line);
+  CacheLineData &data = m_cache_line_lookups[line];
+  m_cache_line_tags[line] = INVALID_TAG;
+  data.valid = 0;
+  data.dirty = 0;
+  data.prefetched = false;
 }
 
-template<unsigned int u1, unsigned int u2>
-uint32_t CachedMemory<u1, u2>::read_dword(uintptr_t addr) {
-  PRINT("reading dword from %p\n", addr);
-  line_index_t line = cache_line_lookup_fetch(addr&~s_cache_line_addr_mask);
-  PRINT("line %d\n", line);
-  ASSERT(line != CACHE_MISS);
-  return *(uint32_t*)&m_cache_lines[line][addr&s_cache_line_addr_mask];
+template<unsigned int u1, unsigned int u2, unsigned int u3, class P>
+void CachedMemory<u1, u2, u3, P>::cache_line_clean(line_index_t line) {
+  cache_line_settle(line);
+  CacheLineData &data = m_cache_line_lookups[line];
+  if (!data.dirty)
+    return;
+  EXTMEM_COUNT(m_stats.cleans++);
+  writeback_queue(line);
+  data.dirty = 0;
 }
 
-template<unsigned int u1, unsigned int u2>
-void CachedMemory<u1, u2>::read_data(uintptr_t addr, uint32_t nbytes, uint8_t *data) {
-  ASSERT(nbytes < s_cache_line_size);
-  ASSERT((nbytes + (addr&s_cache_line_addr_mask)) <= s_cache_line_size);
-  line_index_t line = cache_line_lookup_fetch(addr&~s_cache_line_addr_mask);
-  ASSERT(line != CACHE_MISS);
-  memcpy(data, &m_cache_lines[line][addr&s_cache_line_addr_mask], nbytes);
+template<unsigned int u1, unsigned int u2, unsigned int u3, class P>
+void CachedMemory<u1, u2, u3, P>::flush_range(uintptr_t addr, uint32_t nbytes) {
+  for (line_index_t line = 0; line < s_num_cache_lines; line++) {
+    uintptr_t tag = m_cache_line_tags[line];
+    if (tag == INVALID_TAG || tag + s_cache_line_size <= addr || tag >= addr + nbytes) continue;
+    cache_line_clean(line);
+  }
+  writeback_wait();
+}
+
+template<unsigned int u1, unsigned int u2, unsigned int u3, class P>
+void CachedMemory<u1, u2, u3, P>::flush_all() {
+  for (line_index_t line = 0; line < s_num_cache_lines; line++) {
+    if (m_cache_line_tags[line] != INVALID_TAG) cache_line_clean(line);
+    else cache_line_settle(line);
+  }
+  writeback_wait();
+}
+
+template<unsigned int u1, unsigned int u2, unsigned int u3, class P>
+void CachedMemory<u1, u2, u3, P>::flush() {
+  flush_all();
+  m_memory->flush();
+}
+
+template<unsigned int u1, unsigned int u2, unsigned int u3, class P>
+void CachedMemory<u1, u2, u3, P>::invalidate_range(uintptr_t addr, uint32_t nbytes) {
+  for (line_index_t line = 0; line < s_num_cache_lines; line++) {
+    uintptr_t tag = m_cache_line_tags[line];
+    if (tag == INVALID_TAG || tag + s_cache_line_size <= addr || tag >= addr + nbytes) continue;
+    CacheLineData &data = m_cache_line_lookups[line];
+    bool inside = tag >= addr && tag + s_cache_line_size <= addr + nbytes;
+    if (!inside || data.pins) {
+      cache_line_clean(line);
+      if (data.pins) continue;
+    }
+    cache_line_settle(line);
+    m_cache_line_tags[line] = INVALID_TAG;
+    data.valid = 0;
+    data.dirty = 0;
+    data.prefetched = false;
+  }
+  // nothing from before may land after later direct writes
+  writeback_wait();
 }
 
-template<unsigned int u1, unsigned int u2>
-void CachedMemory<u1, u2>::write_byte(uintptr_t addr, uint8_t value) {
-  PRINT("writing %02x to %p\n", value, addr);
-  line_index_t line = cache_line_lookup_fetch(addr&~s_cache_line_addr_mask);
-  ASSERT(line != CACHE_MISS);
-  *(uint8_t*)&m_cache_lines[line][addr&s_cache_line_addr_mask] = value;
-  m_cache_line_lookups[line].dirty = true;
+template<unsigned int u1, unsigned int u2, unsigned int u3, class P>
+bool CachedMemory<u1, u2, u3, P>::writeback_busy() {
+  if (m_writeback.queued) {
+    writeback_submit();
+    return true;
+  }
+  m_memory->poll();
+  for (unsigned int i = 0; i < m_writeback.count; i++) {
+    if (m_writeback.runs[i].status.load(std::memory_order_acquire) != MemTransaction::DONE) return true;
+  }
+  return false;
 }
 
-template<unsigned int u1, unsigned int u2>
-void CachedMemory<u1, u2>::write_word(uintptr_t addr, uint16_t value) {
-  PRINT("writing %04x to %p\n", value, addr);
-  line_index_t line = cache_line_lookup_fetch(addr&~s_cache_line_addr_mask);
-  ASSERT(line != CACHE_MISS);
-  *(uint16_t*)&m_cache_lines[line][addr&s_cache_line_addr_mask] = value;
-  m_cache_line_lookups[line].dirty = true;
+template<unsigned int u1, unsigned int u2, unsigned int u3, class P>
+unsigned int CachedMemory<u1, u2, u3, P>::clean(unsigned int max_lines) {
+  unsigned int cleaned = 0;
+  for (unsigned int n = 0; n < s_num_sets && cleaned < max_lines; n++) {
+    unsigned int set = m_clean_set;
+    m_clean_set = (m_clean_set+1)&s_set_index_mask;
+    // ask a copy, so the policy's own state doesn't move on
+    auto next = m_replacement[set];
+    line_index_t line = set*s_num_ways + next.victim();
+    CacheLineData &data = m_cache_line_lookups[line];
+    if (!data.dirty || data.pins || data.fill >= 0)
+      continue;
+    if (writeback_busy())
+      break;
+    cache_line_clean(line);
+    writeback_submit();
+    cleaned++;
+  }
+  return cleaned;
 }
 
-template<unsigned int u1, unsigned int u2>
-void CachedMemory<u1, u2>::write_dword(uintptr_t addr, uint32_t value) {
-  PRINT("writing %08x to %p\n", value, addr);
-  line_index_t line = cache_line_lookup_fetch(addr&~s_cache_line_addr_mask);
-  ASSERT(line != CACHE_MISS);
-  *(uint32_t*)&m_cache_lines[line][addr&s_cache_line_addr_mask] = value;
-  m_cache_line_lookups[line].dirty = true;
+template<unsigned int u1, unsigned int u2, unsigned int u3, class P>
+void CachedMemory<u1, u2, u3, P>::stream_read(uintptr_t addr, uint32_t nbytes, uint8_t *data) {
+  PRINT("streaming %d bytes from %p\n", nbytes, addr);
+  for (uint32_t done = 0; done < nbytes;) {
+    uint32_t n = nbytes - done < m_memory->max_read() ? nbytes - done : m_memory->max_read();
+    m_memory->read_data(addr + done, n, data + done);
+    done += n;
+  }
+  EXTMEM_COUNT(m_stats.bytes_read += nbytes);
+  // dirty sectors in the cache are newer than the backing memory
+  for (line_index_t line = 0; line < s_num_cache_lines; line++) {
+    uintptr_t tag = m_cache_line_tags[line];
+    if (tag == INVALID_TAG || tag + s_cache_line_size <= addr || tag >= addr + nbytes) continue;
+    unsigned int lo = addr > tag ? addr - tag : 0;
+    unsigned int hi = addr + nbytes < tag + s_cache_line_size ? addr + nbytes - tag : s_cache_line_size;
+    sector_mask_t dirty = m_cache_line_lookups[line].dirty & sector_mask(lo, hi - lo);
+    for_each_sector_run(dirty, [&](unsigned int first, unsigned int count) {
+      unsigned int from = first<<s_sector_size_pow2;
+      unsigned int to = (first+count)<<s_sector_size_pow2;
+      if (from < lo) from = lo;
+      if (to > hi) to = hi;
+      memcpy(data + (tag + from - addr), &m_cache_lines[line][from], to - from);
+    });
+  }
+}
 
-  PRINT("wrote %08x to %p\n", value, addr);
+template<unsigned int u1, unsigned int u2, unsigned int u3, class P>
+void CachedMemory<u1, u2, u3, P>::stream_write(uintptr_t addr, uint32_t nbytes, const uint8_t *data) {
+  PRINT("streaming %d bytes to %p\n", nbytes, addr);
+  for (uint32_t done = 0; done < nbytes;) {
+    uint32_t n = nbytes - done < m_memory->max_write() ? nbytes - done : m_memory->max_write();
+    m_memory->write_data(addr + done, n, data + done);
+    done += n;
+  }
+  EXTMEM_COUNT(m_stats.bytes_written += nbytes);
+  // keep cached copies up to date, sectors overwritten in full are now clean
+  for (line_index_t line = 0; line < s_num_cache_lines; line++) {
+    uintptr_t tag = m_cache_line_tags[line];
+    if (tag == INVALID_TAG || tag + s_cache_line_size <= addr || tag >= addr + nbytes) continue;
+    cache_line_settle(line);
+    unsigned int lo = addr > tag ? addr - tag : 0;
+    unsigned int hi = addr + nbytes < tag + s_cache_line_size ? addr + nbytes - tag : s_cache_line_size;
+    memcpy(&m_cache_lines[line][lo], data + (tag + lo - addr), hi - lo);
+    sector_mask_t covered = full_sector_mask(lo, hi - lo);
+    m_cache_line_lookups[line].valid |= covered;
+    m_cache_line_lookups[line].dirty &= ~covered;
+  }
 }
 
-template<unsigned int u1, unsigned int u2>
-void CachedMemory<u1, u2>::write_data(uintptr_t addr, uint32_t nbytes, const uint8_t *data) {
-  ASSERT(nbytes < s_cache_line_size);
-  ASSERT((nbytes + (addr&s_cache_line_addr_mask)) <= s_cache_line_size);
-  line_index_t line = cache_line_lookup_fetch(addr&~s_cache_line_addr_mask);
-  ASSERT(line != CACHE_MISS);
-  memcpy(&m_cache_lines[line][addr&s_cache_line_addr_mask], data, nbytes);
-  m_cache_line_lookups[line].dirty = true;
+template<unsigned int u1, unsigned int u2, unsigned int u3, class P>
+void CachedMemory<u1, u2, u3, P>::zero_data(uintptr_t addr, uint32_t nbytes) {
+  // a queued write-back into the range must not land after the zeros
+  writeback_wait();
+  for (line_index_t line = 0; line < s_num_cache_lines; line++) {
+    uintptr_t tag = m_cache_line_tags[line];
+    if (tag == INVALID_TAG || tag + s_cache_line_size <= addr || tag >= addr + nbytes) continue;
+    cache_line_settle(line);
+    unsigned int lo = addr > tag ? addr - tag : 0;
+    unsigned int hi = addr + nbytes < tag + s_cache_line_size ? addr + nbytes - tag : s_cache_line_size;
+    memset(&m_cache_lines[line][lo], 0, hi - lo);
+    // sectors zeroed in full match the backing memory, partly zeroed ones
+    // keep their state; an invalid one is fetched whole later
+    sector_mask_t covered = full_sector_mask(lo, hi - lo);
+    m_cache_line_lookups[line].valid |= covered;
+    m_cache_line_lookups[line].dirty &= ~covered;
+  }
+  m_memory->zero_data(addr, nbytes);
 }
 
-template<unsigned int u1, unsigned int u2>
-typename CachedMemory<u1, u2>::line_index_t CachedMemory<u1, u2>::cache_line_lookup(uintptr_t addr) {
+template<unsigned int u1, unsigned int u2, unsigned int u3, class P>
+typename CachedMemory<u1, u2, u3, P>::line_index_t CachedMemory<u1, u2, u3, P>::cache_line_lookup(uintptr_t addr) {
   ASSERT((addr&s_cache_line_addr_mask) == 0);
-  auto idx = m_cache_line_indexes.find(addr);
-  if (idx == m_cache_line_indexes.end())
-    return CACHE_MISS;
-  return idx->second;
+  line_index_t first = cache_set(addr)*s_num_ways;
+  for (unsigned int way = 0; way < s_num_ways; way++) {
+    if (m_cache_line_tags[first+way] == addr)
+      return first+way;
+  }
+  return CACHE_MISS;
 }
 
-template<unsigned int u1, unsigned int u2>
-typename CachedMemory<u1, u2>::line_index_t CachedMemory<u1, u2>::cache_line_lookup_fetch(uintptr_t addr) {
+template<unsigned int u1, unsigned int u2, unsigned int u3, class P>
+typename CachedMemory<u1, u2, u3, P>::line_index_t CachedMemory<u1, u2, u3, P>::cache_line_lookup_alloc(uintptr_t addr) {
   ASSERT((addr&s_cache_line_addr_mask) == 0);
+  unsigned int set = cache_set(addr);
   line_index_t line = cache_line_lookup(addr);
   if (line == CACHE_MISS) {
     PRINT("CACHE MISS (%p)\n", addr);
-    //evict cache lines in sequence
-    line = m_next_evict;
-    m_next_evict++;
-    m_next_evict &= (s_num_cache_lines-1);
+    EXTMEM_COUNT(m_stats.misses++);
+    line = set*s_num_ways + m_replacement[set].victim();
+    // pinned lines stay put, take the next way that isn't; pin() leaves one
+    while (m_cache_line_lookups[line].pins) line = set*s_num_ways + ((line+1)&(s_num_ways-1));
     cache_line_evict(line);
-    cache_line_fetch(line, addr);
+    m_cache_line_tags[line] = addr;
+  } else {
+    EXTMEM_COUNT(m_stats.hits++);
+    cache_line_settle(line);
   }
+  m_replacement[set].touch(line&(s_num_ways-1));
   PRINT("CACHE %p on %d\n", addr, line);
   return line;
 }
 
-template<unsigned int u1, unsigned int u2>
-void CachedMemory<u1, u2>::cache_line_fetch(line_index_t line, uintptr_t addr) {
-  ASSERT(m_cache_line_lookups[line].dirty == false);
-  ASSERT((addr&s_cache_line_addr_mask) == 0);
-  m_cache_line_lookups[line].masked_addr = addr;
-  m_cache_line_indexes.emplace(addr, line);
-  m_memory->read_data(addr, s_cache_line_size, m_cache_lines[line].data());
+template<unsigned int u1, unsigned int u2, unsigned int u3, class P>
+typename CachedMemory<u1, u2, u3, P>::line_index_t CachedMemory<u1, u2, u3, P>::cache_line_lookup_fetch(uintptr_t addr) {
+  line_index_t line = cache_line_lookup_alloc(addr);
+  CacheLineData &data = m_cache_line_lookups[line];
+  sector_mask_t missing = s_all_sectors & ~data.valid;
+  bool train = missing || data.prefetched;
+  if (data.prefetched) {
+    EXTMEM_COUNT(m_stats.prefetch_useful++);
+    data.prefetched = false;
+  }
+  if (missing) {
+    cache_line_fetch(line, missing);
+  }
+  writeback_submit();
+  if (train && m_prefetcher.enabled()) {
+    m_prefetcher.access(addr>>s_cache_line_size_pow2, [&](intptr_t next) {
+      cache_line_prefetch(uintptr_t(next)<<s_cache_line_size_pow2, line);
+    });
+  }
+  return line;
+}
+
+template<unsigned int u1, unsigned int u2, unsigned int u3, class P>
+void CachedMemory<u1, u2, u3, P>::cache_line_prefetch(uintptr_t addr, line_index_t keep) {
+  if (addr >= m_memory->size_bytes() || cache_line_lookup(addr) != CACHE_MISS)
+    return;
+  unsigned int set = cache_set(addr);
+  // ask a copy: a prefetch given up below mustn't move the policy on
+  auto next = m_replacement[set];
+  line_index_t line = set*s_num_ways + next.victim();
+  // never evict the line the demand access is about to use or a pinned
+  // one, nor pay a write-back for a guess
+  if (line == keep || m_cache_line_lookups[line].dirty || m_cache_line_lookups[line].pins)
+    return;
+
+  unsigned int slot = 0;
+  while (slot < s_max_fills && m_fills[slot].status != MemTransaction::IDLE) slot++;
+  if (slot == s_max_fills) {
+    // reclaim fills that have landed
+    for (unsigned int i = 0; i < s_max_fills; i++) {
+      if (m_fills[i].status == MemTransaction::DONE) {
+        cache_line_settle(m_fill_lines[i]);
+        slot = i;
+      }
+    }
+    if (slot == s_max_fills)
+      return;
+  }
+
+  PRINT("PREFETCH %p on %d\n", addr, line);
+  m_replacement[set] = next;
+  cache_line_evict(line);
+  m_cache_line_tags[line] = addr;
+  CacheLineData &data = m_cache_line_lookups[line];
+  data.prefetched = true;
+  data.fill = slot;
+  m_fill_lines[slot] = line;
+  MemTransaction &t = m_fills[slot];
+  t.op = MemTransaction::READ;
+  t.addr = addr;
+  t.nbytes = s_cache_line_size;
+  t.data = m_cache_lines[line].data();
+  t.on_complete = nullptr;
+  m_memory->submit(&t);
+  m_replacement[set].touch(line&(s_num_ways-1));
+  EXTMEM_COUNT(m_stats.prefetches++);
+  EXTMEM_COUNT(m_stats.bytes_read += s_cache_line_size);
+}
+
+template<unsigned int u1, unsigned int u2, unsigned int u3, class P>
+void CachedMemory<u1, u2, u3, P>::cache_line_settle(line_index_t line) {
+  CacheLineData &data = m_cache_line_lookups[line];
+  if (data.fill < 0)
+    return;
+  MemTransaction &t = m_fills[data.fill];
+  m_memory->wait(&t);
+  t.status = MemTransaction::IDLE;
+  data.valid = s_all_sectors;
+  data.fill = -1;
+}
+
+template<unsigned int u1, unsigned int u2, unsigned int u3, class P>
+typename CachedMemory<u1, u2, u3, P>::line_index_t CachedMemory<u1, u2, u3, P>::cache_line_lookup_write(uintptr_t addr, unsigned int nbytes) {
+  unsigned int offset = addr&s_cache_line_addr_mask;
+  line_index_t line = cache_line_lookup_alloc(addr&~s_cache_line_addr_mask);
+  CacheLineData &data = m_cache_line_lookups[line];
+  if (data.prefetched) {
+    EXTMEM_COUNT(m_stats.prefetch_useful++);
+    data.prefetched = false;
+  }
+  // sectors written in full need no fetch, only partially written ones do
+  sector_mask_t written = sector_mask(offset, nbytes);
+  sector_mask_t missing = written & ~full_sector_mask(offset, nbytes) & ~data.valid;
+  if (missing) {
+    cache_line_fetch(line, missing);
+  }
+  writeback_submit();
+  data.valid |= written;
+  data.dirty |= written;
+  return line;
+}
+
+template<unsigned int u1, unsigned int u2, unsigned int u3, class P>
+void CachedMemory<u1, u2, u3, P>::cache_line_fetch(line_index_t line, sector_mask_t sectors) {
+  ASSERT((m_cache_line_lookups[line].valid & sectors) == 0);
+  for_each_sector_run(sectors, [&](unsigned int first, unsigned int count) {
+    m_memory->read_data(
+      m_cache_line_tags[line] + (first<<s_sector_size_pow2),
+      count<<s_sector_size_pow2,
+      &m_cache_lines[line][first<<s_sector_size_pow2]
+    );
+    EXTMEM_COUNT(m_stats.bytes_read += count<<s_sector_size_pow2);
+  });
+  m_cache_line_lookups[line].valid |= sectors;
+}
+
+template<unsigned int u1, unsigned int u2, unsigned int u3, class P>
+void CachedMemory<u1, u2, u3, P>::cache_line_evict(line_index_t line) {
+  ASSERT(line < s_num_cache_lines && m_cache_line_lookups[line].pins == 0);
+  cache_line_settle(line);
+  CacheLineData &data = m_cache_line_lookups[line];
+  if (data.prefetched) {
+    EXTMEM_COUNT(m_stats.prefetch_wasted++);
+  }
+  if (m_cache_line_tags[line] != INVALID_TAG) {
+    EXTMEM_COUNT(m_stats.evictions++);
+    if (m_evict_hook && data.valid &&
+        m_evict_hook(m_evict_ctx, m_cache_line_tags[line], m_cache_lines[line].data(), data.valid, data.dirty)) {
+      data.dirty = 0;
+    }
+  }
+  if (data.dirty) {
+    EXTMEM_COUNT(m_stats.writebacks++);
+    writeback_queue(line);
+  }
+  m_cache_line_tags[line] = INVALID_TAG;
+  data.valid = 0;
+  data.dirty = 0;
+  data.prefetched = false;
+}
+
+template<unsigned int u1, unsigned int u2, unsigned int u3, class P>
+void CachedMemory<u1, u2, u3, P>::writeback_queue(line_index_t line) {
+  // stage the line so its buffer can be refilled straight away, one
+  // write-back burst per run of contiguous dirty sectors
+  writeback_wait();
+  memcpy(m_writeback.data.data(), m_cache_lines[line].data(), s_cache_line_size);
+  for_each_sector_run(m_cache_line_lookups[line].dirty, [&](unsigned int first, unsigned int count) {
+    MemTransaction &t = m_writeback.runs[m_writeback.count++];
+    t.op = MemTransaction::WRITE;
+    t.addr = m_cache_line_tags[line] + (first<<s_sector_size_pow2);
+    t.nbytes = count<<s_sector_size_pow2;
+    t.data = &m_writeback.data[first<<s_sector_size_pow2];
+    EXTMEM_COUNT(m_stats.bytes_written += t.nbytes);
+    t.on_complete = nullptr;
+  });
+  m_writeback.queued = true;
+}
+
+template<unsigned int u1, unsigned int u2, unsigned int u3, class P>
+void CachedMemory<u1, u2, u3, P>::writeback_submit() {
+  if (!m_writeback.queued)
+    return;
+  for (unsigned int i = 0; i < m_writeback.count; i++) {
+    m_memory->submit(&m_writeback.runs[i]);
+  }
+  m_writeback.queued = false;
 }
 
-template<unsigned int u1, unsigned int u2>
-void CachedMemory<u1, u2>::cache_line_evict(line_index_t line) {
-  ASSERT(line < s_num_cache_lines);
-  if (m_cache_line_lookups[line].dirty) {
-    m_memory->write_data(m_cache_line_lookups[line].masked_addr, s_cache_line_size, m_cache_lines[line].data());
+template<unsigned int u1, unsigned int u2, unsigned int u3, class P>
+void CachedMemory<u1, u2, u3, P>::writeback_wait() {
+  writeback_submit();
+  for (unsigned int i = 0; i < m_writeback.count; i++) {
+    m_memory->wait(&m_writeback.runs[i]);
   }
-  m_cache_line_indexes.erase(m_cache_line_lookups[line].masked_addr);
-  m_cache_line_lookups[line].masked_addr = -1;
-  m_cache_line_lookups[line].dirty = false;
+  m_writeback.count = 0;
 }
\ No newline at end of file
@@ -0,0 +1,197 @@
+#include "extmem_alloc.hpp"
+#include <algorithm>
+#include <iterator>
+#include <new>
+#if !PICO_EXTMEM_HOST
+#include "pico/platform.h"
+#endif
+
+static uintptr_t align_up(uintptr_t addr, uint32_t align) {
+  return (addr + align - 1)&~uintptr_t(align - 1);
+}
+
+// bytes of [base, base + size) from addr on
+static uint32_t remaining(uintptr_t base, uint32_t size, uintptr_t addr) {
+  return addr - base >= size ? 0 : size - uint32_t(addr - base);
+}
+
+ExtmemArena::ExtmemArena(uintptr_t base, uint32_t size, uint32_t line_size) {
+  m_line_size = line_size;
+  m_base = align_up(base, line_size);
+  m_size = remaining(base, size, m_base)&~(line_size - 1);
+  reset();
+}
+
+void ExtmemArena::reset() {
+  m_top = 0;
+  m_free_bytes = 0;
+  m_lost = 0;
+  m_num_free = 0;
+}
+
+uintptr_t ExtmemArena::allocate(uint32_t nbytes) {
+  uint32_t size = round_up(std::max(nbytes, 1u));
+  if (size < nbytes) return s_extmem_alloc_failed;
+  for (uint32_t i = 0; i < m_num_free; i++) {
+    Extent &e = m_free[i];
+    if (e.size < size) continue;
+    uint32_t offset = e.offset;
+    e.offset += size;
+    e.size -= size;
+    m_free_bytes -= size;
+    if (e.size == 0) {
+      std::copy(m_free + i + 1, m_free + m_num_free, m_free + i);
+      m_num_free--;
+    }
+    return m_base + offset;
+  }
+  if (m_size - m_top < size) return s_extmem_alloc_failed;
+  uint32_t offset = m_top;
+  m_top += size;
+  return m_base + offset;
+}
+
+void ExtmemArena::deallocate(uintptr_t addr, uint32_t nbytes) {
+  if (!owns(addr)) return;
+  uint32_t offset = addr - m_base, size = round_up(std::max(nbytes, 1u));
+  if (offset + size == m_top) {
+    // back to the bump pointer, along with a free extent just below
+    m_top = offset;
+    if (m_num_free && m_free[m_num_free - 1].offset + m_free[m_num_free - 1].size == m_top) {
+      m_num_free--;
+      m_top = m_free[m_num_free].offset;
+      m_free_bytes -= m_free[m_num_free].size;
+    }
+    return;
+  }
+  uint32_t i = std::upper_bound(m_free, m_free + m_num_free, offset,
+                                [](uint32_t offset, Extent const &e) { return offset < e.offset; }) - m_free;
+  bool join_prev = i > 0 && m_free[i - 1].offset + m_free[i - 1].size == offset;
+  bool join_next = i < m_num_free && offset + size == m_free[i].offset;
+  if (join_prev && join_next) {
+    m_free[i - 1].size += size + m_free[i].size;
+    std::copy(m_free + i + 1, m_free + m_num_free, m_free + i);
+    m_num_free--;
+  } else if (join_prev) {
+    m_free[i - 1].size += size;
+  } else if (join_next) {
+    m_free[i].offset = offset;
+    m_free[i].size += size;
+  } else if (m_num_free < s_max_free) {
+    std::copy_backward(m_free + i, m_free + m_num_free, m_free + m_num_free + 1);
+    m_free[i] = {offset, size};
+    m_num_free++;
+  } else {
+    m_lost += size;
+    return;
+  }
+  m_free_bytes += size;
+}
+
+ExtmemPool::ExtmemPool(uintptr_t base, uint32_t size) {
+  m_base = base;
+  m_num_slabs = std::min(size/s_slab_size, s_max_slabs);
+  reset();
+}
+
+void ExtmemPool::reset() {
+  m_used = 0;
+  std::fill(m_hint, m_hint + s_num_classes, 0);
+  for (Slab &slab : m_slabs) slab.size_class = s_unassigned;
+}
+
+uint32_t ExtmemPool::block_size(uint32_t nbytes) {
+  if (nbytes > s_max_block) return 0;
+  uint32_t block = s_min_block;
+  while (block < nbytes) block <<= 1;
+  return block;
+}
+
+uintptr_t ExtmemPool::allocate(uint32_t nbytes) {
+  uint32_t block = block_size(nbytes);
+  if (!block) return s_extmem_alloc_failed;
+  uint8_t size_class = __builtin_ctz(block/s_min_block);
+  uint32_t blocks = s_slab_size/block;
+
+  auto has_room = [&](uint32_t i) { return m_slabs[i].size_class == size_class && m_slabs[i].used < blocks; };
+  uint32_t index = m_hint[size_class];
+  if (index >= m_num_slabs || !has_room(index)) {
+    index = 0;
+    while (index < m_num_slabs && !has_room(index)) index++;
+  }
+  if (index == m_num_slabs) {
+    index = 0;
+    while (index < m_num_slabs && m_slabs[index].size_class != s_unassigned) index++;
+    if (index == m_num_slabs) return s_extmem_alloc_failed;
+    Slab &slab = m_slabs[index];
+    slab.size_class = size_class;
+    slab.used = 0;
+    // blocks past the end of the slab read as used
+    for (uint32_t w = 0; w < std::size(slab.bitmap); w++) {
+      uint32_t first = w*32;
+      slab.bitmap[w] = first >= blocks ? ~0u : blocks - first >= 32 ? 0 : ~0u << (blocks - first);
+    }
+  }
+  m_hint[size_class] = index;
+
+  Slab &slab = m_slabs[index];
+  uint32_t w = 0;
+  while (slab.bitmap[w] == ~0u) w++;
+  uint32_t bit = __builtin_ctz(~slab.bitmap[w]);
+  slab.bitmap[w] |= 1u << bit;
+  slab.used++;
+  m_used += block;
+  return m_base + index*s_slab_size + (w*32 + bit)*block;
+}
+
+void ExtmemPool::deallocate(uintptr_t addr) {
+  if (!owns(addr)) return;
+  uint32_t offset = addr - m_base;
+  Slab &slab = m_slabs[offset/s_slab_size];
+  if (slab.size_class == s_unassigned) return;
+  uint32_t block = s_min_block << slab.size_class;
+  uint32_t n = offset%s_slab_size/block;
+  uint32_t mask = 1u << n%32;
+  if (!(slab.bitmap[n/32]&mask)) return;
+  slab.bitmap[n/32] &= ~mask;
+  m_used -= block;
+  if (--slab.used == 0) slab.size_class = s_unassigned;
+}
+
+ExtmemHeap::ExtmemHeap(uintptr_t base, uint32_t size, uint32_t line_size, uint32_t pool_size)
+  : m_pool{align_up(base, line_size), std::min(pool_size, remaining(base, size, align_up(base, line_size)))},
+    m_arena{m_pool.base() + m_pool.size(), remaining(base, size, m_pool.base() + m_pool.size()), line_size} {}
+
+uintptr_t ExtmemHeap::allocate(uint32_t nbytes) {
+  if (nbytes <= ExtmemPool::s_max_block) {
+    uintptr_t addr = m_pool.allocate(nbytes);
+    if (addr != s_extmem_alloc_failed) return addr;
+  }
+  return m_arena.allocate(nbytes);
+}
+
+void ExtmemHeap::deallocate(uintptr_t addr, uint32_t nbytes) {
+  if (m_pool.owns(addr)) m_pool.deallocate(addr);
+  else m_arena.deallocate(addr, nbytes);
+}
+
+// Pool blocks are aligned to their size up to a line and arena blocks to a
+// line, so a block at least alignment bytes long is aligned enough.
+void *ExtmemResource::do_allocate(size_t bytes, size_t alignment) {
+  uintptr_t addr = s_extmem_alloc_failed;
+  if (alignment <= m_heap.arena().line_size() && bytes <= UINT32_MAX) {
+    addr = m_heap.allocate(std::max<uint32_t>(bytes, alignment));
+  }
+  if (addr == s_extmem_alloc_failed) {
+#if PICO_EXTMEM_HOST
+    throw std::bad_alloc();
+#else
+    panic("extmem: out of memory for %u bytes\n", unsigned(bytes));
+#endif
+  }
+  return (void*)addr;
+}
+
+void ExtmemResource::do_deallocate(void *p, size_t bytes, size_t alignment) {
+  m_heap.deallocate(uintptr_t(p), std::max<uint32_t>(bytes, alignment));
+}
@@ -2,18 +2,35 @@
 #include <array>
 
 #include "extmem_mapper.hpp"
+#include "thumb_decoder.hpp"
+#include "extmem_trace.hpp"
 #include <cstdio>
+#if !PICO_EXTMEM_HOST
 #include "pico/stdio.h"
 #include "hardware/exception.h"
+#include "pico/platform.h"
+#endif
 
 #ifndef DEBUG
 #define DEBUG 1
 #endif
 
 #define PRINT(...) if(DEBUG){printf(__VA_ARGS__); fflush(stdout);}
+#if PICO_EXTMEM_TRACE
+// handlers run with PC already past the instruction
+#define TRACE(ps, addr, size, write) ExtmemTracer::record((ps)->PC - 2, (addr), (size), (write))
+#else
+#define TRACE(ps, addr, size, write)
+#endif
 
-IMemory *ExtmemMapper::s_memory;
-uintptr_t ExtmemMapper::s_base_addr;
+template<class Mem> Mem *BasicExtmemMapper<Mem>::s_memory;
+template<class Mem> uintptr_t BasicExtmemMapper<Mem>::s_base_addr;
+template<class Mem> uint32_t BasicExtmemMapper<Mem>::s_size;
+template<class Mem> unsigned BasicExtmemMapper<Mem>::s_emulate_budget = 16;
+template<class Mem> typename BasicExtmemMapper<Mem>::Region BasicExtmemMapper<Mem>::s_regions[s_max_regions + 1];
+template<class Mem> uint8_t BasicExtmemMapper<Mem>::s_region_index[1 << (32 - s_window_bits)];
+template<class Mem> unsigned BasicExtmemMapper<Mem>::s_num_regions;
+template<class Mem> MapperStats BasicExtmemMapper<Mem>::s_stats;
 
 enum Registers {
   R0 = 0,
@@ -34,37 +51,34 @@ enum Registers {
   PC = 15,
 };
 
-struct exception_pushstack{
-  uintptr_t R4, R5, R6, R7, _LR, R0, R1, R2, R3, R12, LR, PC, XPSR;
-  static constexpr int regs_base = 12;
-  static constexpr int regs_mapping[16] = {
-    regs_base-7, // r0
-    regs_base-6, // r1
-    regs_base-5, // r2
-    regs_base-4, // r3
-    regs_base-12,// r4
-    regs_base-11,// r5
-    regs_base-10,// r6
-    regs_base-9, // r7
-    0,
-    0,
-    0,
-    0,
-    0,
-    0,
-    regs_base-2, // lr
-    regs_base-1, // pc
-  };
-} __packed;
-
-
-struct OpCodeType{
-  const char *type;
-  void (*handle)(uint16_t, exception_pushstack*);
+uintptr_t slot_get_value(uint8_t slot, exception_pushstack *ps) {
+  if (slot == DecodedOp::SP_SLOT) {
+    // the stack pointer before the exception: past the frame, and past the
+    // padding word the core inserts to 8 byte align it (XPSR bit 9)
+    return uintptr_t(ps) + (exception_pushstack::regs_base + 1 + ((ps->XPSR >> 9) & 1))*sizeof(uintptr_t);
+  }
+  return ((uintptr_t*)(ps))[slot];
+}
+
+void slot_set_value(uint8_t slot, exception_pushstack *ps, uint32_t value) {
+  ((uintptr_t*)(ps))[slot] = value;
+}
+
+
+typedef void (*Handler)(DecodedOp const&, exception_pushstack*);
+
+struct CachedOp {
+  uintptr_t pc;
+  Handler execute;
+  DecodedOp op;
 };
 
+// one per mapper type, the handlers are bound to its memory
+template<class Mem>
+static std::array<CachedOp, BasicExtmemMapper<Mem>::s_decode_cache_size> s_decode_cache;
+
 uintptr_t reg_get_value(uint8_t reg, exception_pushstack *ps) {
-  if (reg == Registers::SP) return (uintptr_t(ps)) + exception_pushstack::regs_base*sizeof(uintptr_t);
+  if (reg == Registers::SP) return slot_get_value(DecodedOp::SP_SLOT, ps);
   return ((uintptr_t*)(ps))[exception_pushstack::regs_mapping[reg]];
 }
 
@@ -72,201 +86,378 @@ void reg_set_value(uint8_t reg, exception_pushstack *ps, uint32_t value) {
   ((uintptr_t*)(ps))[exception_pushstack::regs_mapping[reg]] = value;
 }
 
-void handle_none(uint16_t, exception_pushstack*){}
+static uintptr_t op_addr(DecodedOp const &op, exception_pushstack *ps) {
+  uintptr_t offset = op.rm == DecodedOp::NO_SLOT ? op.imm : slot_get_value(op.rm, ps);
+  return slot_get_value(op.rn, ps) + offset;
+}
 
-#define DECODE_REG3(opcode) std::tuple<uint8_t, uint8_t, uint8_t>{(opcode>>6)&0b111,(opcode>>3)&0b111,(opcode>>0)&0b111}
+// The region addr falls in. Handlers for a single region skip the table, so
+// mapping more devices doesn't cost it anything.
+template<class Mem, bool multi>
+static auto const &region_of(uintptr_t addr) {
+  using Mapper = BasicExtmemMapper<Mem>;
+  if constexpr (multi) return Mapper::s_regions[Mapper::s_region_index[uint32_t(addr) >> Mapper::s_window_bits]];
+  else return Mapper::s_regions[1];
+}
 
-void handle_0101_000_store(uint16_t opcode, exception_pushstack *ps) {
-  auto [rm, rn, rt] = DECODE_REG3(opcode);
-  auto regval = reg_get_value(rt, ps);
-  uintptr_t addr = reg_get_value(rn, ps) + reg_get_value(rm, ps) - ExtmemMapper::s_base_addr;
-  ExtmemMapper::s_memory->write_dword(addr, regval);
+// Whether nbytes at offset are all inside a region of size bytes. An address
+// below the base wraps to a large offset.
+static bool in_region(uintptr_t offset, uint32_t nbytes, uint32_t size) {
+  return offset < size && size - offset >= nbytes;
 }
-void handle_0101_001_store(uint16_t opcode, exception_pushstack *ps) {
-  auto [rm, rn, rt] = DECODE_REG3(opcode);
-  auto regval = reg_get_value(rt, ps);
-  uintptr_t addr = reg_get_value(rn, ps) + reg_get_value(rm, ps) - ExtmemMapper::s_base_addr;
-  ExtmemMapper::s_memory->write_word(addr, regval);
+
+template<class Mem>
+static void unmapped_access(uintptr_t addr) {
+  EXTMEM_COUNT(BasicExtmemMapper<Mem>::s_stats.unmapped++);
+#if !PICO_EXTMEM_HOST
+  panic("extmem: access to unmapped %08x\n", addr);
+#endif
 }
-void handle_0101_010_store(uint16_t opcode, exception_pushstack *ps) {
-  auto [rm, rn, rt] = DECODE_REG3(opcode);
-  auto regval = reg_get_value(rt, ps);
-  uintptr_t addr = reg_get_value(rn, ps) + reg_get_value(rm, ps) - ExtmemMapper::s_base_addr;
-  ExtmemMapper::s_memory->write_byte(addr, regval);
+
+void execute_none(DecodedOp const&, exception_pushstack*){}
+
+// Unmapped loads read 0 and unmapped stores are dropped.
+template<class Mem, bool multi, uint8_t size, bool sign>
+void execute_load(DecodedOp const &op, exception_pushstack *ps) {
+  uintptr_t addr = op_addr(op, ps);
+  TRACE(ps, addr, size, false);
+  auto const &region = region_of<Mem, multi>(addr);
+  uintptr_t offset = addr - region.base;
+  uint32_t val = 0;
+  if (!in_region(offset, size, region.size)) {
+    unmapped_access<Mem>(addr);
+  } else if constexpr (size == 1) {
+    uint8_t v = region.memory->read_byte(offset);
+    val = sign ? uint32_t(int8_t(v)) : v;
+  } else if constexpr (size == 2) {
+    uint16_t v = region.memory->read_word(offset);
+    val = sign ? uint32_t(int16_t(v)) : v;
+  } else {
+    val = region.memory->read_dword(offset);
+  }
+  slot_set_value(op.rt, ps, val);
 }
-void handle_0101_011_load(uint16_t opcode, exception_pushstack *ps) {
-  auto [rm, rn, rt] = DECODE_REG3(opcode);
-  uintptr_t addr = reg_get_value(rn, ps) + reg_get_value(rm, ps) - ExtmemMapper::s_base_addr;
-  int8_t val = ExtmemMapper::s_memory->read_byte(addr);
-  reg_set_value(rt, ps, val);
+
+template<class Mem, bool multi, uint8_t size>
+void execute_store(DecodedOp const &op, exception_pushstack *ps) {
+  uintptr_t addr = op_addr(op, ps);
+  TRACE(ps, addr, size, true);
+  auto const &region = region_of<Mem, multi>(addr);
+  uintptr_t offset = addr - region.base;
+  auto regval = slot_get_value(op.rt, ps);
+  if (!in_region(offset, size, region.size)) unmapped_access<Mem>(addr);
+  else if constexpr (size == 1) region.memory->write_byte(offset, regval);
+  else if constexpr (size == 2) region.memory->write_word(offset, regval);
+  else region.memory->write_dword(offset, regval);
 }
-void handle_0101_100_load(uint16_t opcode, exception_pushstack *ps) {
-  auto [rm, rn, rt] = DECODE_REG3(opcode);
-  uintptr_t addr = reg_get_value(rn, ps) + reg_get_value(rm, ps) - ExtmemMapper::s_base_addr;
-  uint32_t val = ExtmemMapper::s_memory->read_dword(addr);
-  reg_set_value(rt, ps, val);
+
+// LDM/STM move the whole register list as one block, lowest register at
+// the lowest address
+template<class Mem, bool multi>
+void execute_stm(DecodedOp const &op, exception_pushstack *ps) {
+  uint32_t block[8];
+  unsigned n = 0;
+  for (uint8_t i = 0; i < 8; i++) {
+    if (op.reglist & (1 << i)) block[n++] = reg_get_value(i, ps);
+  }
+  uintptr_t base = slot_get_value(op.rn, ps);
+  TRACE(ps, base, op.size, true);
+  auto const &region = region_of<Mem, multi>(base);
+  uintptr_t offset = base - region.base;
+  if (in_region(offset, op.size, region.size)) region.memory->write_data(offset, op.size, (uint8_t*)block);
+  else unmapped_access<Mem>(base);
+  slot_set_value(op.rn, ps, base + op.size);
 }
-void handle_0101_101_load(uint16_t opcode, exception_pushstack *ps) {
-  auto [rm, rn, rt] = DECODE_REG3(opcode);
-  uintptr_t addr = reg_get_value(rn, ps) + reg_get_value(rm, ps) - ExtmemMapper::s_base_addr;
-  uint16_t val = ExtmemMapper::s_memory->read_word(addr);
-  reg_set_value(rt, ps, val);
+
+template<class Mem, bool multi>
+void execute_ldm(DecodedOp const &op, exception_pushstack *ps) {
+  uint32_t block[8] = {};
+  uintptr_t base = slot_get_value(op.rn, ps);
+  TRACE(ps, base, op.size, false);
+  auto const &region = region_of<Mem, multi>(base);
+  uintptr_t offset = base - region.base;
+  if (in_region(offset, op.size, region.size)) region.memory->read_data(offset, op.size, (uint8_t*)block);
+  else unmapped_access<Mem>(base);
+  if (op.writeback) slot_set_value(op.rn, ps, base + op.size);
+  unsigned n = 0;
+  for (uint8_t i = 0; i < 8; i++) {
+    if (op.reglist & (1 << i)) reg_set_value(i, ps, block[n++]);
   }
-void handle_0101_110_load(uint16_t opcode, exception_pushstack *ps) {
-  auto [rm, rn, rt] = DECODE_REG3(opcode);
-  uintptr_t addr = reg_get_value(rn, ps) + reg_get_value(rm, ps) - ExtmemMapper::s_base_addr;
-  uint8_t val = ExtmemMapper::s_memory->read_byte(addr);
-  reg_set_value(rt, ps, val);
-      }
-void handle_0101_111_load(uint16_t opcode, exception_pushstack *ps) {
-  auto [rm, rn, rt] = DECODE_REG3(opcode);
-  uintptr_t addr = reg_get_value(rn, ps) + reg_get_value(rm, ps) - ExtmemMapper::s_base_addr;
-  int16_t val = ExtmemMapper::s_memory->read_word(addr);
-  reg_set_value(rt, ps, val);
 }
-#define DECODE_IMM5_REG2(opcode) std::tuple<uint8_t, uint8_t, uint8_t>{(opcode>>6)&0b11111,(opcode>>3)&0b111,(opcode>>0)&0b111}
-void handle_0110_0xx_store(uint16_t opcode, exception_pushstack *ps) {
-  auto [imm5, rn, rt] = DECODE_IMM5_REG2(opcode);
-  uintptr_t addr = reg_get_value(rn, ps) + imm5 - ExtmemMapper::s_base_addr;
-  auto regval = reg_get_value(rt, ps);
-  ExtmemMapper::s_memory->write_dword(addr, regval);
+
+enum Flags : uint32_t {
+  FLAG_N = 1u << 31,
+  FLAG_Z = 1u << 30,
+  FLAG_C = 1u << 29,
+  FLAG_V = 1u << 28,
+};
+
+static uint32_t add_with_carry(uint32_t x, uint32_t y, bool carry_in, uint32_t &flags) {
+  uint64_t usum = uint64_t(x) + y + carry_in;
+  uint32_t result = usum;
+  flags |= (usum >> 32) ? FLAG_C : 0;
+  flags |= (~(x ^ y) & (x ^ result)) >> 31 ? FLAG_V : 0;
+  return result;
 }
-void handle_0110_1xx_load(uint16_t opcode, exception_pushstack *ps) {
-  auto [imm5, rn, rt] = DECODE_IMM5_REG2(opcode);
-  uintptr_t addr = reg_get_value(rn, ps) + imm5 - ExtmemMapper::s_base_addr;
-  auto val = ExtmemMapper::s_memory->read_dword(addr);
-  reg_set_value(rt, ps, val);
+
+// shifts by 0 leave the value and carry alone
+template<DecodedOp::Alu alu>
+static uint32_t shift(uint32_t value, uint32_t n, uint32_t &flags, bool carry_in) {
+  bool carry = carry_in;
+  if (n == 0) {
+  } else if (alu == DecodedOp::LSL) {
+    carry = n <= 32 && ((uint64_t(value) << n) >> 32) & 1;
+    value = n < 32 ? value << n : 0;
+  } else if (alu == DecodedOp::LSR) {
+    carry = n <= 32 && (value >> (n-1)) & 1;
+    value = n < 32 ? value >> n : 0;
+  } else if (alu == DecodedOp::ASR) {
+    n = n < 32 ? n : 32;
+    carry = (int64_t(int32_t(value)) >> (n-1)) & 1;
+    value = uint32_t(int64_t(int32_t(value)) >> n);
+  } else {
+    n %= 32;
+    if (n) value = (value >> n) | (value << (32-n));
+    carry = value >> 31;
+  }
+  flags |= carry ? FLAG_C : 0;
+  return value;
 }
-void handle_0111_0xx_store(uint16_t opcode, exception_pushstack *ps) {
-  auto [imm5, rn, rt] = DECODE_IMM5_REG2(opcode);
-  uintptr_t addr = reg_get_value(rn, ps) + imm5 - ExtmemMapper::s_base_addr;
-  auto regval = reg_get_value(rt, ps);
-  ExtmemMapper::s_memory->write_byte(addr, regval);
+
+template<DecodedOp::Alu alu>
+void execute_alu(DecodedOp const &op, exception_pushstack *ps) {
+  using A = DecodedOp::Alu;
+  uint32_t a = slot_get_value(op.rn, ps);
+  uint32_t b = op.rm == DecodedOp::NO_SLOT ? uint32_t(op.imm) : uint32_t(slot_get_value(op.rm, ps));
+  uint32_t xpsr = ps->XPSR;
+  bool carry_in = xpsr & FLAG_C;
+  // N and Z always follow the result; C and V are kept unless set below
+  uint32_t flags = 0, kept = FLAG_C | FLAG_V;
+  uint32_t result;
+  if constexpr (alu == A::MOV) result = b;
+  else if constexpr (alu == A::MVN) result = ~b;
+  else if constexpr (alu == A::AND || alu == A::TST) result = a & b;
+  else if constexpr (alu == A::EOR) result = a ^ b;
+  else if constexpr (alu == A::ORR) result = a | b;
+  else if constexpr (alu == A::BIC) result = a & ~b;
+  else if constexpr (alu == A::MUL) result = a * b;
+  else if constexpr (alu == A::LSL || alu == A::LSR || alu == A::ASR || alu == A::ROR) {
+    // by register only the bottom byte counts
+    uint32_t n = op.rm == DecodedOp::NO_SLOT ? b : b & 0xff;
+    result = shift<alu>(a, n, flags, carry_in);
+    kept = FLAG_V;
+  } else {
+    if constexpr (alu == A::ADD || alu == A::CMN) result = add_with_carry(a, b, false, flags);
+    else if constexpr (alu == A::ADC) result = add_with_carry(a, b, carry_in, flags);
+    else if constexpr (alu == A::SUB || alu == A::CMP) result = add_with_carry(a, ~b, true, flags);
+    else if constexpr (alu == A::SBC) result = add_with_carry(a, ~b, carry_in, flags);
+    else result = add_with_carry(0, ~b, true, flags); // NEG
+    kept = 0;
+  }
+  flags |= (result & (1u << 31)) ? FLAG_N : 0;
+  flags |= result == 0 ? FLAG_Z : 0;
+  ps->XPSR = (xpsr & ~(FLAG_N | FLAG_Z | FLAG_C | FLAG_V)) | (xpsr & kept) | flags;
+  if (op.rt != DecodedOp::NO_SLOT) slot_set_value(op.rt, ps, result);
 }
-void handle_0111_1xx_load(uint16_t opcode, exception_pushstack *ps) {
-  auto [imm5, rn, rt] = DECODE_IMM5_REG2(opcode);
-  uintptr_t addr = reg_get_value(rn, ps) + imm5 - ExtmemMapper::s_base_addr;
-  auto val = ExtmemMapper::s_memory->read_byte(addr);
-  reg_set_value(rt, ps, val);
+
+static bool condition_passed(uint8_t cond, uint32_t xpsr) {
+  bool n = xpsr & FLAG_N, z = xpsr & FLAG_Z, c = xpsr & FLAG_C, v = xpsr & FLAG_V;
+  bool result;
+  switch (cond >> 1) {
+    case 0: result = z; break;            // eq
+    case 1: result = c; break;            // cs
+    case 2: result = n; break;            // mi
+    case 3: result = v; break;            // vs
+    case 4: result = c && !z; break;      // hi
+    case 5: result = n == v; break;       // ge
+    case 6: result = n == v && !z; break; // gt
+    default: return true;                 // al
+  }
+  return (cond & 1) ? !result : result;
 }
-void handle_1000_0xx_store(uint16_t opcode, exception_pushstack *ps) {
-  auto [imm5, rn, rt] = DECODE_IMM5_REG2(opcode);
-  uintptr_t addr = reg_get_value(rn, ps) + imm5 - ExtmemMapper::s_base_addr;
-  auto regval = reg_get_value(rt, ps);
-  ExtmemMapper::s_memory->write_word(addr, regval);
+
+void execute_branch(DecodedOp const &op, exception_pushstack *ps) {
+  if (condition_passed(op.cond, ps->XPSR)) ps->PC += op.imm;
 }
-void handle_1000_1xx_load(uint16_t opcode, exception_pushstack *ps) {
-  auto [imm5, rn, rt] = DECODE_IMM5_REG2(opcode);
-  uintptr_t addr = reg_get_value(rn, ps) + imm5 - ExtmemMapper::s_base_addr;
-  auto val = ExtmemMapper::s_memory->read_word(addr);
-  reg_set_value(rt, ps, val);
+
+static constexpr Handler alu_handlers[DecodedOp::NUM_ALU] = {
+  execute_alu<DecodedOp::MOV>, execute_alu<DecodedOp::MVN>, execute_alu<DecodedOp::AND>,
+  execute_alu<DecodedOp::EOR>, execute_alu<DecodedOp::ORR>, execute_alu<DecodedOp::BIC>,
+  execute_alu<DecodedOp::TST>, execute_alu<DecodedOp::ADD>, execute_alu<DecodedOp::ADC>,
+  execute_alu<DecodedOp::SUB>, execute_alu<DecodedOp::SBC>, execute_alu<DecodedOp::NEG>,
+  execute_alu<DecodedOp::CMP>, execute_alu<DecodedOp::CMN>, execute_alu<DecodedOp::MUL>,
+  execute_alu<DecodedOp::LSL>, execute_alu<DecodedOp::LSR>, execute_alu<DecodedOp::ASR>,
+  execute_alu<DecodedOp::ROR>,
+};
+
+template<class Mem, bool multi>
+static Handler select_handler(DecodedOp const &op) {
+  switch (op.kind) {
+    case DecodedOp::LOAD:
+      if (op.size == 4) return execute_load<Mem, multi, 4, false>;
+      if (op.size == 2) return op.sign ? execute_load<Mem, multi, 2, true> : execute_load<Mem, multi, 2, false>;
+      return op.sign ? execute_load<Mem, multi, 1, true> : execute_load<Mem, multi, 1, false>;
+    case DecodedOp::STORE:
+      if (op.size == 4) return execute_store<Mem, multi, 4>;
+      if (op.size == 2) return execute_store<Mem, multi, 2>;
+      return execute_store<Mem, multi, 1>;
+    case DecodedOp::LOAD_MULTIPLE: return execute_ldm<Mem, multi>;
+    case DecodedOp::STORE_MULTIPLE: return execute_stm<Mem, multi>;
+    case DecodedOp::ALU: return alu_handlers[op.alu];
+    case DecodedOp::BRANCH: return execute_branch;
+    default: return execute_none;
+  }
 }
-#define DECODE_REG_IMM8(opcode) std::tuple<uint8_t, uint8_t>{(opcode>>8)&0b111, opcode&0xff}
-void handle_1001_0xx_store(uint16_t opcode, exception_pushstack *ps) {
-  auto [rt, imm8] = DECODE_REG_IMM8(opcode);
-  uintptr_t addr = reg_get_value(Registers::SP, ps) + imm8 - ExtmemMapper::s_base_addr;
-  auto regval = reg_get_value(rt, ps);
-  ExtmemMapper::s_memory->write_dword(addr, regval);
+
+// map() flushes the decode cache, so cached handlers always match the
+// current number of regions
+template<class Mem>
+static Handler select_handler(DecodedOp const &op) {
+  if (BasicExtmemMapper<Mem>::s_num_regions > 1) return select_handler<Mem, true>(op);
+  return select_handler<Mem, false>(op);
 }
-void handle_1001_1xx_load(uint16_t opcode, exception_pushstack *ps) {
-  auto [rt, imm8] = DECODE_REG_IMM8(opcode);
-  uintptr_t addr = reg_get_value(Registers::SP, ps) + imm8 - ExtmemMapper::s_base_addr;
-  auto val = ExtmemMapper::s_memory->read_dword(addr);
-  reg_set_value(rt, ps, val);
+
+template<class Mem>
+static bool mapped(uintptr_t addr, uint32_t nbytes) {
+  using Mapper = BasicExtmemMapper<Mem>;
+  auto const &region = Mapper::s_num_regions > 1 ? region_of<Mem, true>(addr) : region_of<Mem, false>(addr);
+  return in_region(addr - region.base, nbytes, region.size);
 }
 
-#define DECODE_REG_REGS DECODE_REG_IMM8
-void handle_1100_0xx_stm(uint16_t opcode, exception_pushstack *ps) {
-  auto [rn, regs] = DECODE_REG_REGS(opcode);
-  auto addr = reg_get_value(rn, ps);
-  for (uint8_t i = 0; i < 8; i++) {
-    if (regs & 1) {
-      ExtmemMapper::s_memory->write_dword(addr, reg_get_value(i, ps));
-      addr += 4;
-    }
-    regs >>= 1;
+// Whether the instruction after an emulated one can be emulated too: ALU ops
+// and branches always, accesses when they hit external memory. Anything else
+// is left for the core.
+template<class Mem>
+static bool can_continue(DecodedOp const &op, exception_pushstack *ps) {
+  switch (op.kind) {
+    case DecodedOp::ALU:
+    case DecodedOp::BRANCH:
+      return true;
+    case DecodedOp::LOAD:
+    case DecodedOp::STORE:
+      return mapped<Mem>(op_addr(op, ps), op.size);
+    case DecodedOp::LOAD_MULTIPLE:
+    case DecodedOp::STORE_MULTIPLE:
+      return mapped<Mem>(slot_get_value(op.rn, ps), op.size);
+    default:
+      return false;
   }
-  reg_set_value(rn, ps, addr);
 }
-void handle_1100_1xx_ldm(uint16_t opcode, exception_pushstack *ps) {
-  auto [rn, regs] = DECODE_REG_REGS(opcode);
-  auto addr = reg_get_value(rn, ps);
-  for (uint8_t i = 0; i < 8; i++) {
-    if (regs & 1) {
-      auto val = ExtmemMapper::s_memory->read_dword(addr);
-      reg_set_value(i, ps, val);
-      addr += 4;
-    }
-    regs >>= 1;
+
+template<class Mem>
+static CachedOp &decode_cached(uintptr_t pc) {
+  using Mapper = BasicExtmemMapper<Mem>;
+  auto &entry = s_decode_cache<Mem>[(pc >> 1) % Mapper::s_decode_cache_size];
+  if (entry.pc != pc) {
+    entry.op = thumb_decode(*(uint16_t*)pc);
+    entry.execute = select_handler<Mem>(entry.op);
+    entry.pc = pc;
+    EXTMEM_COUNT(Mapper::s_stats.decode_misses++);
+  } else {
+    EXTMEM_COUNT(Mapper::s_stats.decode_hits++);
   }
-  reg_set_value(rn, ps, addr);
+  return entry;
 }
 
-constexpr auto construct_opcode_table(){
-  std::array<OpCodeType, 128> out{};
-  for (auto &e : out) {
-    e.handle = handle_none;
-    e.type = "NONE";
+template<class Mem>
+void BasicExtmemMapper<Mem>::emulate(exception_pushstack *ps) {
+  // the faulting instruction, then what follows while it can be emulated
+  EXTMEM_COUNT(s_stats.faults++);
+  CachedOp *entry = &decode_cached<Mem>(ps->PC);
+  for (unsigned n = 1;; n++) {
+    // handlers see the PC of the next instruction
+    ps->PC += 2;
+    EXTMEM_COUNT(s_stats.ops[entry->op.kind]++);
+    entry->execute(entry->op, ps);
+    if (n >= s_emulate_budget) break;
+    entry = &decode_cached<Mem>(ps->PC);
+    if (!can_continue<Mem>(entry->op, ps)) break;
   }
+}
 
-  out[0b0101'000] = OpCodeType{"Store Register", &handle_0101_000_store};
-  out[0b0101'001] = OpCodeType{"Store Register Halfword", &handle_0101_001_store};
-  out[0b0101'010] = OpCodeType{"Store Register Byte", &handle_0101_010_store};
-  out[0b0101'011] = OpCodeType{"Load Register Signed Byte", &handle_0101_011_load};
-  out[0b0101'100] = OpCodeType{"Load Register", &handle_0101_100_load};
-  out[0b0101'101] = OpCodeType{"Load Register Halword", &handle_0101_101_load};
-  out[0b0101'110] = OpCodeType{"Load Register Byte", &handle_0101_110_load};
-  out[0b0101'111] = OpCodeType{"Load Register Signed Halfword", &handle_0101_111_load};
-  for (int i = 0b0110'000; i <= 0b0110'011; i++) out[i] = OpCodeType{"Store Register", &handle_0110_0xx_store};
-  for (int i = 0b0110'100; i <= 0b0110'111; i++) out[i] = OpCodeType{"Load Register", &handle_0110_1xx_load};
-  for (int i = 0b0111'000; i <= 0b0111'011; i++) out[i] = OpCodeType{"Store Register Byte", &handle_0111_0xx_store};
-  for (int i = 0b0111'100; i <= 0b0111'111; i++) out[i] = OpCodeType{"Load Register Byte", &handle_0111_1xx_load};
-  for (int i = 0b1000'000; i <= 0b1000'011; i++) out[i] = OpCodeType{"Store Register Halfword", &handle_1000_0xx_store};
-  for (int i = 0b1000'100; i <= 0b1000'111; i++) out[i] = OpCodeType{"Load Register Halfword", &handle_1000_1xx_load};
-  for (int i = 0b1001'000; i <= 0b1001'011; i++) out[i] = OpCodeType{"Store Register", &handle_1001_0xx_store};
-  for (int i = 0b1001'100; i <= 0b1001'111; i++) out[i] = OpCodeType{"Load Register", &handle_1001_1xx_load};
-  
-  for (int i = 0b1100'000; i <= 0b1100'011; i++) {
-    out[i] = OpCodeType{"Store Multiple", handle_1100_0xx_stm};
-  }
-  for (int i = 0b1100'100; i <= 0b1100'111; i++) {
-    out[i] = OpCodeType{"Load Multiple", handle_1100_1xx_ldm};
-  }
-  return out;
+template<class Mem>
+void BasicExtmemMapper<Mem>::emulate_uncached(exception_pushstack *ps) {
+  DecodedOp op = thumb_decode(*(uint16_t*)ps->PC);
+  EXTMEM_COUNT(s_stats.faults++);
+  EXTMEM_COUNT(s_stats.ops[op.kind]++);
+  ps->PC += 2;
+  select_handler<Mem>(op)(op, ps);
+}
+
+template<class Mem>
+void BasicExtmemMapper<Mem>::flush_decode_cache() {
+  for (auto &entry : s_decode_cache<Mem>) entry.pc = ~uintptr_t(0);
 }
 
-auto opcode_types = construct_opcode_table();
+void print_mapper_stats(const char *desc, MapperStats const &s) {
+  static const char *const kinds[DecodedOp::NUM_KINDS] = {"other", "ldr", "str", "ldm", "stm", "alu", "branch"};
+  uint32_t decodes = s.decode_hits + s.decode_misses;
+  printf("MAPPER (%s): %u faults, %u decode hits (%.2f%%), %u unmapped;", desc, s.faults, s.decode_hits,
+         decodes ? 100.f*s.decode_hits/decodes : 0.f, s.unmapped);
+  for (unsigned kind = 0; kind < DecodedOp::NUM_KINDS; kind++) printf(" %s %u", kinds[kind], s.ops[kind]);
+  printf("\n");
+}
 
+#if !PICO_EXTMEM_HOST
+// emulate() of the mapper last initialised
+extern "C" void (*extmem_mapper_emulate)(exception_pushstack *ps);
+void (*extmem_mapper_emulate)(exception_pushstack *ps);
 
 __attribute__((naked))
-void ExtmemMapper::hardfault_handler(void) {
+static void hardfault_handler(void) {
 
   asm volatile(
-    "mov r0, sp\n\t"
-    "ldr r0, [r0, #24]\n\t"             // get PC from stack
-    "eor r1, r1, r1\n\t"                // clear r1
-    "ldrh r0, [r0, r1]\n\t"             // get instruction from pc
     "push {r4, r5, r6, r7, lr}\n\t"     // save regs
-    "mov r1, sp\n\t"                    // second function parameter
-    "lsr r2, r0, #9 \n\t"               // opcode >> 9
-    "lsl r2, r2, #3 \n\t"               // index (*sizeof OpCodeType)
-    "add r3, r3, r2\n\t"                // optype+index
-    "ldr r3, [r3, #4]\n\t"              // handler = optype[index].handle
-    "blx r3\n\t"                        // (*handler)()
+    "mov r0, sp\n\t"                    // exception_pushstack
+    "ldr r3, 1f\n\t"
+    "ldr r3, [r3]\n\t"                  // extmem_mapper_emulate
+    "blx r3\n\t"                        // emulate and step past the instructions
     "pop {r4, r5, r6, r7} \n\t"         // restore regs
     "pop {r0}\n\t"                      // pop pc without return
-    "ldr r2, [sp, #24]\n\t"             // get PC address from stack
-    "add r2, r2, #2\n\t"                // increment PC
-    "str r2, [sp, #24]\n\t"             // writeback PC
-    "bx r0"                             // return
-    :: "r"(&opcode_types)
+    "bx r0\n\t"                         // return
+    ".align 2\n"
+    "1: .word extmem_mapper_emulate"
   );
 }
+#endif
 
+template<class Mem>
+void BasicExtmemMapper<Mem>::init(Mem *memory, uintptr_t base)
+{
+  s_num_regions = 0;
+  for (auto &index : s_region_index) index = 0;
+  map(memory, base);
+}
 
-void ExtmemMapper::init(IMemory *memory, uintptr_t base)
+template<class Mem>
+bool BasicExtmemMapper<Mem>::map(Mem *memory, uintptr_t base, uint32_t size)
 {
-  s_memory = memory;
-  s_base_addr = base;
+  if (!size) size = memory->size_bytes();
+  uintptr_t last = base + (size - 1);
+  if (s_num_regions == s_max_regions || !size || last < base || last > UINT32_MAX) return false;
+  for (uintptr_t window = base >> s_window_bits; window <= last >> s_window_bits; window++) {
+    if (s_region_index[window]) return false;
+  }
+  s_regions[++s_num_regions] = {memory, base, size};
+  for (uintptr_t window = base >> s_window_bits; window <= last >> s_window_bits; window++) {
+    s_region_index[window] = s_num_regions;
+  }
+  if (s_num_regions == 1) {
+    s_memory = memory;
+    s_base_addr = base;
+    s_size = size;
+  }
+  flush_decode_cache();
+#if !PICO_EXTMEM_HOST
+  extmem_mapper_emulate = emulate;
   exception_set_exclusive_handler(HARDFAULT_EXCEPTION, hardfault_handler);
+#endif
+  return true;
+}
+
+template<class Mem>
+typename BasicExtmemMapper<Mem>::Region const *BasicExtmemMapper<Mem>::lookup(uintptr_t addr)
+{
+  Region const &region = s_regions[s_region_index[uint32_t(addr) >> s_window_bits]];
+  return in_region(addr - region.base, 1, region.size) ? &region : nullptr;
 }
\ No newline at end of file
@@ -0,0 +1,51 @@
+#include "extmem_trace.hpp"
+#include <cinttypes>
+
+bool ExtmemTracer::s_running;
+TraceRecord *ExtmemTracer::s_buffer;
+uint32_t ExtmemTracer::s_capacity;
+uint32_t ExtmemTracer::s_head;
+uint32_t ExtmemTracer::s_total;
+
+void ExtmemTracer::start(TraceRecord *buffer, uint32_t capacity) {
+  s_running = false;
+  s_buffer = buffer;
+  s_capacity = capacity;
+  s_head = 0;
+  s_total = 0;
+  s_running = buffer && capacity;
+}
+
+uint32_t ExtmemTracer::read(TraceRecord *out, uint32_t max) {
+  uint32_t n = size() < max ? size() : max;
+  uint32_t index = s_total < s_capacity ? 0 : s_head;
+  for (uint32_t i = 0; i < n; i++) {
+    out[i] = s_buffer[index];
+    if (++index == s_capacity) index = 0;
+  }
+  return n;
+}
+
+void ExtmemTracer::print(FILE *out) {
+  // nothing is recorded while printing
+  bool running = s_running;
+  s_running = false;
+  uint32_t n = size();
+  uint32_t index = s_total < s_capacity ? 0 : s_head;
+  for (uint32_t i = 0; i < n; i++) {
+    TraceRecord const &r = s_buffer[index];
+    fprintf(out, "T %08" PRIx32 " %08" PRIx32 " %u %c\n", r.pc, r.addr, unsigned(r.size), r.write ? 'W' : 'R');
+    if (++index == s_capacity) index = 0;
+  }
+  s_running = running;
+}
+
+bool ExtmemTracer::parse(const char *line, TraceRecord &record) {
+  uint32_t pc, addr;
+  unsigned size;
+  char op;
+  if (sscanf(line, " T %" SCNx32 " %" SCNx32 " %u %c", &pc, &addr, &size, &op) != 4) return false;
+  if (op != 'R' && op != 'W') return false;
+  record = {pc, addr, uint16_t(size), op == 'W', 0};
+  return true;
+}
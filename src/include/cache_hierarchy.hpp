@@ -0,0 +1,192 @@
+#pragma once
+
+#include "mem_interface.hpp"
+#include "cache_policy.hpp"
+#include "cached_memory.hpp"
+#include <array>
+
+enum class HierarchyMode : uint8_t { INCLUSIVE, EXCLUSIVE };
+
+// Counted while PICO_EXTMEM_STATS is on. L1 keeps its own CacheStats for the
+// accesses that reach it; its misses are the fetches from the backing memory.
+struct HierarchyStats {
+  uint32_t l0_hits;
+  uint32_t l0_misses;           // passed on to L1
+  uint32_t l0_fills;            // lines copied up from L1 (inclusive) or taken as L1 victims (exclusive)
+  uint32_t l0_evictions;
+  uint32_t l0_writebacks;       // dirty lines written down: into L1 (inclusive) or the backing memory (exclusive)
+  uint32_t back_invalidations;  // inclusive: lines dropped because L1 evicted them
+};
+void print_hierarchy_stats(const char *desc, HierarchyStats const &stats);
+
+// A small fully associative L0 of nl0 lines in front of a CachedMemory L1,
+// sharing its line size and sectors.
+//
+// INCLUSIVE: L0 holds copies of L1 lines. A single access that misses copies
+// the line up; dirty L0 lines are written into L1 when evicted, and a line L1
+// evicts is dropped from L0 with its dirty sectors merged into L1's
+// write-back, so each dirty line reaches the backing memory once, from L1.
+//
+// EXCLUSIVE: L0 is a victim buffer. Lines L1 evicts move to L0 instead of
+// being written back and are served from there, so a line conflicting out of
+// its L1 set is still a hit. A line is in one level or the other; L0 writes
+// its own dirty lines back to the backing memory when it evicts them.
+//
+// read_data/write_data use lines already in L0 but never bring lines into
+// it, so bulk copies don't flush it. The hierarchy takes over L1's evict
+// hook; go through the hierarchy, not L1, from then on.
+template<unsigned int nl0, class L1, HierarchyMode mode = HierarchyMode::EXCLUSIVE>
+class CacheHierarchy final : public IMemory {
+public:
+  using sector_mask_t = typename L1::sector_mask_t;
+  static constexpr unsigned int s_num_l0_lines = nl0;
+  static constexpr unsigned int s_cache_line_size = L1::s_cache_line_size;
+  static constexpr HierarchyMode s_mode = mode;
+
+  static_assert(nl0 > 0 && (nl0 & (nl0-1)) == 0 && nl0 <= 64, "L0 lines must be a power of 2 up to 64");
+
+  CacheHierarchy(L1 *l1);
+  ~CacheHierarchy();
+
+  uint8_t read_byte(uintptr_t addr) final override { return read<uint8_t>(addr); }
+  uint16_t read_word(uintptr_t addr) final override { return read<uint16_t>(addr); }
+  uint32_t read_dword(uintptr_t addr) final override { return read<uint32_t>(addr); }
+  void read_data(uintptr_t addr, uint32_t nbytes, uint8_t *data) final override;
+
+  void write_byte(uintptr_t addr, uint8_t value) final override { write<uint8_t>(addr, value); }
+  void write_word(uintptr_t addr, uint16_t value) final override { write<uint16_t>(addr, value); }
+  void write_dword(uintptr_t addr, uint32_t value) final override { write<uint32_t>(addr, value); }
+  void write_data(uintptr_t addr, uint32_t nbytes, uint8_t const *data) final override;
+  void zero_data(uintptr_t addr, uint32_t nbytes) final override;
+
+  uint32_t max_read() const final override { return m_l1->max_read(); }
+  uint32_t max_write() const final override { return m_l1->max_write(); }
+
+  uint32_t size_bytes() const final override { return m_l1->size_bytes(); }
+
+  // empties L0 into L1, then flushes L1
+  void flush() final override;
+
+  L1 &l1() { return *m_l1; }
+  HierarchyStats &stats() { return m_stats; }
+  void reset_stats() { m_stats = {}; }
+
+private:
+  static constexpr unsigned int s_line_mask = s_cache_line_size-1;
+  static constexpr unsigned int s_sector_size_pow2 = L1::s_sector_size_pow2;
+  static constexpr unsigned int s_sector_size = L1::s_sector_size;
+  static constexpr unsigned int s_num_sectors = L1::s_num_sectors;
+  static constexpr sector_mask_t s_all_sectors = L1::s_all_sectors;
+  static constexpr unsigned int NONE = -1;
+  static constexpr uintptr_t INVALID_TAG = -1;
+
+  L1 *const m_l1;
+
+  alignas(uint64_t) std::array<
+    std::array<uint8_t, s_cache_line_size>,
+    nl0
+  > m_lines;
+  std::array<uintptr_t, nl0> m_tags;
+  std::array<sector_mask_t, nl0> m_valid;
+  std::array<sector_mask_t, nl0> m_dirty;
+  typename LruPolicy::template Set<nl0> m_lru;
+  HierarchyStats m_stats;
+
+  static sector_mask_t sector_mask(unsigned int offset, unsigned int nbytes) {
+    unsigned int first = offset>>s_sector_size_pow2;
+    unsigned int last = (offset+nbytes-1)>>s_sector_size_pow2;
+    return (sector_mask_t(-1)>>(31-last+first))<<first;
+  }
+  static sector_mask_t full_sector_mask(unsigned int offset, unsigned int nbytes) {
+    unsigned int first = (offset+s_sector_size-1)>>s_sector_size_pow2;
+    unsigned int end = (offset+nbytes)>>s_sector_size_pow2;
+    if (end <= first) return 0;
+    return (sector_mask_t(-1)>>(32-end+first))<<first;
+  }
+
+  // calls f(first, count) for each run of contiguous sectors in mask
+  template<class F>
+  static void for_each_sector_run(sector_mask_t mask, F &&f) {
+    while (mask) {
+      unsigned int first = __builtin_ctz(mask);
+      sector_mask_t rest = ~(mask>>first);
+      unsigned int count = rest ? __builtin_ctz(rest) : s_num_sectors;
+      f(first, count);
+      mask &= ~sector_mask(first<<s_sector_size_pow2, count<<s_sector_size_pow2);
+    }
+  }
+
+  unsigned int lookup(uintptr_t tag) const {
+    for (unsigned int i = 0; i < nl0; i++) {
+      if (m_tags[i] == tag) return i;
+    }
+    return NONE;
+  }
+
+  // The L0 line to read or write nbytes at addr in, or NONE to go to L1.
+  // A line whose partly written or read sectors aren't valid is evicted.
+  unsigned int l0_line(uintptr_t addr, unsigned int nbytes, bool write, bool allocate) {
+    uintptr_t tag = addr&~uintptr_t(s_line_mask);
+    unsigned int offset = addr&s_line_mask;
+    unsigned int i = lookup(tag);
+    if (i != NONE) {
+      sector_mask_t needed = sector_mask(offset, nbytes);
+      if (write) needed &= ~full_sector_mask(offset, nbytes);
+      if ((m_valid[i] & needed) == needed) {
+        EXTMEM_COUNT(m_stats.l0_hits++);
+        m_lru.touch(i);
+        return i;
+      }
+      evict(i);
+    }
+    EXTMEM_COUNT(m_stats.l0_misses++);
+    if (mode == HierarchyMode::EXCLUSIVE || !allocate) return NONE;
+    return fill(tag);
+  }
+
+  template<class T>
+  T read(uintptr_t addr) {
+    if ((addr&s_line_mask) + sizeof(T) > s_cache_line_size) {
+      T value;
+      read_data(addr, sizeof(T), (uint8_t*)&value);
+      return value;
+    }
+    unsigned int i = l0_line(addr, sizeof(T), false, true);
+    if (i == NONE) {
+      if constexpr (sizeof(T) == 1) return m_l1->read_byte(addr);
+      else if constexpr (sizeof(T) == 2) return m_l1->read_word(addr);
+      else return m_l1->read_dword(addr);
+    }
+    return *(T*)&m_lines[i][addr&s_line_mask];
+  }
+
+  template<class T>
+  void write(uintptr_t addr, T value) {
+    unsigned int offset = addr&s_line_mask;
+    if (offset + sizeof(T) > s_cache_line_size) {
+      write_data(addr, sizeof(T), (uint8_t const*)&value);
+      return;
+    }
+    unsigned int i = l0_line(addr, sizeof(T), true, true);
+    if (i == NONE) {
+      if constexpr (sizeof(T) == 1) m_l1->write_byte(addr, value);
+      else if constexpr (sizeof(T) == 2) m_l1->write_word(addr, value);
+      else m_l1->write_dword(addr, value);
+      return;
+    }
+    *(T*)&m_lines[i][offset] = value;
+    sector_mask_t written = sector_mask(offset, sizeof(T));
+    m_valid[i] |= written;
+    m_dirty[i] |= written;
+  }
+
+  unsigned int allocate();
+  unsigned int fill(uintptr_t tag);
+  void evict(unsigned int i);
+  static bool l1_evicted(void *ctx, uintptr_t addr, uint8_t *data, sector_mask_t valid, sector_mask_t &dirty);
+};
+
+TPL_USING(L0_8_Cached_32_32, CacheHierarchy, 8, Cached_32_32, HierarchyMode::INCLUSIVE);
+TPL_USING(VB_8_Cached_32_32, CacheHierarchy, 8, Cached_32_32, HierarchyMode::EXCLUSIVE);
+TPL_USING(VB_4_Cached_32_32, CacheHierarchy, 4, Cached_32_32, HierarchyMode::EXCLUSIVE);
+TPL_USING(VB_8_Cached_64_32, CacheHierarchy, 8, Cached_64_32, HierarchyMode::EXCLUSIVE);
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <stdint.h>
+#include <array>
+
+// Replacement policies for CachedMemory. Each policy provides per-set state
+// Set<nways> with:
+//   void touch(unsigned way)  - way was just hit or filled
+//   unsigned victim()         - way to evict next
+
+// Evict ways in sequence, ignoring use.
+struct RoundRobinPolicy {
+  template<unsigned int nways>
+  struct Set {
+    uint8_t next = 0;
+
+    void touch(unsigned int) {}
+    unsigned int victim() {
+      unsigned int way = next;
+      next = (next+1)&(nways-1);
+      return way;
+    }
+  };
+};
+
+// True least recently used: each way holds its age rank, 0 being most recent.
+struct LruPolicy {
+  template<unsigned int nways>
+  struct Set {
+    std::array<uint8_t, nways> age;
+
+    Set() { for (unsigned int i = 0; i < nways; i++) age[i] = i; }
+
+    void touch(unsigned int way) {
+      uint8_t a = age[way];
+      for (auto &e : age) {
+        if (e < a) e++;
+      }
+      age[way] = 0;
+    }
+    unsigned int victim() {
+      for (unsigned int i = 0; i < nways; i++) {
+        if (age[i] == nways-1) return i;
+      }
+      return 0;
+    }
+  };
+};
+
+// Tree pseudo-LRU: nways-1 bits in a binary tree (node 1 is the root), each
+// pointing at the half that was used least recently.
+struct TreePlruPolicy {
+  template<unsigned int nways>
+  struct Set {
+    static_assert(nways <= 64, "tree pseudo-LRU supports up to 64 ways");
+    static constexpr unsigned int s_levels = __builtin_ctz(nways);
+    uint64_t bits = 0;
+
+    void touch(unsigned int way) {
+      unsigned int node = 1;
+      for (unsigned int l = s_levels; l--;) {
+        unsigned int b = (way>>l)&1;
+        if (b) bits &= ~(uint64_t(1)<<node);
+        else bits |= uint64_t(1)<<node;
+        node = node*2+b;
+      }
+    }
+    unsigned int victim() {
+      unsigned int node = 1;
+      for (unsigned int l = 0; l < s_levels; l++) {
+        node = node*2 + ((bits>>node)&1);
+      }
+      return node - nways;
+    }
+  };
+};
+
+// CLOCK / second chance: a hand sweeps the ways, clearing reference bits,
+// and evicts the first way that has not been referenced since its last pass.
+struct ClockPolicy {
+  template<unsigned int nways>
+  struct Set {
+    static_assert(nways <= 64, "CLOCK supports up to 64 ways");
+    uint64_t referenced = 0;
+    uint8_t hand = 0;
+
+    void touch(unsigned int way) { referenced |= uint64_t(1)<<way; }
+    unsigned int victim() {
+      while (referenced & (uint64_t(1)<<hand)) {
+        referenced &= ~(uint64_t(1)<<hand);
+        hand = (hand+1)&(nways-1);
+      }
+      unsigned int way = hand;
+      hand = (hand+1)&(nways-1);
+      return way;
+    }
+  };
+};
+
+// Uniformly random way from a per-set xorshift generator.
+struct RandomPolicy {
+  template<unsigned int nways>
+  struct Set {
+    uint32_t state = 0x9e37'79b9;
+
+    void touch(unsigned int) {}
+    unsigned int victim() {
+      state ^= state<<13;
+      state ^= state>>17;
+      state ^= state<<5;
+      return state&(nways-1);
+    }
+  };
+};
@@ -1,65 +1,265 @@
 #pragma once
 
 #include "mem_interface.hpp"
+#include "cache_policy.hpp"
+#include "stride_prefetcher.hpp"
 #include <array>
 #include <memory>
-#include <map>
 
-template<unsigned int ncl, unsigned int clsp2>
+// Counted while PICO_EXTMEM_STATS is on. Copy to snapshot.
+struct CacheStats {
+  uint32_t hits;
+  uint32_t misses;
+  uint32_t prefetches;       // lines filled by the prefetcher
+  uint32_t prefetch_useful;  // prefetched lines later accessed
+  uint32_t prefetch_wasted;  // prefetched lines evicted unused
+  uint32_t evictions;        // valid lines replaced
+  uint32_t writebacks;       // evicted lines that were dirty
+  uint32_t cleans;           // dirty lines written back and kept: flushes, clean()
+  uint32_t bytes_read;       // from the backing memory: fills, prefetches, streams
+  uint32_t bytes_written;    // to the backing memory: write-backs, streams
+};
+void print_cache_stats(const char *desc, CacheStats const &stats);
+
+// ncl cache lines of 2^clsp2 bytes, arranged as ncl/nways sets of nways lines.
+// nways == 1 is direct mapped, nways == ncl is fully associative. Policy picks
+// the way evicted within a set, see cache_policy.hpp.
+template<unsigned int ncl, unsigned int clsp2, unsigned int nways = 4, class Policy = TreePlruPolicy>
 class CachedMemory final : public IMemory {
 public:
 
   CachedMemory(IMemory *memory);
+  ~CachedMemory();
 
-  uint8_t read_byte(uintptr_t addr) final override;
-  uint16_t read_word(uintptr_t addr) final override;
-  uint32_t read_dword(uintptr_t addr) final override;
+  // The single accesses are inline so that callers holding the concrete type
+  // (see BasicExtmemMapper) can fold the hit path in; misses go out of line.
+  uint8_t read_byte(uintptr_t addr) final override { return read<uint8_t>(addr); }
+  uint16_t read_word(uintptr_t addr) final override { return read<uint16_t>(addr); }
+  uint32_t read_dword(uintptr_t addr) final override { return read<uint32_t>(addr); }
   void read_data(uintptr_t addr, uint32_t nbytes, uint8_t *data) final override;
 
-  void write_byte(uintptr_t addr, uint8_t value) final override;
-  void write_word(uintptr_t addr, uint16_t value) final override;
-  void write_dword(uintptr_t addr, uint32_t value) final override;
+  void write_byte(uintptr_t addr, uint8_t value) final override { write<uint8_t>(addr, value); }
+  void write_word(uintptr_t addr, uint16_t value) final override { write<uint16_t>(addr, value); }
+  void write_dword(uintptr_t addr, uint32_t value) final override { write<uint32_t>(addr, value); }
   void write_data(uintptr_t addr, uint32_t nbytes, uint8_t const *data) final override;
+  // zeroes cached copies, then passes the range on to the backing memory
+  void zero_data(uintptr_t addr, uint32_t nbytes) final override;
 
-  uint32_t max_read() const final override { return s_cache_line_size; }
-  uint32_t max_write() const final override { return s_cache_line_size; }
+  uint32_t max_read() const final override { return m_memory->size_bytes(); }
+  uint32_t max_write() const final override { return m_memory->size_bytes(); }
 
   uint32_t size_bytes() const final override { return m_memory->size_bytes(); }
   
   using line_index_t = unsigned int;
   static constexpr line_index_t CACHE_MISS = -1;
-  static constexpr unsigned int s_num_cache_lines = 32;
-  static constexpr unsigned int s_cache_line_size_pow2 = 5;
+  static constexpr unsigned int s_num_cache_lines = ncl;
+  static constexpr unsigned int s_cache_line_size_pow2 = clsp2;
   static constexpr unsigned int s_cache_line_size = 1<<s_cache_line_size_pow2;
   static constexpr unsigned int s_cache_line_addr_mask = s_cache_line_size-1;
+  static constexpr unsigned int s_num_ways = nways;
+  static constexpr unsigned int s_num_sets = ncl/nways;
+  static constexpr unsigned int s_set_index_mask = s_num_sets-1;
+  static constexpr uintptr_t INVALID_TAG = -1;
+
+  // validity and dirtiness are tracked per sector: words for small lines, 1/32nd of a line for large ones
+  using sector_mask_t = uint32_t;
+  static constexpr unsigned int s_num_sectors_pow2 = s_cache_line_size_pow2 - 2 < 5 ? s_cache_line_size_pow2 - 2 : 5;
+  static constexpr unsigned int s_num_sectors = 1<<s_num_sectors_pow2;
+  static constexpr unsigned int s_sector_size_pow2 = s_cache_line_size_pow2 - s_num_sectors_pow2;
+  static constexpr unsigned int s_sector_size = 1<<s_sector_size_pow2;
+  static constexpr sector_mask_t s_all_sectors = sector_mask_t(-1)>>(32-s_num_sectors);
+
+  // prefetch fills that may be in flight at once
+  static constexpr unsigned int s_max_fills = 4;
+  // write-back bursts for one line: at most every other sector starts a dirty run
+  static constexpr unsigned int s_max_writeback_runs = (s_num_sectors+1)/2;
+  static constexpr uint8_t s_max_pins = 255;
+
+  static_assert((ncl & (ncl-1)) == 0, "number of cache lines must be a power of 2");
+  static_assert(nways > 0 && nways <= ncl && (nways & (nways-1)) == 0, "ways must be a power of 2 no greater than the number of lines");
 
   void cache_line_evict(line_index_t line);
 
+  CacheStats &stats() { return m_stats; }
+  void reset_stats() { m_stats = {}; }
+
+  // read_data/write_data of at least this many bytes bypass the cache and go
+  // straight to the backing memory, so large copies don't evict the working set
+  static constexpr uint32_t s_default_stream_threshold = s_num_cache_lines*s_cache_line_size/4;
+  void set_stream_threshold(uint32_t nbytes) { m_stream_threshold = nbytes; }
+
+  // fetch degree lines ahead of detected read streams, starting distance
+  // strides ahead. Off (degree 0) by default.
+  void set_prefetch(unsigned int degree, unsigned int distance = 1) { m_prefetcher.configure(degree, distance); }
+
+  // Zero-copy access: a pointer to nbytes at addr straight into the cache
+  // line holding them, which stays resident until every pin() on it is
+  // undone. The range must lie within one line. Stores through the pointer
+  // reach memory after unpin() with written set. One way per set is never
+  // pinned, so the cache keeps working; nullptr when that would be broken
+  // (always for a direct mapped cache) or the range crosses a line.
+  uint8_t *pin(uintptr_t addr, uint32_t nbytes);
+  void unpin(uintptr_t addr, uint32_t nbytes, bool written);
+
+  // For a level in front (CacheHierarchy): hook(ctx, addr, data, valid,
+  // dirty) sees each line as it is evicted, before its write-back. Returning
+  // true takes the line, which is then not written back; returning false
+  // lets the write-back go ahead with whatever hook left in data and dirty.
+  using evict_hook_t = bool (*)(void *ctx, uintptr_t addr, uint8_t *data, sector_mask_t valid, sector_mask_t &dirty);
+  void set_evict_hook(evict_hook_t hook, void *ctx) { m_evict_hook = hook; m_evict_ctx = ctx; }
+  // drops the line holding addr, if any, without writing it back
+  void discard(uintptr_t addr);
+  IMemory *backing() const { return m_memory; }
+
+  // Coherence with direct access to the backing memory. flush_range() writes
+  // back the dirty lines overlapping the range, which stay cached and clean,
+  // and returns once the writes are done. invalidate_range() drops the lines
+  // overlapping the range so later reads see the backing memory: dirty data
+  // inside the range is lost, lines reaching past it are written back first,
+  // and pinned lines are only written back.
+  void flush_range(uintptr_t addr, uint32_t nbytes);
+  void invalidate_range(uintptr_t addr, uint32_t nbytes);
+  void flush_all();
+  // flush_all(), then flushes the backing memory
+  void flush() final override;
+
+  // Writes back up to max_lines dirty lines that are their set's next
+  // victim, so misses find clean lines to replace instead of paying a
+  // write-back before the fill. For an idle hook: it doesn't wait for an
+  // earlier write-back, returns the lines cleaned. Not reentrant; from a
+  // second core, hold the same lock as the accesses.
+  unsigned int clean(unsigned int max_lines = 1);
+
 protected:
 private:
   IMemory *const m_memory;
-  line_index_t m_next_evict;
 
-  std::array<
+  // aligned for pinned lines to be used as arrays of any word-sized type
+  alignas(uint64_t) std::array<
     std::array<uint8_t, s_cache_line_size>, 
     s_num_cache_lines
   > m_cache_lines;
 
+  // line address held by each line, indexed set*nways+way
+  std::array<
+    uintptr_t,
+    s_num_cache_lines
+  > m_cache_line_tags;
+
   struct CacheLineData{
-    uintptr_t masked_addr;
-    bool dirty;
+    sector_mask_t valid;
+    sector_mask_t dirty;
+    bool prefetched;
+    int8_t fill;  // index into m_fills while a prefetch fill is in flight, else -1
+    uint8_t pins; // outstanding pin()s, the line is not evicted while non zero
   };
 
   std::array<
     CacheLineData,
     s_num_cache_lines
   > m_cache_line_lookups;
-  
-  std::map<uintptr_t, line_index_t> m_cache_line_indexes;
+
+  std::array<
+    typename Policy::template Set<nways>,
+    s_num_sets
+  > m_replacement;
+
+  CacheStats m_stats;
+  uint32_t m_stream_threshold;
+  evict_hook_t m_evict_hook;
+  void *m_evict_ctx;
+  unsigned int m_clean_set;  // where clean() looks next
+  StridePrefetcher<> m_prefetcher;
+
+  // prefetch fills submitted to the backing memory, and the line each fills
+  std::array<MemTransaction, s_max_fills> m_fills;
+  std::array<line_index_t, s_max_fills> m_fill_lines;
+
+  // dirty data of the last evicted line, written back asynchronously once
+  // the fill that caused the eviction has been issued
+  struct WriteBack {
+    std::array<uint8_t, s_cache_line_size> data;
+    std::array<MemTransaction, s_max_writeback_runs> runs;
+    unsigned int count;
+    bool queued;
+  } m_writeback;
+
+  static unsigned int cache_set(uintptr_t addr) { return (addr>>s_cache_line_size_pow2)&s_set_index_mask; }
+  // sectors touched by nbytes at offset within a line
+  static sector_mask_t sector_mask(unsigned int offset, unsigned int nbytes) {
+    unsigned int first = offset>>s_sector_size_pow2;
+    unsigned int last = (offset+nbytes-1)>>s_sector_size_pow2;
+    return (sector_mask_t(-1)>>(31-last+first))<<first;
+  }
+  // sectors entirely overwritten by nbytes at offset within a line
+  static sector_mask_t full_sector_mask(unsigned int offset, unsigned int nbytes) {
+    unsigned int first = (offset+s_sector_size-1)>>s_sector_size_pow2;
+    unsigned int end = (offset+nbytes)>>s_sector_size_pow2;
+    if (end <= first) return 0;
+    return (sector_mask_t(-1)>>(32-end+first))<<first;
+  }
+  // calls f(first, count) for each run of contiguous sectors in mask
+  template<class F>
+  static void for_each_sector_run(sector_mask_t mask, F &&f) {
+    while (mask) {
+      unsigned int first = __builtin_ctz(mask);
+      sector_mask_t rest = ~(mask>>first);
+      unsigned int count = rest ? __builtin_ctz(rest) : s_num_sectors;
+      f(first, count);
+      mask &= ~sector_mask(first<<s_sector_size_pow2, count<<s_sector_size_pow2);
+    }
+  }
+
+  // The line holding addr if it can be used as it is: settled, the needed
+  // sectors valid, no first use of a prefetch to account. Counts the hit.
+  line_index_t cache_line_hit(uintptr_t addr, sector_mask_t needed) {
+    uintptr_t tag = addr&~uintptr_t(s_cache_line_addr_mask);
+    unsigned int set = cache_set(addr);
+    line_index_t first = set*s_num_ways;
+    for (unsigned int way = 0; way < s_num_ways; way++) {
+      if (m_cache_line_tags[first+way] != tag) continue;
+      CacheLineData &data = m_cache_line_lookups[first+way];
+      if (data.fill >= 0 || data.prefetched || (data.valid & needed) != needed) return CACHE_MISS;
+      EXTMEM_COUNT(m_stats.hits++);
+      m_replacement[set].touch(way);
+      return first+way;
+    }
+    return CACHE_MISS;
+  }
+
+  template<class T>
+  T read(uintptr_t addr) {
+    line_index_t line = cache_line_hit(addr, s_all_sectors);
+    if (line == CACHE_MISS) line = cache_line_lookup_fetch(addr&~s_cache_line_addr_mask);
+    return *(T*)&m_cache_lines[line][addr&s_cache_line_addr_mask];
+  }
+
+  template<class T>
+  void write(uintptr_t addr, T value) {
+    sector_mask_t written = sector_mask(addr&s_cache_line_addr_mask, sizeof(T));
+    line_index_t line = cache_line_hit(addr, written);
+    if (line == CACHE_MISS) line = cache_line_lookup_write(addr, sizeof(T));
+    else m_cache_line_lookups[line].dirty |= written;
+    *(T*)&m_cache_lines[line][addr&s_cache_line_addr_mask] = value;
+  }
 
   line_index_t cache_line_lookup(uintptr_t addr);
+  line_index_t cache_line_lookup_alloc(uintptr_t addr);
   line_index_t cache_line_lookup_fetch(uintptr_t addr);
-  void cache_line_fetch(line_index_t line, uintptr_t addr);
+  line_index_t cache_line_lookup_write(uintptr_t addr, unsigned int nbytes);
+  void cache_line_fetch(line_index_t line, sector_mask_t sectors);
+  void cache_line_prefetch(uintptr_t addr, line_index_t keep);
+  void cache_line_settle(line_index_t line);
+  void writeback_wait();
+  void writeback_submit();
+  // stages the line's dirty sectors, one burst per run, waiting for the last
+  void writeback_queue(line_index_t line);
+  // a write-back submitted and still in flight, progressed by polling
+  bool writeback_busy();
+  // the line's dirty sectors written back and marked clean, queued only
+  void cache_line_clean(line_index_t line);
+  void stream_read(uintptr_t addr, uint32_t nbytes, uint8_t *data);
+  void stream_write(uintptr_t addr, uint32_t nbytes, uint8_t const *data);
 
 };
 
@@ -99,4 +299,13 @@ TPL_USING(Cached_64_64,   CachedMemory, 64, 6);
 TPL_USING(Cached_64_128,  CachedMemory, 64, 7);
 TPL_USING(Cached_64_256,  CachedMemory, 64, 8);
 TPL_USING(Cached_64_512,  CachedMemory, 64, 9);
-TPL_USING(Cached_64_1024, CachedMemory, 64, 10);
\ No newline at end of file
+TPL_USING(Cached_64_1024, CachedMemory, 64, 10);
+
+TPL_USING(Cached_32_32_DM, CachedMemory, 32, 5, 1);
+TPL_USING(Cached_32_32_FA, CachedMemory, 32, 5, 32);
+
+TPL_USING(Cached_32_32_RR,     CachedMemory, 32, 5, 4, RoundRobinPolicy);
+TPL_USING(Cached_32_32_LRU,    CachedMemory, 32, 5, 4, LruPolicy);
+using Cached_32_32_PLRU = Cached_32_32;
+TPL_USING(Cached_32_32_CLOCK,  CachedMemory, 32, 5, 4, ClockPolicy);
+TPL_USING(Cached_32_32_RANDOM, CachedMemory, 32, 5, 4, RandomPolicy);
\ No newline at end of file
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+
+// Registers as laid out on the stack by the hardfault handler: r4-r7 and
+// EXC_RETURN pushed by the handler, followed by the exception frame.
+struct exception_pushstack{
+  uintptr_t R4, R5, R6, R7, _LR, R0, R1, R2, R3, R12, LR, PC, XPSR;
+  static constexpr int regs_base = 12;
+  static constexpr int regs_mapping[16] = {
+    regs_base-7, // r0
+    regs_base-6, // r1
+    regs_base-5, // r2
+    regs_base-4, // r3
+    regs_base-12,// r4
+    regs_base-11,// r5
+    regs_base-10,// r6
+    regs_base-9, // r7
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    regs_base-2, // lr
+    regs_base-1, // pc
+  };
+} __attribute__((packed));
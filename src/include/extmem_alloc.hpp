@@ -0,0 +1,130 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include <memory_resource>
+
+// Allocation in external memory. The allocators hand out addresses in
+// [base, base + size): a mapped window such as 0x3000'0000, or IMemory
+// offsets from 0. They never touch the memory itself; all bookkeeping is
+// in SRAM, so allocating and freeing never faults or misses the cache.
+
+// Returned when there is no space, since 0 is a valid IMemory offset.
+static constexpr uintptr_t s_extmem_alloc_failed = ~uintptr_t(0);
+
+// Bulk buffers. Every block starts on a cache line and is a whole number of
+// lines, so no two buffers share a line. Freed blocks go on a free list
+// searched first fit; a block freed at the top goes back to the bump pointer.
+class ExtmemArena {
+public:
+  static constexpr uint32_t s_max_free = 32;
+
+  // base is rounded up to a line
+  ExtmemArena(uintptr_t base, uint32_t size, uint32_t line_size = 32);
+
+  uintptr_t allocate(uint32_t nbytes);
+  void deallocate(uintptr_t addr, uint32_t nbytes);
+  void reset();
+
+  bool owns(uintptr_t addr) const { return addr - m_base < m_size; }
+  uintptr_t base() const { return m_base; }
+  uint32_t size() const { return m_size; }
+  uint32_t line_size() const { return m_line_size; }
+  // bytes in live blocks, and bytes freed while the free list was full
+  uint32_t used() const { return m_top - m_free_bytes - m_lost; }
+  uint32_t lost() const { return m_lost; }
+
+private:
+  struct Extent {
+    uint32_t offset;
+    uint32_t size;
+  };
+  uint32_t round_up(uint32_t nbytes) const { return (nbytes + m_line_size - 1)&~(m_line_size - 1); }
+
+  uintptr_t m_base;
+  uint32_t m_size;
+  uint32_t m_line_size;
+  uint32_t m_top;
+  uint32_t m_free_bytes;
+  uint32_t m_lost;
+  uint32_t m_num_free;
+  Extent m_free[s_max_free];  // by offset, never adjacent
+};
+
+// Small objects. The pool is split into slabs, each holding blocks of one
+// power of two size class from s_min_block to s_max_block with a bitmap of
+// the used ones. With a line aligned base a block no bigger than a line
+// never straddles two.
+class ExtmemPool {
+public:
+  static constexpr uint32_t s_slab_size = 1024;
+  static constexpr uint32_t s_max_slabs = 64;
+  static constexpr uint32_t s_min_block = 8;
+  static constexpr uint32_t s_max_block = 512;
+  static constexpr uint32_t s_num_classes = 7;
+
+  // size is rounded down to whole slabs, at most s_max_slabs
+  ExtmemPool(uintptr_t base, uint32_t size);
+
+  uintptr_t allocate(uint32_t nbytes);
+  void deallocate(uintptr_t addr);
+  void reset();
+
+  bool owns(uintptr_t addr) const { return addr - m_base < m_num_slabs*s_slab_size; }
+  uintptr_t base() const { return m_base; }
+  uint32_t size() const { return m_num_slabs*s_slab_size; }
+  // bytes in live blocks, rounded up to their class
+  uint32_t used() const { return m_used; }
+  static uint32_t block_size(uint32_t nbytes);
+
+private:
+  static constexpr uint8_t s_unassigned = 0xff;
+  struct Slab {
+    uint8_t size_class;
+    uint8_t used;
+    uint32_t bitmap[s_slab_size/s_min_block/32];
+  };
+
+  uintptr_t m_base;
+  uint32_t m_num_slabs;
+  uint32_t m_used;
+  uint8_t m_hint[s_num_classes];  // slab last allocated from, per class
+  Slab m_slabs[s_max_slabs];
+};
+
+// A pool for small objects in front of an arena for the rest. Allocations
+// the pool can't take fall back to the arena.
+class ExtmemHeap {
+public:
+  ExtmemHeap(uintptr_t base, uint32_t size, uint32_t line_size = 32,
+             uint32_t pool_size = ExtmemPool::s_max_slabs*ExtmemPool::s_slab_size);
+
+  uintptr_t allocate(uint32_t nbytes);
+  void deallocate(uintptr_t addr, uint32_t nbytes);
+
+  ExtmemPool &pool() { return m_pool; }
+  ExtmemArena &arena() { return m_arena; }
+  uint32_t used() const { return m_pool.used() + m_arena.used(); }
+
+private:
+  ExtmemPool m_pool;
+  ExtmemArena m_arena;
+};
+
+// Lets std::pmr containers live in a mapped external memory. The heap must
+// manage addresses the CPU can dereference, i.e. a window the mapper serves.
+// Running out panics on the Pico, where exceptions are off, and throws
+// std::bad_alloc on the host.
+class ExtmemResource : public std::pmr::memory_resource {
+public:
+  explicit ExtmemResource(ExtmemHeap &heap) : m_heap{heap} {}
+  ExtmemHeap &heap() { return m_heap; }
+
+protected:
+  void *do_allocate(size_t bytes, size_t alignment) override;
+  void do_deallocate(void *p, size_t bytes, size_t alignment) override;
+  bool do_is_equal(std::pmr::memory_resource const &other) const noexcept override { return this == &other; }
+
+private:
+  ExtmemHeap &m_heap;
+};
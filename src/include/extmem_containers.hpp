@@ -0,0 +1,370 @@
+#pragma once
+
+#include "mem_interface.hpp"
+#include "extmem_alloc.hpp"
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+
+// Containers for logs and sample buffers in external memory, used through
+// the memory interface rather than faulting per word. Elements are stored in
+// chunks of ChunkBytes, allocated line aligned from an ExtmemArena over the
+// memory's offsets, and never straddle two chunks. Sizes and chunk tables
+// live in SRAM. Bulk operations move each run of elements with one
+// read_data/write_data burst per chunk, and for_each_chunk hands the
+// elements to f(T const *elements, uint32_t n) one chunk at a time.
+//
+// Make ChunkBytes a multiple of the cache line, and give the arena the
+// cache's line size, so chunks and lines coincide.
+
+template<class T, uint32_t ChunkBytes>
+struct ext_chunk_layout {
+  static_assert(std::is_trivially_copyable_v<T>, "external memory holds trivially copyable types only");
+  static_assert(sizeof(T) <= ChunkBytes, "an element must fit in a chunk");
+  static constexpr uint32_t s_per_chunk = ChunkBytes/sizeof(T);
+  // whether consecutive chunks hold consecutive elements without a gap
+  static constexpr bool s_packed = ChunkBytes%sizeof(T) == 0;
+};
+
+// Grows at the back. push_back() goes to an SRAM copy of the last chunk,
+// which is written out in one burst when it fills or on flush(); whole
+// chunks given to append() are written straight from the caller's buffer.
+template<class T, class Mem = IMemory, uint32_t MaxChunks = 64, uint32_t ChunkBytes = 256>
+class ExtVector {
+  using Layout = ext_chunk_layout<T, ChunkBytes>;
+public:
+  static constexpr uint32_t s_per_chunk = Layout::s_per_chunk;
+  static constexpr uint32_t s_max_size = MaxChunks*s_per_chunk;
+
+  ExtVector(Mem *memory, ExtmemArena &arena) : m_memory{memory}, m_arena{arena} {}
+  ~ExtVector() { clear(); }
+  ExtVector(ExtVector const &) = delete;
+  ExtVector &operator=(ExtVector const &) = delete;
+
+  uint32_t size() const { return m_size; }
+  bool empty() const { return m_size == 0; }
+
+  // false when out of chunks or arena space
+  bool push_back(T const &value) { return append(&value, 1) == 1; }
+  // returns how many of the n were appended
+  uint32_t append(T const *src, uint32_t n) {
+    uint32_t done = 0;
+    while (done < n) {
+      uint32_t slot = m_size%s_per_chunk;
+      if (slot == 0 && !grow()) break;
+      uint32_t count = std::min(n - done, s_per_chunk - slot);
+      uint32_t chunk = m_size/s_per_chunk;
+      if (count == s_per_chunk) {
+        m_memory->write_data(m_chunks[chunk], s_per_chunk*sizeof(T), (uint8_t const*)(src + done));
+      } else {
+        memcpy(m_tail + slot, src + done, count*sizeof(T));
+        if (slot + count == s_per_chunk) write_tail(chunk, s_per_chunk);
+      }
+      m_size += count;
+      done += count;
+    }
+    return done;
+  }
+  // writes out a partly filled last chunk
+  void flush() {
+    if (m_size%s_per_chunk) write_tail(m_size/s_per_chunk, m_size%s_per_chunk);
+  }
+
+  T operator[](uint32_t i) const {
+    if (in_tail(i)) return m_tail[i%s_per_chunk];
+    T value;
+    m_memory->read_data(addr_of(i), sizeof(T), (uint8_t*)&value);
+    return value;
+  }
+  void set(uint32_t i, T const &value) {
+    if (in_tail(i)) m_tail[i%s_per_chunk] = value;
+    else m_memory->write_data(addr_of(i), sizeof(T), (uint8_t const*)&value);
+  }
+  // copies n elements from first into dst
+  void read(uint32_t first, T *dst, uint32_t n) const {
+    while (n) {
+      uint32_t slot = first%s_per_chunk, count = std::min(n, s_per_chunk - slot);
+      if (in_tail(first)) memcpy(dst, m_tail + slot, count*sizeof(T));
+      else m_memory->read_data(addr_of(first), count*sizeof(T), (uint8_t*)dst);
+      first += count;
+      dst += count;
+      n -= count;
+    }
+  }
+
+  template<class F>
+  void for_each_chunk(F &&f) const {
+    alignas(T) uint8_t buffer[s_per_chunk*sizeof(T)];
+    for (uint32_t first = 0; first < m_size; first += s_per_chunk) {
+      uint32_t n = std::min(m_size - first, s_per_chunk);
+      if (in_tail(first)) {
+        f((T const*)m_tail, n);
+      } else {
+        m_memory->read_data(addr_of(first), n*sizeof(T), buffer);
+        f((T const*)buffer, n);
+      }
+    }
+  }
+
+  void clear() {
+    for (uint32_t i = 0; i < m_num_chunks; i++) m_arena.deallocate(m_chunks[i], ChunkBytes);
+    m_num_chunks = 0;
+    m_size = 0;
+  }
+
+private:
+  // the last chunk while partly filled, only m_tail is up to date
+  bool in_tail(uint32_t i) const { return i/s_per_chunk == m_size/s_per_chunk; }
+  uintptr_t addr_of(uint32_t i) const { return m_chunks[i/s_per_chunk] + i%s_per_chunk*sizeof(T); }
+  bool grow() {
+    if (m_size < m_num_chunks*s_per_chunk) return true;
+    if (m_num_chunks == MaxChunks) return false;
+    uintptr_t addr = m_arena.allocate(ChunkBytes);
+    if (addr == s_extmem_alloc_failed) return false;
+    m_chunks[m_num_chunks++] = addr;
+    return true;
+  }
+  void write_tail(uint32_t chunk, uint32_t n) {
+    m_memory->write_data(m_chunks[chunk], n*sizeof(T), (uint8_t const*)m_tail);
+  }
+
+  Mem *m_memory;
+  ExtmemArena &m_arena;
+  uint32_t m_size = 0;
+  uint32_t m_num_chunks = 0;
+  uintptr_t m_chunks[MaxChunks];
+  T m_tail[s_per_chunk];
+};
+
+// Grows and shrinks at both ends. The chunk table is a ring in SRAM; a chunk
+// emptied at one end is kept as a spare for the next one needed, so a deque
+// used as a queue doesn't go back to the arena at every chunk boundary.
+// Single element operations go straight to memory.
+template<class T, class Mem = IMemory, uint32_t MaxChunks = 64, uint32_t ChunkBytes = 256>
+class ExtDeque {
+  using Layout = ext_chunk_layout<T, ChunkBytes>;
+public:
+  static constexpr uint32_t s_per_chunk = Layout::s_per_chunk;
+
+  ExtDeque(Mem *memory, ExtmemArena &arena) : m_memory{memory}, m_arena{arena} {}
+  ~ExtDeque() { clear(); }
+  ExtDeque(ExtDeque const &) = delete;
+  ExtDeque &operator=(ExtDeque const &) = delete;
+
+  uint32_t size() const { return m_size; }
+  bool empty() const { return m_size == 0; }
+
+  bool push_back(T const &value) { return append(&value, 1) == 1; }
+  bool push_front(T const &value) {
+    if (m_begin == 0) {
+      if (m_num_chunks == MaxChunks) return false;
+      uintptr_t addr = acquire();
+      if (addr == s_extmem_alloc_failed) return false;
+      m_first = (m_first + MaxChunks - 1)%MaxChunks;
+      m_map[m_first] = addr;
+      m_num_chunks++;
+      m_begin = s_per_chunk;
+    }
+    m_begin--;
+    m_size++;
+    set(0, value);
+    return true;
+  }
+  bool pop_front() { return drain(nullptr, 1) == 1; }
+  bool pop_back() {
+    if (!m_size) return false;
+    m_size--;
+    if (m_begin + m_size <= (m_num_chunks - 1)*s_per_chunk) release(--m_num_chunks);
+    if (!m_size) reset_empty();
+    return true;
+  }
+
+  // returns how many of the n were appended at the back
+  uint32_t append(T const *src, uint32_t n) {
+    uint32_t done = 0;
+    while (done < n) {
+      uint32_t end = m_begin + m_size;
+      if (end == m_num_chunks*s_per_chunk) {
+        if (m_num_chunks == MaxChunks) break;
+        uintptr_t addr = acquire();
+        if (addr == s_extmem_alloc_failed) break;
+        m_map[(m_first + m_num_chunks)%MaxChunks] = addr;
+        m_num_chunks++;
+      }
+      uint32_t count = std::min(n - done, s_per_chunk - end%s_per_chunk);
+      m_memory->write_data(slot_addr(end), count*sizeof(T), (uint8_t const*)(src + done));
+      m_size += count;
+      done += count;
+    }
+    return done;
+  }
+  // removes up to n from the front, copying them to dst unless it is null;
+  // returns how many were removed
+  uint32_t drain(T *dst, uint32_t n) {
+    n = std::min(n, m_size);
+    for (uint32_t done = 0; done < n;) {
+      uint32_t count = std::min(n - done, s_per_chunk - m_begin);
+      if (dst) m_memory->read_data(slot_addr(m_begin), count*sizeof(T), (uint8_t*)(dst + done));
+      m_begin += count;
+      m_size -= count;
+      done += count;
+      if (m_begin == s_per_chunk) {
+        release(0);
+        m_first = (m_first + 1)%MaxChunks;
+        m_num_chunks--;
+        m_begin = 0;
+      }
+    }
+    if (!m_size) reset_empty();
+    return n;
+  }
+
+  T operator[](uint32_t i) const {
+    T value;
+    m_memory->read_data(slot_addr(m_begin + i), sizeof(T), (uint8_t*)&value);
+    return value;
+  }
+  void set(uint32_t i, T const &value) {
+    m_memory->write_data(slot_addr(m_begin + i), sizeof(T), (uint8_t const*)&value);
+  }
+  T front() const { return (*this)[0]; }
+  T back() const { return (*this)[m_size - 1]; }
+
+  template<class F>
+  void for_each_chunk(F &&f) const {
+    alignas(T) uint8_t buffer[s_per_chunk*sizeof(T)];
+    for (uint32_t slot = m_begin, end = m_begin + m_size; slot < end;) {
+      uint32_t n = std::min(end - slot, s_per_chunk - slot%s_per_chunk);
+      m_memory->read_data(slot_addr(slot), n*sizeof(T), buffer);
+      f((T const*)buffer, n);
+      slot += n;
+    }
+  }
+
+  void clear() {
+    for (uint32_t i = 0; i < m_num_chunks; i++) m_arena.deallocate(m_map[(m_first + i)%MaxChunks], ChunkBytes);
+    if (m_spare != s_extmem_alloc_failed) m_arena.deallocate(m_spare, ChunkBytes);
+    m_spare = s_extmem_alloc_failed;
+    m_num_chunks = 0;
+    m_size = 0;
+    m_begin = 0;
+  }
+
+private:
+  // slot counts from the first slot of the first chunk
+  uintptr_t slot_addr(uint32_t slot) const {
+    return m_map[(m_first + slot/s_per_chunk)%MaxChunks] + slot%s_per_chunk*sizeof(T);
+  }
+  uintptr_t acquire() {
+    uintptr_t addr = m_spare;
+    if (addr == s_extmem_alloc_failed) return m_arena.allocate(ChunkBytes);
+    m_spare = s_extmem_alloc_failed;
+    return addr;
+  }
+  // chunk counts from the first
+  void release(uint32_t chunk) {
+    uintptr_t addr = m_map[(m_first + chunk)%MaxChunks];
+    if (m_spare == s_extmem_alloc_failed) m_spare = addr;
+    else m_arena.deallocate(addr, ChunkBytes);
+  }
+  // an empty deque keeps at most one chunk, and starts it from its first slot
+  void reset_empty() {
+    while (m_num_chunks > 1) release(--m_num_chunks);
+    m_begin = 0;
+  }
+
+  Mem *m_memory;
+  ExtmemArena &m_arena;
+  uint32_t m_size = 0;
+  uint32_t m_begin = 0;       // slot of the front element in the first chunk
+  uint32_t m_first = 0;       // map index of the first chunk
+  uint32_t m_num_chunks = 0;
+  uintptr_t m_spare = s_extmem_alloc_failed;
+  uintptr_t m_map[MaxChunks];
+};
+
+// Fixed capacity FIFO, e.g. for streaming samples to external memory while
+// something else drains them. Its chunks are one arena block, so when
+// ChunkBytes is a multiple of sizeof(T) an append or drain is at most two
+// bursts, split only where the ring wraps.
+template<class T, class Mem = IMemory, uint32_t ChunkBytes = 256>
+class ExtRing {
+  using Layout = ext_chunk_layout<T, ChunkBytes>;
+public:
+  static constexpr uint32_t s_per_chunk = Layout::s_per_chunk;
+
+  // capacity is rounded up to whole chunks; check valid() for the allocation
+  ExtRing(Mem *memory, ExtmemArena &arena, uint32_t capacity) : m_memory{memory}, m_arena{arena} {
+    uint32_t chunks = (capacity + s_per_chunk - 1)/s_per_chunk;
+    m_base = m_arena.allocate(chunks*ChunkBytes);
+    m_capacity = m_base == s_extmem_alloc_failed ? 0 : chunks*s_per_chunk;
+  }
+  ~ExtRing() {
+    if (valid()) m_arena.deallocate(m_base, m_capacity/s_per_chunk*ChunkBytes);
+  }
+  ExtRing(ExtRing const &) = delete;
+  ExtRing &operator=(ExtRing const &) = delete;
+
+  bool valid() const { return m_capacity != 0; }
+  uint32_t size() const { return m_size; }
+  uint32_t capacity() const { return m_capacity; }
+  uint32_t space() const { return m_capacity - m_size; }
+  bool empty() const { return m_size == 0; }
+
+  // returns how many of the n fitted
+  uint32_t append(T const *src, uint32_t n) {
+    n = std::min(n, space());
+    spans((m_head + m_size)%std::max(m_capacity, 1u), n, [&](uintptr_t addr, uint32_t done, uint32_t count) {
+      m_memory->write_data(addr, count*sizeof(T), (uint8_t const*)(src + done));
+    });
+    m_size += n;
+    return n;
+  }
+  // removes up to n, copying them to dst unless it is null
+  uint32_t drain(T *dst, uint32_t n) {
+    n = std::min(n, m_size);
+    if (dst) {
+      spans(m_head, n, [&](uintptr_t addr, uint32_t done, uint32_t count) {
+        m_memory->read_data(addr, count*sizeof(T), (uint8_t*)(dst + done));
+      });
+    }
+    m_head = n ? (m_head + n)%m_capacity : m_head;
+    m_size -= n;
+    return n;
+  }
+  bool push(T const &value) { return append(&value, 1) == 1; }
+  bool pop(T &value) { return drain(&value, 1) == 1; }
+
+  template<class F>
+  void for_each_chunk(F &&f) const {
+    alignas(T) uint8_t buffer[s_per_chunk*sizeof(T)];
+    for (uint32_t done = 0; done < m_size;) {
+      uint32_t slot = (m_head + done)%m_capacity;
+      uint32_t n = std::min({m_size - done, s_per_chunk - slot%s_per_chunk, m_capacity - slot});
+      m_memory->read_data(slot_addr(slot), n*sizeof(T), buffer);
+      f((T const*)buffer, n);
+      done += n;
+    }
+  }
+
+private:
+  uintptr_t slot_addr(uint32_t slot) const { return m_base + slot/s_per_chunk*ChunkBytes + slot%s_per_chunk*sizeof(T); }
+  // f(addr, done, count) for each contiguous run of n slots from slot
+  template<class F>
+  void spans(uint32_t slot, uint32_t n, F &&f) const {
+    for (uint32_t done = 0; done < n;) {
+      uint32_t count = std::min(n - done, m_capacity - slot);
+      if (!Layout::s_packed) count = std::min(count, s_per_chunk - slot%s_per_chunk);
+      f(slot_addr(slot), done, count);
+      done += count;
+      slot = (slot + count)%m_capacity;
+    }
+  }
+
+  Mem *m_memory;
+  ExtmemArena &m_arena;
+  uintptr_t m_base;
+  uint32_t m_capacity;
+  uint32_t m_head = 0;
+  uint32_t m_size = 0;
+};
@@ -1,15 +1,84 @@
 #pragma once
 
 #include "mem_interface.hpp"
+#include "cached_memory.hpp"
+#include "exception_pushstack.hpp"
+#include "thumb_decoder.hpp"
 #include <memory>
 
-class ExtmemMapper {
+// Counted while PICO_EXTMEM_STATS is on. Copy to snapshot, reset_stats() to
+// clear.
+struct MapperStats {
+  uint32_t faults;        // hardfaults taken, each emulating one or more instructions
+  uint32_t decode_hits;
+  uint32_t decode_misses;
+  uint32_t unmapped;      // accesses outside every region
+  uint32_t ops[DecodedOp::NUM_KINDS]; // instructions emulated, by kind
+};
+void print_mapper_stats(const char *desc, MapperStats const &stats);
+
+// Maps external memory into the address space by emulating the loads and
+// stores that fault on it. Mem is the type of memory accessed: IMemory for
+// any backend through virtual calls (ExtmemMapper), or a final class such as
+// a CachedMemory, whose accesses are then direct calls that can inline into
+// the handlers. The hardfault handler serves the mapper last initialised.
+//
+// Several devices can be mapped at once, each a region of the address space
+// with its own base and size. A fault finds its region by the address's
+// window (top 8 bits) through a 256 entry table; accesses outside every
+// region panic on the Pico and are counted in stats().unmapped.
+template<class Mem>
+class BasicExtmemMapper {
 public:
-  static void init(IMemory *memory, uintptr_t base_addr);
-  static IMemory * s_memory;
+  // Maps memory at base_addr as the only region.
+  static void init(Mem *memory, uintptr_t base_addr);
+  // Adds a region, of size bytes or all of memory. No two regions can share
+  // a 16MB window, so this fails when the window is taken or the table full.
+  static bool map(Mem *memory, uintptr_t base_addr, uint32_t size = 0);
+  // Emulate the instruction at ps->PC and step past it, as the hardfault
+  // handler does. Lets the opcode handlers run on the host.
+  //
+  // The instructions after it are emulated in the same fault while they are
+  // external memory accesses, low register ALU ops or branches, up to
+  // s_emulate_budget in all. A larger budget amortises exception entry over
+  // more accesses but holds off interrupts for longer.
+  static void emulate(exception_pushstack *ps);
+  // Only the faulting instruction, decoding it every time rather than using
+  // the cache.
+  static void emulate_uncached(exception_pushstack *ps);
+  static unsigned s_emulate_budget;
+
+  // Decoded instructions are cached by PC, direct mapped, so repeat faults
+  // skip straight to the access. Flush if code at a faulting PC changes.
+  static constexpr unsigned s_decode_cache_size = 64;
+  static void flush_decode_cache();
+
+  static MapperStats &stats() { return s_stats; }
+  static void reset_stats() { s_stats = {}; }
+
+  struct Region {
+    Mem *memory;
+    uintptr_t base;
+    uint32_t size;
+  };
+  static constexpr unsigned s_max_regions = 8;
+  static constexpr unsigned s_window_bits = 24;
+  // the region containing addr, nullptr when unmapped
+  static Region const *lookup(uintptr_t addr);
+
+  // region 0 is an empty sentinel, so unmapped windows need no test
+  static Region s_regions[s_max_regions + 1];
+  static uint8_t s_region_index[1 << (32 - s_window_bits)];
+  static unsigned s_num_regions;
+  static MapperStats s_stats;
+
+  // the region mapped by init()
+  static Mem * s_memory;
   static uintptr_t s_base_addr;
-protected:
-private:
+  static uint32_t s_size;
+};
 
-  static void hardfault_handler(void) asm("hardfault_handler");
-};
\ No newline at end of file
+TPL_USING(ExtmemMapper, BasicExtmemMapper, IMemory);
+TPL_USING(ExtmemMapper_32_32, BasicExtmemMapper, Cached_32_32);
+TPL_USING(ExtmemMapper_64_32, BasicExtmemMapper, Cached_64_32);
+TPL_USING(ExtmemMapper_64_64, BasicExtmemMapper, Cached_64_64);
\ No newline at end of file
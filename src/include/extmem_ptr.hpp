@@ -0,0 +1,203 @@
+#pragma once
+
+#include "mem_interface.hpp"
+#include <cstddef>
+#include <cstring>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+
+// Typed access to external memory through its memory interface instead of a
+// hardfault per access. Addresses are offsets into the memory, as for IMemory.
+// Mem is IMemory, or a final class such as Cached_32_32 so that accesses are
+// direct calls that can inline (see BasicExtmemMapper).
+
+template<class Mem, class = void>
+struct extmem_can_pin : std::false_type {};
+template<class Mem>
+struct extmem_can_pin<Mem, std::void_t<decltype(std::declval<Mem&>().pin(0, 0))>> : std::true_type {};
+
+// What ExtArray walks at a time: cache lines for memories that can pin them,
+// else chunks of this many bytes copied through the stack.
+static constexpr uint32_t s_extmem_chunk_size = 64;
+
+template<class Mem>
+constexpr uint32_t extmem_line_size() {
+  if constexpr (extmem_can_pin<Mem>::value) return Mem::s_cache_line_size;
+  else return s_extmem_chunk_size;
+}
+
+// Stands in for T& to an element in external memory.
+template<class T, class Mem = IMemory>
+class extmem_ref {
+  static_assert(std::is_trivially_copyable_v<T>, "external memory holds trivially copyable types only");
+public:
+  extmem_ref(Mem *memory, uintptr_t addr) : m_memory{memory}, m_addr{addr} {}
+  extmem_ref(extmem_ref const &) = default;
+
+  operator T() const { return load(); }
+  extmem_ref &operator=(T const &value) { store(value); return *this; }
+  extmem_ref &operator=(extmem_ref const &other) { store(other.load()); return *this; }
+  extmem_ref &operator+=(T const &value) { store(load() + value); return *this; }
+  extmem_ref &operator-=(T const &value) { store(load() - value); return *this; }
+  extmem_ref &operator&=(T const &value) { store(load() & value); return *this; }
+  extmem_ref &operator|=(T const &value) { store(load() | value); return *this; }
+  extmem_ref &operator^=(T const &value) { store(load() ^ value); return *this; }
+
+  // word sized and aligned types use the single accesses, others a block
+  T load() const {
+    T value;
+    if constexpr (sizeof(T) == 1) {
+      uint8_t v = m_memory->read_byte(m_addr);
+      memcpy(&value, &v, 1);
+    } else if constexpr (sizeof(T) == 2 && alignof(T) >= 2) {
+      uint16_t v = m_memory->read_word(m_addr);
+      memcpy(&value, &v, 2);
+    } else if constexpr (sizeof(T) == 4 && alignof(T) >= 4) {
+      uint32_t v = m_memory->read_dword(m_addr);
+      memcpy(&value, &v, 4);
+    } else {
+      m_memory->read_data(m_addr, sizeof(T), (uint8_t*)&value);
+    }
+    return value;
+  }
+  void store(T const &value) const {
+    if constexpr (sizeof(T) == 1) {
+      uint8_t v;
+      memcpy(&v, &value, 1);
+      m_memory->write_byte(m_addr, v);
+    } else if constexpr (sizeof(T) == 2 && alignof(T) >= 2) {
+      uint16_t v;
+      memcpy(&v, &value, 2);
+      m_memory->write_word(m_addr, v);
+    } else if constexpr (sizeof(T) == 4 && alignof(T) >= 4) {
+      uint32_t v;
+      memcpy(&v, &value, 4);
+      m_memory->write_dword(m_addr, v);
+    } else {
+      m_memory->write_data(m_addr, sizeof(T), (uint8_t const*)&value);
+    }
+  }
+
+  uintptr_t addr() const { return m_addr; }
+
+private:
+  Mem *m_memory;
+  uintptr_t m_addr;
+};
+
+// Pointer to T in external memory, also a random access iterator. Every
+// dereference is one access through the memory; walk ranges with
+// ExtArray::for_each_line to pay one lookup per line instead.
+template<class T, class Mem = IMemory>
+class extmem_ptr {
+public:
+  using iterator_category = std::random_access_iterator_tag;
+  using value_type = T;
+  using difference_type = ptrdiff_t;
+  using pointer = void;
+  using reference = extmem_ref<T, Mem>;
+
+  extmem_ptr() : m_memory{nullptr}, m_addr{0} {}
+  extmem_ptr(Mem *memory, uintptr_t addr) : m_memory{memory}, m_addr{addr} {}
+
+  reference operator*() const { return {m_memory, m_addr}; }
+  reference operator[](difference_type i) const { return {m_memory, m_addr + i*sizeof(T)}; }
+
+  extmem_ptr &operator++() { m_addr += sizeof(T); return *this; }
+  extmem_ptr &operator--() { m_addr -= sizeof(T); return *this; }
+  extmem_ptr operator++(int) { extmem_ptr p = *this; ++*this; return p; }
+  extmem_ptr operator--(int) { extmem_ptr p = *this; --*this; return p; }
+  extmem_ptr &operator+=(difference_type n) { m_addr += n*sizeof(T); return *this; }
+  extmem_ptr &operator-=(difference_type n) { m_addr -= n*sizeof(T); return *this; }
+  extmem_ptr operator+(difference_type n) const { return {m_memory, m_addr + n*sizeof(T)}; }
+  extmem_ptr operator-(difference_type n) const { return {m_memory, m_addr - n*sizeof(T)}; }
+  friend extmem_ptr operator+(difference_type n, extmem_ptr p) { return p + n; }
+  difference_type operator-(extmem_ptr const &other) const { return (difference_type(m_addr) - difference_type(other.m_addr))/difference_type(sizeof(T)); }
+
+  bool operator==(extmem_ptr const &other) const { return m_addr == other.m_addr && m_memory == other.m_memory; }
+  bool operator!=(extmem_ptr const &other) const { return !(*this == other); }
+  bool operator<(extmem_ptr const &other) const { return m_addr < other.m_addr; }
+  bool operator>(extmem_ptr const &other) const { return m_addr > other.m_addr; }
+  bool operator<=(extmem_ptr const &other) const { return m_addr <= other.m_addr; }
+  bool operator>=(extmem_ptr const &other) const { return m_addr >= other.m_addr; }
+
+  Mem *memory() const { return m_memory; }
+  uintptr_t addr() const { return m_addr; }
+
+private:
+  Mem *m_memory;
+  uintptr_t m_addr;
+};
+
+// count elements of T from addr in external memory.
+//
+// for_each_line() and update_lines() hand the elements to f a line at a time
+// as a plain T array in SRAM: pinned in place when Mem can pin (CachedMemory),
+// otherwise copied through a chunk buffer. Either way a sequential scan costs
+// one cache lookup per line rather than one per element. An element that
+// straddles a line boundary is passed on its own, through a copy.
+template<class T, class Mem = IMemory>
+class ExtArray {
+  static_assert(std::is_trivially_copyable_v<T>, "external memory holds trivially copyable types only");
+public:
+  using value_type = T;
+  using iterator = extmem_ptr<T, Mem>;
+  using reference = extmem_ref<T, Mem>;
+
+  ExtArray(Mem *memory, uintptr_t addr, size_t count) : m_memory{memory}, m_addr{addr}, m_count{count} {}
+
+  size_t size() const { return m_count; }
+  uintptr_t addr() const { return m_addr; }
+  iterator begin() const { return {m_memory, m_addr}; }
+  iterator end() const { return {m_memory, m_addr + m_count*sizeof(T)}; }
+  reference operator[](size_t i) const { return {m_memory, m_addr + i*sizeof(T)}; }
+
+  ExtArray subarray(size_t first, size_t count) const { return {m_memory, m_addr + first*sizeof(T), count}; }
+
+  // f(T const *elements, size_t n) for each run of elements in a line
+  template<class F>
+  void for_each_line(F &&f) const {
+    visit<false>([&](T *elements, size_t n) { f((T const*)elements, n); });
+  }
+  // f(T *elements, size_t n); what f leaves in the elements is written back
+  template<class F>
+  void update_lines(F &&f) const {
+    visit<true>(f);
+  }
+
+private:
+  static constexpr uint32_t s_line_size = extmem_line_size<Mem>();
+
+  Mem *m_memory;
+  uintptr_t m_addr;
+  size_t m_count;
+
+  template<bool write, class F>
+  void visit(F &&f) const {
+    alignas(T) alignas(uint32_t) uint8_t buffer[s_line_size > sizeof(T) ? s_line_size : sizeof(T)];
+    uintptr_t addr = m_addr;
+    for (size_t i = 0; i < m_count;) {
+      uintptr_t line_end = (addr | (s_line_size-1)) + 1;
+      size_t n = (line_end - addr)/sizeof(T);
+      if (n > m_count - i) n = m_count - i;
+      if (n == 0) n = 1; // straddles the line end, copy it alone
+      uint32_t nbytes = n*sizeof(T);
+      uint8_t *pinned = nullptr;
+      if constexpr (extmem_can_pin<Mem>::value) {
+        // in place when T's alignment holds there
+        if (addr + nbytes <= line_end && addr % alignof(T) == 0) pinned = m_memory->pin(addr, nbytes);
+      }
+      if (pinned) {
+        f((T*)pinned, n);
+        if constexpr (extmem_can_pin<Mem>::value) m_memory->unpin(addr, nbytes, write);
+      } else {
+        m_memory->read_data(addr, nbytes, buffer);
+        f((T*)buffer, n);
+        if (write) m_memory->write_data(addr, nbytes, buffer);
+      }
+      addr += nbytes;
+      i += n;
+    }
+  }
+};
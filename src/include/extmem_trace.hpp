@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstdio>
+
+// Tracing of the accesses the mapper emulates. Compiled in by default, build
+// with PICO_EXTMEM_TRACE=0 to remove the hook from the fault path entirely.
+#ifndef PICO_EXTMEM_TRACE
+#define PICO_EXTMEM_TRACE 1
+#endif
+
+// One external memory access seen by the mapper.
+struct TraceRecord {
+  uint32_t pc;      // of the faulting or chained instruction
+  uint32_t addr;    // as accessed, before translation to a region offset
+  uint16_t size;    // bytes, the whole block for LDM/STM
+  uint8_t write;
+  uint8_t reserved;
+};
+
+// Ring buffer of the most recent accesses. Off until start() hands it a
+// buffer, which should be in SRAM; when full the oldest records are
+// overwritten. The records stay readable after stop(). print() writes them
+// out as text lines that tools/trace_sim replays against any cache geometry.
+class ExtmemTracer {
+public:
+  static void start(TraceRecord *buffer, uint32_t capacity);
+  static void stop() { s_running = false; }
+  static bool running() { return s_running; }
+
+  static void record(uint32_t pc, uintptr_t addr, uint16_t size, bool write) {
+    if (!s_running) return;
+    s_buffer[s_head] = {pc, uint32_t(addr), size, write, 0};
+    if (++s_head == s_capacity) s_head = 0;
+    s_total++;
+  }
+
+  // records held, and records lost to the ring wrapping
+  static uint32_t size() { return s_total < s_capacity ? s_total : s_capacity; }
+  static uint32_t dropped() { return s_total - size(); }
+  // copies up to max records out, oldest first
+  static uint32_t read(TraceRecord *out, uint32_t max);
+
+  // "T <pc> <addr> <size> <R|W>" per record, oldest first
+  static void print(FILE *out = stdout);
+  // one print() line back into a record, false for any other line
+  static bool parse(const char *line, TraceRecord &record);
+
+private:
+  static bool s_running;
+  static TraceRecord *s_buffer;
+  static uint32_t s_capacity;
+  static uint32_t s_head;
+  static uint32_t s_total;
+};
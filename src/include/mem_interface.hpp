@@ -1,6 +1,37 @@
 #pragma once
 
 #include "stdint.h"
+#include <atomic>
+
+// Performance counters in CachedMemory and the mapper. On by default, build
+// with PICO_EXTMEM_STATS=0 to compile them out.
+#ifndef PICO_EXTMEM_STATS
+#define PICO_EXTMEM_STATS 1
+#endif
+#if PICO_EXTMEM_STATS
+#define EXTMEM_COUNT(stmt) (stmt)
+#else
+#define EXTMEM_COUNT(stmt) ((void)0)
+#endif
+
+// A read or write submitted to IMemory::submit. The descriptor and its data
+// must stay alive until status reads DONE.
+struct MemTransaction {
+  enum Op : uint8_t { READ, WRITE };
+  enum Status : uint8_t { IDLE, PENDING, DONE };
+
+  Op op;
+  uintptr_t addr;
+  uint32_t nbytes;
+  uint8_t *data;
+  // called once the transaction is done, from poll() or the backend's own
+  // completion context (a DMA interrupt or worker thread)
+  void (*on_complete)(MemTransaction *t, void *ctx);
+  void *ctx;
+
+  std::atomic<Status> status{IDLE};
+  MemTransaction *next; // free for the backend to queue with
+};
 
 class IMemory {
 public:
@@ -17,9 +48,50 @@ public:
   virtual void write_dword(uintptr_t addr, uint32_t value) = 0;
   virtual void write_data(uintptr_t addr, uint32_t nbytes, uint8_t const *data) = 0;
 
+  // Sets nbytes from addr to zero. The default writes zeros, memories that
+  // track zeroed regions (ZeroElidingMemory) do it without the bus.
+  virtual void zero_data(uintptr_t addr, uint32_t nbytes) {
+    static const uint8_t zeros[64] = {};
+    while (nbytes) {
+      uint32_t n = nbytes < sizeof(zeros) ? nbytes : sizeof(zeros);
+      write_data(addr, n, zeros);
+      addr += n;
+      nbytes -= n;
+    }
+  }
+
+  // Writes out anything held back from the memory below, dirty cache lines
+  // or combined writes, down to the device. Call it before accessing the
+  // device some other way.
+  virtual void flush() {}
+
   virtual uint32_t max_read() const = 0;
   virtual uint32_t max_write() const = 0;
 
   virtual uint32_t size_bytes() const = 0;
-};
 
+  // Asynchronous transactions. Backends complete them in submission order,
+  // and blocking calls are ordered after everything already submitted. The
+  // default runs the transaction with the blocking calls before returning.
+  virtual void submit(MemTransaction *t) {
+    t->status = MemTransaction::PENDING;
+    if (t->op == MemTransaction::READ) read_data(t->addr, t->nbytes, t->data);
+    else write_data(t->addr, t->nbytes, t->data);
+    complete(t);
+  }
+  // Progresses outstanding transactions, true while any are still pending.
+  virtual bool poll() { return false; }
+
+  void wait(MemTransaction *t) {
+    while (t->status.load(std::memory_order_acquire) != MemTransaction::DONE) poll();
+  }
+
+protected:
+  static void complete(MemTransaction *t) {
+    // once DONE is visible the owner may reuse t, so read the callback first
+    auto on_complete = t->on_complete;
+    auto ctx = t->ctx;
+    t->status.store(MemTransaction::DONE, std::memory_order_release);
+    if (on_complete) on_complete(t, ctx);
+  }
+};
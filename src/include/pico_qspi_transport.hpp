@@ -0,0 +1,41 @@
+#pragma once
+
+#include <pico/stdlib.h>
+#include "hardware/pio.h"
+#include "spi_transport.hpp"
+
+// Quad SPI on a PIO state machine, SIO0-3 on consecutive pins. Data phases
+// run on DMA. Until set_quad(true) the bus is bit-banged as plain SPI
+// (SIO0 out, SIO1 in), which is only meant for the commands that put the
+// device into QPI mode.
+class PicoQspiTransport final : public ISpiTransport {
+  public:
+    // clkdiv 2: SCK at a quarter of the system clock, 31.25MHz at 125MHz
+    PicoQspiTransport(PIO pio, uint sio0, uint sclk, uint cs, float clkdiv = 2.f);
+
+    void select() { gpio_put(cs, 0); }
+    void deselect() { gpio_put(cs, 1); }
+
+    void write(uint8_t const *data, uint32_t nbytes);
+    void read(uint8_t *data, uint32_t nbytes);
+
+    void write_async(uint8_t const *data, uint32_t nbytes);
+    void read_async(uint8_t *data, uint32_t nbytes);
+    bool busy();
+
+    bool supports_quad() const { return true; }
+    void set_quad(bool quad);
+
+  private:
+    PIO pio;
+    uint sm;
+    uint offset;
+    uint sio0, sclk, cs;
+    bool quad;
+    uint dma_tx, dma_rx;
+
+    void start(uint32_t write_nibbles, uint32_t read_nibbles);
+    // back at top waiting for the next phase, every nibble clocked out
+    bool idle();
+    void bitbang(uint8_t const *tx, uint8_t *rx, uint32_t nbytes);
+};
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <pico/stdlib.h>
+#include "hardware/spi.h"
+#include "spi_transport.hpp"
+
+// SPI peripheral with a GPIO chip select, data phases on two DMA channels.
+class PicoSpiTransport final : public ISpiTransport {
+  public:
+    PicoSpiTransport(spi_inst_t *spi, uint mosi, uint miso, uint sclk, uint cs, uint baudrate = 31'250'000);
+
+    void select() { gpio_put(cs, 0); }
+    void deselect() { gpio_put(cs, 1); }
+
+    void write(uint8_t const *data, uint32_t nbytes);
+    void read(uint8_t *data, uint32_t nbytes);
+
+    void write_async(uint8_t const *data, uint32_t nbytes);
+    void read_async(uint8_t *data, uint32_t nbytes);
+    bool busy();
+
+  private:
+    spi_inst_t *spi;
+    uint cs;
+    uint dma_tx, dma_rx;
+
+    void dma_start(uint8_t const *tx, bool tx_inc, uint8_t *rx, bool rx_inc, uint32_t nbytes);
+};
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "spi_transport.hpp"
+#include <vector>
+
+// Software model of an APS6404-style 8MB SPI PSRAM for host builds. It
+// decodes the byte stream SpiRam sends and counts what it costs on the bus.
+// Like the device, bursts wrap within a 1KB page; the model counts those
+// wraps as page crossings, which a correct driver never causes.
+//
+// The device starts in SPI mode; ENTER_QUAD (0x35) switches it to QPI, where
+// commands, addresses and data all use four lines. The transport side follows
+// set_quad(), and clocking bytes at a width the device isn't in is an error,
+// except for a single quad byte to a device in SPI mode: two clocks of a
+// command, which the device drops, as drivers rely on to leave QPI mode
+// without knowing which mode the device is in.
+//
+// The device refreshes only while deselected; a frame longer than tCEM
+// (8us, 250 clocks at 31.25MHz) risks losing data and counts as an error.
+class PsramModel final : public ISpiTransport {
+public:
+  static constexpr uint32_t s_size = 0x0080'0000;
+  static constexpr uint32_t s_page_size = 1024;
+  static constexpr uint32_t s_max_select_clocks = 250;
+
+  struct Stats {
+    uint32_t selects;
+    uint32_t commands;
+    uint32_t command_bytes; // command, address and wait cycle bytes
+    uint32_t data_bytes;
+    uint64_t clocks;
+    uint32_t errors;        // bad commands, truncated frames, data in the wrong direction
+    uint32_t page_crossings;
+    uint32_t long_selects;  // frames over tCEM, also counted as errors
+  };
+
+  PsramModel();
+
+  void select() override;
+  void deselect() override;
+  void write(uint8_t const *data, uint32_t nbytes) override;
+  void read(uint8_t *data, uint32_t nbytes) override;
+
+  bool supports_quad() const override { return true; }
+  void set_quad(bool quad) override { m_bus_quad = quad; }
+  bool qpi() const { return m_qpi; }
+
+  uint8_t *data() { return m_storage.data(); }
+  Stats const &stats() const { return m_stats; }
+  void reset_stats() { m_stats = {}; m_select_clocks = 0; }
+
+private:
+  enum State : uint8_t { IDLE, COMMAND, ADDRESS, DUMMY, READ_DATA, WRITE_DATA, ID_DATA, DONE, DROPPED };
+
+  std::vector<uint8_t> m_storage;
+  Stats m_stats;
+  State m_state;
+  uint8_t m_command;
+  uint8_t m_last_command; // of the previous frame, for reset enable
+  unsigned m_count;       // bytes into the current phase
+  uint32_t m_addr;
+  bool m_wrapped;
+  bool m_qpi;             // device mode
+  bool m_bus_quad;        // transport mode
+  uint8_t m_wait;         // wait cycle bytes left
+  uint64_t m_select_clocks; // clock count at select
+
+  void data_byte();
+  uint8_t clock(uint8_t mosi, bool reading);
+  void next_addr();
+};
@@ -0,0 +1,147 @@
+#pragma once
+
+#include "mem_interface.hpp"
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Simulated memories for host (Linux) builds.
+
+class ByteArrayMemory : public IMemory {
+public:
+  uint8_t read_byte(uintptr_t addr) override;
+  uint16_t read_word(uintptr_t addr) override;
+  uint32_t read_dword(uintptr_t addr) override;
+  void read_data(uintptr_t addr, uint32_t nbytes, uint8_t *data) override;
+
+  void write_byte(uintptr_t addr, uint8_t value) override;
+  void write_word(uintptr_t addr, uint16_t value) override;
+  void write_dword(uintptr_t addr, uint32_t value) override;
+  void write_data(uintptr_t addr, uint32_t nbytes, uint8_t const *data) override;
+
+  uint32_t max_read() const override { return m_size; }
+  uint32_t max_write() const override { return m_size; }
+
+  uint32_t size_bytes() const override { return m_size; }
+
+  uint8_t *data() { return m_data; }
+
+protected:
+  ByteArrayMemory() : m_data{nullptr}, m_size{0} {}
+
+  uint8_t *m_data;
+  uint32_t m_size;
+};
+
+// Plain heap-backed memory.
+class RamMemory final : public ByteArrayMemory {
+public:
+  RamMemory(uint32_t size_bytes = 0x0080'0000);
+
+private:
+  std::vector<uint8_t> m_storage;
+};
+
+// Memory backed by a file mapped with mmap, so contents survive between runs.
+class MmapMemory final : public ByteArrayMemory {
+public:
+  MmapMemory(const char *path, uint32_t size_bytes = 0x0080'0000);
+  ~MmapMemory();
+
+  bool ok() const { return m_data != nullptr; }
+};
+
+// Wraps another memory and charges each transaction a fixed cost plus a
+// cost per byte, in the same shape as a SpiRam command + data transfer.
+class LatencyMemory final : public IMemory {
+public:
+  struct Cost {
+    uint32_t ns_per_transaction;
+    uint32_t ns_per_byte;
+  };
+  // 4 command bytes + CS toggle, then 8 clocks per byte at 31.25MHz
+  static constexpr Cost s_spiram_cost{1100, 256};
+
+  LatencyMemory(IMemory *memory, Cost cost = s_spiram_cost, bool spin = false);
+
+  uint8_t read_byte(uintptr_t addr) final override;
+  uint16_t read_word(uintptr_t addr) final override;
+  uint32_t read_dword(uintptr_t addr) final override;
+  void read_data(uintptr_t addr, uint32_t nbytes, uint8_t *data) final override;
+
+  void write_byte(uintptr_t addr, uint8_t value) final override;
+  void write_word(uintptr_t addr, uint16_t value) final override;
+  void write_dword(uintptr_t addr, uint32_t value) final override;
+  void write_data(uintptr_t addr, uint32_t nbytes, uint8_t const *data) final override;
+  // charged as a write of nbytes: a SpiRam has no zeroing command
+  void zero_data(uintptr_t addr, uint32_t nbytes) final override;
+
+  uint32_t max_read() const final override { return m_memory->max_read(); }
+  uint32_t max_write() const final override { return m_memory->max_write(); }
+
+  uint32_t size_bytes() const final override { return m_memory->size_bytes(); }
+
+  void flush() final override { m_memory->flush(); }
+
+  // Simulated bus time and traffic since construction or the last reset.
+  uint64_t elapsed_ns() const { return m_elapsed_ns; }
+  uint64_t transactions() const { return m_transactions; }
+  uint64_t bytes() const { return m_bytes; }
+  void reset_counters();
+
+private:
+  IMemory *const m_memory;
+  const Cost m_cost;
+  const bool m_spin;
+
+  uint64_t m_elapsed_ns;
+  uint64_t m_transactions;
+  uint64_t m_bytes;
+
+  void charge(uint32_t nbytes);
+};
+
+// Wraps another memory and performs submitted transactions on a background
+// thread, like a DMA engine would. Wrap a spinning LatencyMemory to simulate
+// transfers that take time while the caller carries on.
+class ThreadedMemory final : public IMemory {
+public:
+  ThreadedMemory(IMemory *memory);
+  ~ThreadedMemory();
+
+  uint8_t read_byte(uintptr_t addr) final override;
+  uint16_t read_word(uintptr_t addr) final override;
+  uint32_t read_dword(uintptr_t addr) final override;
+  void read_data(uintptr_t addr, uint32_t nbytes, uint8_t *data) final override;
+
+  void write_byte(uintptr_t addr, uint8_t value) final override;
+  void write_word(uintptr_t addr, uint16_t value) final override;
+  void write_dword(uintptr_t addr, uint32_t value) final override;
+  void write_data(uintptr_t addr, uint32_t nbytes, uint8_t const *data) final override;
+  void zero_data(uintptr_t addr, uint32_t nbytes) final override;
+
+  uint32_t max_read() const final override { return m_memory->max_read(); }
+  uint32_t max_write() const final override { return m_memory->max_write(); }
+
+  uint32_t size_bytes() const final override { return m_memory->size_bytes(); }
+
+  void flush() final override;
+
+  void submit(MemTransaction *t) final override;
+  bool poll() final override;
+
+private:
+  IMemory *const m_memory;
+
+  std::mutex m_lock;
+  std::condition_variable m_wake;
+  std::deque<MemTransaction*> m_queue;
+  bool m_busy;
+  bool m_stop;
+  std::thread m_worker;
+
+  void drain();
+  void run();
+};
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+
+// Byte stream to an SPI device with a chip select. SpiRam frames its
+// commands over one of these, so the command stream can run against real
+// hardware or a software model of the device.
+class ISpiTransport {
+public:
+  virtual ~ISpiTransport(){}
+
+  // assert/release chip select; everything in between is one frame
+  virtual void select() = 0;
+  virtual void deselect() = 0;
+
+  virtual void write(uint8_t const *data, uint32_t nbytes) = 0;
+  virtual void read(uint8_t *data, uint32_t nbytes) = 0;
+
+  // Data phase started in the background (DMA), done once busy() is false.
+  // The default transfers before returning.
+  virtual void write_async(uint8_t const *data, uint32_t nbytes) { write(data, nbytes); }
+  virtual void read_async(uint8_t *data, uint32_t nbytes) { read(data, nbytes); }
+  virtual bool busy() { return false; }
+
+  // Quad (QPI) mode moves every byte over four data lines in two clocks.
+  // Only called when supports_quad() is true.
+  virtual bool supports_quad() const { return false; }
+  virtual void set_quad(bool quad) {}
+};
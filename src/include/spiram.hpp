@@ -1,13 +1,37 @@
 #pragma once
 
 #include <stdint.h>
-#include <pico/stdlib.h>
+#include <memory>
 #include "mem_interface.hpp"
+#include "spi_transport.hpp"
+#if !PICO_EXTMEM_HOST
+#include <pico/stdlib.h>
+#endif
 
 class SpiRam final : public IMemory{
   public:
+    // The device wraps bursts within a page, so every burst is split at page
+    // boundaries.
+    static constexpr uint32_t s_page_size = 1024;
+    // The device only refreshes while deselected, so CS may stay low for at
+    // most tCEM, 8us: 250 clocks at the transports' 31.25MHz SCK. Bursts are
+    // also split so that command, wait cycles and data fit in that.
+    static constexpr uint32_t s_max_select_clocks = 250;
+    static constexpr uint32_t max_burst(bool quad) {
+      return quad ? (s_max_select_clocks - 7*2)/2 : (s_max_select_clocks - 4*8)/8;
+    }
+    // small blocking writes to consecutive addresses are combined up to this
+    static constexpr uint32_t s_write_buffer_size = 32;
+
+    // With quad set and a transport that supports it, the device is switched
+    // to QPI mode and accessed with READ_FAST_QUAD / WRITE_QUAD.
+    SpiRam(ISpiTransport &spi, bool quad = false);
+#if !PICO_EXTMEM_HOST
     SpiRam(uint mosi, uint miso, uint sclk, uint cs);
-    ~SpiRam(){}
+    // QPI over PIO, SIO0-3 on consecutive pins from sio0
+    SpiRam(uint sio0, uint sclk, uint cs);
+#endif
+    ~SpiRam();
 
     uint8_t read_byte(uintptr_t addr);
     uint16_t read_word(uintptr_t addr);
@@ -19,12 +43,45 @@ class SpiRam final : public IMemory{
     void write_dword(uintptr_t addr, uint32_t value);
     void write_data(uintptr_t addr, uint32_t nbytes, uint8_t const *data);
 
-    uint32_t max_read() const { return 1024; }
-    uint32_t max_write() const { return 1024; }
+    uint32_t max_read() const { return size_bytes(); }
+    uint32_t max_write() const { return size_bytes(); }
 
     uint32_t size_bytes() const { return 0x0080'0000; } // 8MB
 
+    // Transactions run one segment at a time on the transport, progressed by
+    // poll(). A queued transaction that continues the previous one (same op,
+    // next address, same page) is merged into its burst without raising CS,
+    // up to max_burst() bytes.
+    void submit(MemTransaction *t) override;
+    bool poll() override;
+
+    // writes out the combined small writes
+    void flush() override;
+
+    bool quad() const { return qpi; }
+
   protected:
   private:
-    uint cs;
+    ISpiTransport *spi;
+    std::unique_ptr<ISpiTransport> owned_spi;
+    bool qpi;
+
+    MemTransaction *queue_head, *queue_tail;
+    uint32_t seg_offset, seg_len; // running segment of queue_head
+    bool burst_open;              // CS still low after the last segment
+    MemTransaction::Op burst_op;
+    uintptr_t burst_next;         // address the open burst continues at
+    uint32_t burst_len;           // data bytes since the open burst's select
+
+    uint8_t write_buf[s_write_buffer_size];
+    uintptr_t write_buf_addr;
+    uint32_t write_buf_len;
+
+    void reset(bool quad);
+    void send_single(uint8_t cmd);
+    void drain() { while (poll()); }
+    void send_cmd(MemTransaction::Op op, uintptr_t addr);
+    void transfer(MemTransaction::Op op, uintptr_t addr, uint32_t nbytes, uint8_t *data);
+    void write_small(uintptr_t addr, uint8_t const *data, uint32_t nbytes);
+    void start_segment();
 };
\ No newline at end of file
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdint.h>
+#include <array>
+
+// Detects constant strides between the lines a cache fills and predicts the
+// lines that follow. Strides are counted in lines, so sequential word loops
+// show up as a stride of 1 and a loop stepping over two lines as 2.
+template<unsigned int nstreams = 4>
+class StridePrefetcher {
+public:
+  // lines further apart than this are treated as separate streams
+  static constexpr intptr_t s_max_stride = 16;
+
+  // degree lines are prefetched, starting distance strides ahead of the access.
+  // A degree of 0 disables prefetching.
+  void configure(unsigned int degree, unsigned int distance) {
+    m_degree = degree;
+    m_distance = distance ? distance : 1;
+    m_streams = {};
+  }
+  bool enabled() const { return m_degree != 0; }
+
+  // Trains on an access to line number `line`, calling prefetch(line) for each
+  // line predicted by a stream that has seen the same stride twice.
+  template<class F>
+  void access(intptr_t line, F &&prefetch) {
+    Stream *match = nullptr;
+    intptr_t best = s_max_stride+1;
+    for (auto &s : m_streams) {
+      if (!s.valid) continue;
+      intptr_t delta = line - s.last;
+      if (delta == 0) return;
+      if (delta == s.stride) {
+        match = &s;
+        break;
+      }
+      intptr_t distance = delta < 0 ? -delta : delta;
+      if (distance < best) {
+        best = distance;
+        match = &s;
+      }
+    }
+    if (!match) {
+      m_streams[m_next] = Stream{line, 0, 0, true};
+      m_next = (m_next+1)%nstreams;
+      return;
+    }
+
+    intptr_t delta = line - match->last;
+    if (delta == match->stride) {
+      if (match->confidence < 3) match->confidence++;
+    } else {
+      match->stride = delta;
+      match->confidence = 0;
+    }
+    match->last = line;
+    if (!match->confidence) return;
+    for (unsigned int d = m_distance; d < m_distance + m_degree; d++) {
+      prefetch(line + match->stride*intptr_t(d));
+    }
+  }
+
+private:
+  struct Stream {
+    intptr_t last;
+    intptr_t stride;
+    uint8_t confidence;
+    bool valid;
+  };
+  std::array<Stream, nstreams> m_streams{};
+  uint8_t m_next = 0;
+  uint8_t m_degree = 0;
+  uint8_t m_distance = 1;
+};
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+#include "exception_pushstack.hpp"
+
+// A Thumb load/store decoded into what the emulation needs to perform it:
+// register slots in the exception_pushstack, a scaled immediate and the
+// access width. Decoding is kept apart from the memory access so repeat
+// faults can skip it, and so it can be tested on the host.
+//
+// The flag-setting low register ALU ops and branches are decoded too, so the
+// instructions between accesses can be emulated without leaving the fault.
+struct DecodedOp {
+  enum Kind : uint8_t { NONE, LOAD, STORE, LOAD_MULTIPLE, STORE_MULTIPLE, ALU, BRANCH, NUM_KINDS };
+  // result = rn <op> operand, operand being rm or imm
+  enum Alu : uint8_t { MOV, MVN, AND, EOR, ORR, BIC, TST, ADD, ADC, SUB, SBC, NEG, CMP, CMN, MUL, LSL, LSR, ASR, ROR, NUM_ALU };
+  // pseudo slots: the pre-exception stack pointer, and no offset register
+  static constexpr uint8_t SP_SLOT = 0xff;
+  static constexpr uint8_t NO_SLOT = 0xfe;
+
+  const char *type;
+  Kind kind;
+  uint8_t size;     // access width in bytes, the whole block for LDM/STM
+  bool sign;        // sign extend loads
+  bool writeback;   // LDM/STM update the base register
+  uint8_t rt;       // transfer or destination register slot, NO_SLOT for compares
+  uint8_t rn;       // base register or first operand slot, or SP_SLOT
+  uint8_t rm;       // offset register or operand slot, or NO_SLOT to use imm
+  uint8_t reglist;  // LDM/STM registers r0-r7
+  Alu alu;
+  uint8_t cond;     // branch condition, 0xe for always
+  int32_t imm;      // byte offset scaled by the access width, ALU immediate
+                    // or shift, or branch offset from the next instruction
+};
+
+DecodedOp thumb_decode(uint16_t opcode);
+
+// slot in the exception_pushstack of one of r0-r7, lr or pc
+constexpr uint8_t thumb_reg_slot(uint8_t reg) { return exception_pushstack::regs_mapping[reg]; }
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "cached_memory.hpp"
+#include "sim_memory.hpp"
+#include "extmem_trace.hpp"
+#include <map>
+#include <vector>
+
+// Replays mapper traces (see ExtmemTracer) against a cache geometry on the
+// host, over a LatencyMemory charging the given bus cost.
+
+struct ReplayResult {
+  CacheStats cache;
+  uint32_t accesses;
+  uint32_t skipped;        // records outside the replayed memory
+  uint64_t bus_transactions;
+  uint64_t bus_bytes;
+  uint64_t bus_ns;         // estimated time spent on the bus
+  struct Page {
+    uint32_t accesses;
+    uint32_t misses;
+  };
+  std::map<uint32_t, Page> pages; // by page index, offset/page_size
+};
+
+// Records are replayed at addr - base; write data is zero, only the access
+// pattern matters. Lines still dirty at the end are not written back.
+template<class Cache>
+ReplayResult trace_replay(std::vector<TraceRecord> const &trace, uintptr_t base,
+                          LatencyMemory::Cost cost = LatencyMemory::s_spiram_cost,
+                          uint32_t page_size = 1024, uint32_t size_bytes = 0x0080'0000) {
+  RamMemory ram{size_bytes};
+  LatencyMemory bus{&ram, cost};
+  Cache cache{&bus};
+  ReplayResult result{};
+  uint8_t block[256] = {};
+  for (TraceRecord const &r : trace) {
+    uintptr_t offset = uintptr_t(r.addr) - base;
+    if (offset >= size_bytes || size_bytes - offset < r.size || r.size > sizeof(block)) {
+      result.skipped++;
+      continue;
+    }
+    uint32_t misses = cache.stats().misses;
+    switch (r.write ? -int(r.size) : int(r.size)) {
+      case 1: cache.read_byte(offset); break;
+      case 2: cache.read_word(offset); break;
+      case 4: cache.read_dword(offset); break;
+      case -1: cache.write_byte(offset, 0); break;
+      case -2: cache.write_word(offset, 0); break;
+      case -4: cache.write_dword(offset, 0); break;
+      default:
+        if (r.write) cache.write_data(offset, r.size, block);
+        else cache.read_data(offset, r.size, block);
+    }
+    result.accesses++;
+    ReplayResult::Page &page = result.pages[offset/page_size];
+    page.accesses++;
+    page.misses += cache.stats().misses - misses;
+  }
+  result.cache = cache.stats();
+  result.bus_transactions = bus.transactions();
+  result.bus_bytes = bus.bytes();
+  result.bus_ns = bus.elapsed_ns();
+  return result;
+}
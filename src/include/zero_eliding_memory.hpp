@@ -0,0 +1,104 @@
+#pragma once
+
+#include "mem_interface.hpp"
+#include <memory>
+
+// Counted while PICO_EXTMEM_STATS is on.
+struct ZeroStats {
+  uint32_t bytes_read;       // served as zeros without the bus
+  uint32_t bytes_written;    // zeros not written to blocks known to be zero
+  uint32_t bytes_zeroed;     // zero_data() done by clearing blocks
+  uint32_t block_fills;      // first partial writes to a block, written as a whole block
+};
+
+// Wraps a memory and tracks, per block of 2^block_size_pow2 bytes, whether
+// the block has ever been written; the bitmap is in SRAM. A block that
+// hasn't is known to be zero: reads of it are zeros without bus traffic,
+// and zero_data() over whole blocks just clears their bits. The first write
+// that covers only part of a block writes the whole block, zeros around the
+// data, so the backing memory's power-up contents never show through.
+//
+// Put it between a CachedMemory and the device; a cache line fetched from
+// untouched memory then costs nothing.
+class ZeroElidingMemory final : public IMemory {
+public:
+  static constexpr uint32_t s_default_block_size_pow2 = 10;
+
+  // every block starts known zero; the memory's size must be a multiple of the block
+  ZeroElidingMemory(IMemory *memory, uint32_t block_size_pow2 = s_default_block_size_pow2);
+
+  uint8_t read_byte(uintptr_t addr) final override { return read<uint8_t>(addr); }
+  uint16_t read_word(uintptr_t addr) final override { return read<uint16_t>(addr); }
+  uint32_t read_dword(uintptr_t addr) final override { return read<uint32_t>(addr); }
+  void read_data(uintptr_t addr, uint32_t nbytes, uint8_t *data) final override;
+
+  void write_byte(uintptr_t addr, uint8_t value) final override { write<uint8_t>(addr, value); }
+  void write_word(uintptr_t addr, uint16_t value) final override { write<uint16_t>(addr, value); }
+  void write_dword(uintptr_t addr, uint32_t value) final override { write<uint32_t>(addr, value); }
+  void write_data(uintptr_t addr, uint32_t nbytes, uint8_t const *data) final override;
+  void zero_data(uintptr_t addr, uint32_t nbytes) final override;
+  void flush() final override { m_memory->flush(); }
+
+  uint32_t max_read() const final override { return m_memory->size_bytes(); }
+  uint32_t max_write() const final override { return m_memory->size_bytes(); }
+
+  uint32_t size_bytes() const final override { return m_memory->size_bytes(); }
+
+  // Transactions wholly in written blocks, or writes covering the blocks
+  // they touch, go to the backing memory as they are; reads wholly in zero
+  // blocks complete at once; anything else runs blocking.
+  void submit(MemTransaction *t) final override;
+  bool poll() final override { return m_memory->poll(); }
+
+  uint32_t block_size() const { return 1u<<m_block_size_pow2; }
+  bool written(uintptr_t addr) const { return block_written(addr>>m_block_size_pow2); }
+  uint32_t blocks_written() const;
+
+  ZeroStats &stats() { return m_stats; }
+  void reset_stats() { m_stats = {}; }
+
+private:
+  IMemory *const m_memory;
+  const uint32_t m_block_size_pow2;
+  const uint32_t m_num_blocks;
+  std::unique_ptr<uint32_t[]> m_written;
+  std::unique_ptr<uint8_t[]> m_block;  // staging for block fills
+  ZeroStats m_stats;
+
+  bool block_written(uint32_t block) const { return m_written[block/32]>>(block%32)&1; }
+  void set_written(uint32_t block, bool written) {
+    if (written) m_written[block/32] |= 1u<<(block%32);
+    else m_written[block/32] &= ~(1u<<(block%32));
+  }
+  // whether every block nbytes from addr touches is written / known zero
+  bool all_written(uintptr_t addr, uint32_t nbytes, bool written) const;
+
+  template<class T>
+  T read(uintptr_t addr) {
+    uint32_t block = addr>>m_block_size_pow2;
+    if (block == (addr + sizeof(T) - 1)>>m_block_size_pow2) {
+      if (block_written(block)) {
+        if constexpr (sizeof(T) == 1) return m_memory->read_byte(addr);
+        else if constexpr (sizeof(T) == 2) return m_memory->read_word(addr);
+        else return m_memory->read_dword(addr);
+      }
+      EXTMEM_COUNT(m_stats.bytes_read += sizeof(T));
+      return 0;
+    }
+    T value;
+    read_data(addr, sizeof(T), (uint8_t*)&value);
+    return value;
+  }
+
+  template<class T>
+  void write(uintptr_t addr, T value) {
+    uint32_t block = addr>>m_block_size_pow2;
+    if (block == (addr + sizeof(T) - 1)>>m_block_size_pow2 && block_written(block)) {
+      if constexpr (sizeof(T) == 1) m_memory->write_byte(addr, value);
+      else if constexpr (sizeof(T) == 2) m_memory->write_word(addr, value);
+      else m_memory->write_dword(addr, value);
+      return;
+    }
+    write_data(addr, sizeof(T), (uint8_t const*)&value);
+  }
+};
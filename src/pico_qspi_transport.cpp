@@ -0,0 +1,136 @@
+#include "pico_qspi_transport.hpp"
+#include "hardware/dma.h"
+#include "qspi.pio.h"
+
+PicoQspiTransport::PicoQspiTransport(PIO pio, uint sio0, uint sclk, uint cs, float clkdiv)
+: pio{pio}
+, sio0{sio0}
+, sclk{sclk}
+, cs{cs}
+, quad{true}
+{
+  gpio_init(cs);
+  gpio_set_dir(cs, GPIO_OUT);
+  gpio_put(cs, 1);
+
+  sm = pio_claim_unused_sm(pio, true);
+  offset = pio_add_program(pio, &qspi_program);
+  pio_sm_config c = qspi_program_get_default_config(offset);
+  sm_config_set_out_pins(&c, sio0, 4);
+  sm_config_set_set_pins(&c, sio0, 4);
+  sm_config_set_in_pins(&c, sio0);
+  sm_config_set_sideset_pins(&c, sclk);
+  // MSB first, a byte per FIFO word
+  sm_config_set_out_shift(&c, false, true, 8);
+  sm_config_set_in_shift(&c, false, true, 8);
+  sm_config_set_clkdiv(&c, clkdiv);
+  pio_sm_init(pio, sm, offset, &c);
+
+  dma_tx = dma_claim_unused_channel(true);
+  dma_rx = dma_claim_unused_channel(true);
+
+  set_quad(false);
+
+  // give the device time to power up before the first command
+  sleep_ms(1);
+}
+
+void PicoQspiTransport::set_quad(bool q) {
+  if (q == quad) return;
+  quad = q;
+  if (quad) {
+    for (uint i = 0; i < 4; i++) pio_gpio_init(pio, sio0 + i);
+    pio_gpio_init(pio, sclk);
+    pio_sm_set_consecutive_pindirs(pio, sm, sclk, 1, true);
+    pio_sm_set_enabled(pio, sm, true);
+  } else {
+    pio_sm_set_enabled(pio, sm, false);
+    for (uint pin : {sio0, sio0 + 1, sio0 + 2, sio0 + 3, sclk}) gpio_init(pin);
+    gpio_set_dir(sio0, GPIO_OUT);
+    gpio_set_dir(sclk, GPIO_OUT);
+    // hold /WP and /HOLD (SIO2, SIO3) high in SPI mode
+    gpio_set_dir(sio0 + 2, GPIO_OUT);
+    gpio_set_dir(sio0 + 3, GPIO_OUT);
+    gpio_put(sio0 + 2, 1);
+    gpio_put(sio0 + 3, 1);
+  }
+}
+
+void PicoQspiTransport::bitbang(uint8_t const *tx, uint8_t *rx, uint32_t nbytes) {
+  for (uint32_t i = 0; i < nbytes; i++) {
+    uint8_t out = tx ? tx[i] : 0, in = 0;
+    for (int bit = 7; bit >= 0; bit--) {
+      gpio_put(sio0, (out >> bit) & 1);
+      gpio_put(sclk, 1);
+      in = (in << 1) | gpio_get(sio0 + 1);
+      gpio_put(sclk, 0);
+    }
+    if (rx) rx[i] = in;
+  }
+}
+
+void PicoQspiTransport::start(uint32_t write_nibbles, uint32_t read_nibbles) {
+  pio_sm_put_blocking(pio, sm, write_nibbles);
+  pio_sm_put_blocking(pio, sm, read_nibbles);
+}
+
+// TXSTALL can't tell: it is set whenever the state machine waits for data
+// mid-phase, and with the FIFO empty the last byte may still be in the OSR.
+// Back at top with nothing queued, the last clock edge has gone out.
+bool PicoQspiTransport::idle() {
+  return pio_sm_is_tx_fifo_empty(pio, sm) && pio_sm_get_pc(pio, sm) == offset + qspi_offset_top;
+}
+
+void PicoQspiTransport::write(uint8_t const *data, uint32_t nbytes) {
+  if (!quad) {
+    bitbang(data, nullptr, nbytes);
+    return;
+  }
+  start(nbytes*2, 0);
+  for (uint32_t i = 0; i < nbytes; i++) pio_sm_put_blocking(pio, sm, uint32_t(data[i]) << 24);
+  while (!idle());
+}
+
+void PicoQspiTransport::read(uint8_t *data, uint32_t nbytes) {
+  if (!quad) {
+    bitbang(nullptr, data, nbytes);
+    return;
+  }
+  start(0, nbytes*2);
+  for (uint32_t i = 0; i < nbytes; i++) data[i] = pio_sm_get_blocking(pio, sm);
+}
+
+void PicoQspiTransport::write_async(uint8_t const *data, uint32_t nbytes) {
+  if (!quad) {
+    write(data, nbytes);
+    return;
+  }
+  start(nbytes*2, 0);
+  // a byte write to the FIFO is replicated across the word, so its top
+  // nibbles are the ones shifted out
+  dma_channel_config c = dma_channel_get_default_config(dma_tx);
+  channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+  channel_config_set_dreq(&c, pio_get_dreq(pio, sm, true));
+  channel_config_set_read_increment(&c, true);
+  channel_config_set_write_increment(&c, false);
+  dma_channel_configure(dma_tx, &c, &pio->txf[sm], data, nbytes, true);
+}
+
+void PicoQspiTransport::read_async(uint8_t *data, uint32_t nbytes) {
+  if (!quad) {
+    read(data, nbytes);
+    return;
+  }
+  dma_channel_config c = dma_channel_get_default_config(dma_rx);
+  channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+  channel_config_set_dreq(&c, pio_get_dreq(pio, sm, false));
+  channel_config_set_read_increment(&c, false);
+  channel_config_set_write_increment(&c, true);
+  dma_channel_configure(dma_rx, &c, data, &pio->rxf[sm], nbytes, true);
+  start(0, nbytes*2);
+}
+
+bool PicoQspiTransport::busy() {
+  if (!quad) return false;
+  return dma_channel_is_busy(dma_tx) || dma_channel_is_busy(dma_rx) || !idle();
+}
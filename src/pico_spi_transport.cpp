@@ -0,0 +1,63 @@
+#include "pico_spi_transport.hpp"
+#include "hardware/dma.h"
+
+PicoSpiTransport::PicoSpiTransport(spi_inst_t *spi, uint mosi, uint miso, uint sclk, uint cs, uint baudrate)
+: spi{spi}
+, cs{cs}
+{
+  gpio_init(cs);
+  gpio_set_dir(cs, GPIO_OUT);
+  gpio_put(cs, 1);
+  gpio_set_function(mosi, GPIO_FUNC_SPI);
+  gpio_set_function(miso, GPIO_FUNC_SPI);
+  gpio_set_function(sclk, GPIO_FUNC_SPI);
+  spi_init(spi, baudrate);
+
+  dma_tx = dma_claim_unused_channel(true);
+  dma_rx = dma_claim_unused_channel(true);
+
+  // give the device time to power up before the first command
+  sleep_ms(1);
+}
+
+void PicoSpiTransport::write(uint8_t const *data, uint32_t nbytes) {
+  spi_write_blocking(spi, data, nbytes);
+}
+
+void PicoSpiTransport::read(uint8_t *data, uint32_t nbytes) {
+  spi_read_blocking(spi, 0, data, nbytes);
+}
+
+void PicoSpiTransport::write_async(uint8_t const *data, uint32_t nbytes) {
+  // soak up the bytes clocked in while writing
+  static uint8_t rx_discard;
+  dma_start(data, true, &rx_discard, false, nbytes);
+}
+
+void PicoSpiTransport::read_async(uint8_t *data, uint32_t nbytes) {
+  // clock out zeros while reading
+  static const uint8_t tx_zero = 0;
+  dma_start(&tx_zero, false, data, true, nbytes);
+}
+
+bool PicoSpiTransport::busy() {
+  return dma_channel_is_busy(dma_rx) || spi_is_busy(spi);
+}
+
+void PicoSpiTransport::dma_start(uint8_t const *tx, bool tx_inc, uint8_t *rx, bool rx_inc, uint32_t nbytes) {
+  dma_channel_config c = dma_channel_get_default_config(dma_tx);
+  channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+  channel_config_set_dreq(&c, spi_get_dreq(spi, true));
+  channel_config_set_read_increment(&c, tx_inc);
+  channel_config_set_write_increment(&c, false);
+  dma_channel_configure(dma_tx, &c, &spi_get_hw(spi)->dr, tx, nbytes, false);
+
+  c = dma_channel_get_default_config(dma_rx);
+  channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+  channel_config_set_dreq(&c, spi_get_dreq(spi, false));
+  channel_config_set_read_increment(&c, false);
+  channel_config_set_write_increment(&c, rx_inc);
+  dma_channel_configure(dma_rx, &c, rx, &spi_get_hw(spi)->dr, nbytes, false);
+
+  dma_start_channel_mask((1u << dma_tx) | (1u << dma_rx));
+}
@@ -0,0 +1,183 @@
+#include "psram_model.hpp"
+
+enum Command : uint8_t {
+  WRITE = 0x02,
+  READ = 0x03,
+  READ_FAST = 0x0b,
+  READ_ID = 0x9f,
+  RESET_ENABLE = 0x66,
+  RESET = 0x99,
+  READ_FAST_QUAD = 0xeb,
+  WRITE_QUAD = 0x38,
+  ENTER_QUAD = 0x35,
+  EXIT_QUAD = 0xf5,
+};
+
+// Known good die ID: manufacturer, KGD, then EID bytes
+static const uint8_t s_read_id[] = {0x0d, 0x5d, 0x52, 0x00, 0x00, 0x00, 0x00, 0x00};
+
+
+PsramModel::PsramModel()
+: m_storage(s_size)
+, m_stats{}
+, m_state{IDLE}
+, m_command{0}
+, m_last_command{0}
+, m_count{0}
+, m_addr{0}
+, m_wrapped{false}
+, m_qpi{false}
+, m_bus_quad{false}
+, m_wait{0}
+, m_select_clocks{0}
+{}
+
+void PsramModel::select() {
+  if (m_state != IDLE) m_stats.errors++; // already selected
+  m_stats.selects++;
+  m_select_clocks = m_stats.clocks;
+  m_state = COMMAND;
+  m_count = 0;
+}
+
+void PsramModel::deselect() {
+  if (m_state == IDLE || m_state == COMMAND || m_state == ADDRESS || m_state == DUMMY) {
+    m_stats.errors++; // frame ended before its data phase
+  }
+  if (m_stats.clocks - m_select_clocks > s_max_select_clocks) {
+    m_stats.long_selects++;
+    m_stats.errors++;
+  }
+  // mode changes take effect once the command is finished
+  if (m_state == DONE) {
+    if (m_command == ENTER_QUAD) m_qpi = true;
+    else if (m_command == EXIT_QUAD) m_qpi = false;
+    else if (m_command == RESET && m_last_command == RESET_ENABLE) m_qpi = false;
+  }
+  m_last_command = m_command;
+  m_command = 0;
+  m_state = IDLE;
+}
+
+void PsramModel::write(uint8_t const *data, uint32_t nbytes) {
+  for (uint32_t i = 0; i < nbytes; i++) clock(data[i], false);
+}
+
+void PsramModel::read(uint8_t *data, uint32_t nbytes) {
+  for (uint32_t i = 0; i < nbytes; i++) data[i] = clock(0, true);
+}
+
+void PsramModel::next_addr() {
+  m_addr = (m_addr & ~(s_page_size-1)) | ((m_addr + 1) & (s_page_size-1));
+  // the burst carries on past the end of its page, back to the page start
+  if (m_addr % s_page_size == 0) m_wrapped = true;
+}
+
+void PsramModel::data_byte() {
+  if (m_wrapped) m_stats.page_crossings++;
+  m_wrapped = false;
+  m_stats.data_bytes++;
+}
+
+uint8_t PsramModel::clock(uint8_t mosi, bool reading) {
+  m_stats.clocks += m_bus_quad ? 2 : 8;
+  if (m_state == COMMAND && m_bus_quad && !m_qpi) {
+    // an SPI mode device has only seen two bits of its command
+    m_stats.command_bytes++;
+    m_state = DROPPED;
+    return 0xff;
+  }
+  if (m_state != IDLE && m_bus_quad != m_qpi) m_stats.errors++; // bus width doesn't match the device
+  switch (m_state) {
+    case IDLE:
+      m_stats.errors++; // clocked without chip select
+      return 0xff;
+    case COMMAND:
+      m_stats.commands++;
+      m_stats.command_bytes++;
+      m_command = mosi;
+      m_count = 0;
+      m_addr = 0;
+      switch (mosi) {
+        case READ: case READ_ID:
+          // SPI mode only
+          if (m_qpi) m_stats.errors++;
+          m_state = ADDRESS;
+          break;
+        case READ_FAST_QUAD: case WRITE_QUAD:
+          // in SPI mode these take the address on four lines, which this
+          // model's byte stream can't carry
+          if (!m_qpi) m_stats.errors++;
+          m_state = ADDRESS;
+          break;
+        case READ_FAST: case WRITE:
+          m_state = ADDRESS;
+          break;
+        case ENTER_QUAD:
+          if (m_qpi) m_stats.errors++;
+          m_state = DONE;
+          break;
+        case EXIT_QUAD:
+          if (!m_qpi) m_stats.errors++;
+          m_state = DONE;
+          break;
+        case RESET_ENABLE:
+          m_state = DONE;
+          break;
+        case RESET:
+          if (m_last_command != RESET_ENABLE) m_stats.errors++;
+          m_state = DONE;
+          break;
+        default:
+          m_stats.errors++;
+          m_state = DONE;
+      }
+      return 0xff;
+    case ADDRESS:
+      m_stats.command_bytes++;
+      m_addr = (m_addr << 8) | mosi;
+      if (++m_count < 3) return 0xff;
+      if (m_addr >= s_size) m_stats.errors++;
+      m_addr &= s_size - 1;
+      m_count = 0;
+      m_wrapped = false;
+      // wait cycles: 8 for FAST READ in SPI mode, 4 in QPI, 6 for FAST READ QUAD
+      if (m_command == READ_FAST) m_wait = m_qpi ? 2 : 1;
+      else if (m_command == READ_FAST_QUAD) m_wait = 3;
+      else m_wait = 0;
+      if (m_wait) m_state = DUMMY;
+      else if (m_command == READ) m_state = READ_DATA;
+      else if (m_command == READ_ID) m_state = ID_DATA;
+      else m_state = WRITE_DATA;
+      return 0xff;
+    case DUMMY:
+      m_stats.command_bytes++;
+      if (--m_wait == 0) m_state = READ_DATA;
+      return 0xff;
+    case READ_DATA: {
+      if (!reading) m_stats.errors++;
+      data_byte();
+      uint8_t value = m_storage[m_addr];
+      next_addr();
+      return value;
+    }
+    case WRITE_DATA:
+      if (reading) m_stats.errors++;
+      data_byte();
+      m_storage[m_addr] = mosi;
+      next_addr();
+      return 0xff;
+    case ID_DATA: {
+      uint8_t value = m_count < sizeof(s_read_id) ? s_read_id[m_count] : 0;
+      m_count++;
+      return value;
+    }
+    case DONE:
+      m_stats.errors++; // bytes past the end of a command
+      return 0xff;
+    case DROPPED:
+      m_stats.errors++; // quad bytes the SPI mode device takes as a command
+      return 0xff;
+  }
+  return 0xff;
+}
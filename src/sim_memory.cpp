@@ -0,0 +1,274 @@
+#include "sim_memory.hpp"
+#include <chrono>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#if DEBUG
+#define ASSERT(cond) if(!(cond)){printf("Assert failed: %s\n%s:%d", #cond, __FILE__, __LINE__); while(1);}
+#else
+#define ASSERT(cond)
+#endif
+
+
+uint8_t ByteArrayMemory::read_byte(uintptr_t addr) {
+  ASSERT(addr + 1 <= m_size);
+  return m_data[addr];
+}
+
+uint16_t ByteArrayMemory::read_word(uintptr_t addr) {
+  ASSERT(addr + 2 <= m_size);
+  uint16_t value;
+  memcpy(&value, &m_data[addr], sizeof(value));
+  return value;
+}
+
+uint32_t ByteArrayMemory::read_dword(uintptr_t addr) {
+  ASSERT(addr + 4 <= m_size);
+  uint32_t value;
+  memcpy(&value, &m_data[addr], sizeof(value));
+  return value;
+}
+
+void ByteArrayMemory::read_data(uintptr_t addr, uint32_t nbytes, uint8_t *data) {
+  ASSERT(addr + nbytes <= m_size);
+  memcpy(data, &m_data[addr], nbytes);
+}
+
+void ByteArrayMemory::write_byte(uintptr_t addr, uint8_t value) {
+  ASSERT(addr + 1 <= m_size);
+  m_data[addr] = value;
+}
+
+void ByteArrayMemory::write_word(uintptr_t addr, uint16_t value) {
+  ASSERT(addr + 2 <= m_size);
+  memcpy(&m_data[addr], &value, sizeof(value));
+}
+
+void ByteArrayMemory::write_dword(uintptr_t addr, uint32_t value) {
+  ASSERT(addr + 4 <= m_size);
+  memcpy(&m_data[addr], &value, sizeof(value));
+}
+
+void ByteArrayMemory::write_data(uintptr_t addr, uint32_t nbytes, const uint8_t *data) {
+  ASSERT(addr + nbytes <= m_size);
+  memcpy(&m_data[addr], data, nbytes);
+}
+
+
+RamMemory::RamMemory(uint32_t size_bytes)
+: m_storage(size_bytes)
+{
+  m_data = m_storage.data();
+  m_size = size_bytes;
+}
+
+
+MmapMemory::MmapMemory(const char *path, uint32_t size_bytes)
+{
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    perror(path);
+    return;
+  }
+  if (ftruncate(fd, size_bytes) != 0) {
+    perror(path);
+    close(fd);
+    return;
+  }
+  void *p = mmap(nullptr, size_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    perror(path);
+    return;
+  }
+  m_data = (uint8_t*)p;
+  m_size = size_bytes;
+}
+
+MmapMemory::~MmapMemory() {
+  if (m_data) munmap(m_data, m_size);
+}
+
+
+LatencyMemory::LatencyMemory(IMemory *memory, Cost cost, bool spin)
+: m_memory{memory}
+, m_cost{cost}
+, m_spin{spin}
+{
+  reset_counters();
+}
+
+void LatencyMemory::reset_counters() {
+  m_elapsed_ns = 0;
+  m_transactions = 0;
+  m_bytes = 0;
+}
+
+void LatencyMemory::charge(uint32_t nbytes) {
+  uint64_t ns = m_cost.ns_per_transaction + uint64_t(m_cost.ns_per_byte)*nbytes;
+  m_elapsed_ns += ns;
+  m_transactions++;
+  m_bytes += nbytes;
+  if (m_spin) {
+    auto until = std::chrono::steady_clock::now() + std::chrono::nanoseconds(ns);
+    while (std::chrono::steady_clock::now() < until);
+  }
+}
+
+uint8_t LatencyMemory::read_byte(uintptr_t addr) {
+  charge(1);
+  return m_memory->read_byte(addr);
+}
+
+uint16_t LatencyMemory::read_word(uintptr_t addr) {
+  charge(2);
+  return m_memory->read_word(addr);
+}
+
+uint32_t LatencyMemory::read_dword(uintptr_t addr) {
+  charge(4);
+  return m_memory->read_dword(addr);
+}
+
+void LatencyMemory::read_data(uintptr_t addr, uint32_t nbytes, uint8_t *data) {
+  charge(nbytes);
+  m_memory->read_data(addr, nbytes, data);
+}
+
+void LatencyMemory::write_byte(uintptr_t addr, uint8_t value) {
+  charge(1);
+  m_memory->write_byte(addr, value);
+}
+
+void LatencyMemory::write_word(uintptr_t addr, uint16_t value) {
+  charge(2);
+  m_memory->write_word(addr, value);
+}
+
+void LatencyMemory::write_dword(uintptr_t addr, uint32_t value) {
+  charge(4);
+  m_memory->write_dword(addr, value);
+}
+
+void LatencyMemory::write_data(uintptr_t addr, uint32_t nbytes, const uint8_t *data) {
+  charge(nbytes);
+  m_memory->write_data(addr, nbytes, data);
+}
+
+void LatencyMemory::zero_data(uintptr_t addr, uint32_t nbytes) {
+  charge(nbytes);
+  m_memory->zero_data(addr, nbytes);
+}
+
+
+ThreadedMemory::ThreadedMemory(IMemory *memory)
+: m_memory{memory}
+, m_busy{false}
+, m_stop{false}
+, m_worker{&ThreadedMemory::run, this}
+{
+}
+
+ThreadedMemory::~ThreadedMemory() {
+  drain();
+  {
+    std::lock_guard<std::mutex> lock{m_lock};
+    m_stop = true;
+  }
+  m_wake.notify_all();
+  m_worker.join();
+}
+
+void ThreadedMemory::submit(MemTransaction *t) {
+  t->status = MemTransaction::PENDING;
+  {
+    std::lock_guard<std::mutex> lock{m_lock};
+    m_queue.push_back(t);
+  }
+  m_wake.notify_all();
+}
+
+bool ThreadedMemory::poll() {
+  std::lock_guard<std::mutex> lock{m_lock};
+  return m_busy || !m_queue.empty();
+}
+
+void ThreadedMemory::drain() {
+  std::unique_lock<std::mutex> lock{m_lock};
+  m_wake.wait(lock, [this]{ return !m_busy && m_queue.empty(); });
+}
+
+void ThreadedMemory::run() {
+  std::unique_lock<std::mutex> lock{m_lock};
+  while (true) {
+    m_wake.wait(lock, [this]{ return m_stop || !m_queue.empty(); });
+    if (m_queue.empty()) return;
+    MemTransaction *t = m_queue.front();
+    m_queue.pop_front();
+    m_busy = true;
+    lock.unlock();
+
+    if (t->op == MemTransaction::READ) m_memory->read_data(t->addr, t->nbytes, t->data);
+    else m_memory->write_data(t->addr, t->nbytes, t->data);
+    complete(t);
+
+    lock.lock();
+    m_busy = false;
+    m_wake.notify_all();
+  }
+}
+
+// blocking calls wait for everything submitted before them
+
+uint8_t ThreadedMemory::read_byte(uintptr_t addr) {
+  drain();
+  return m_memory->read_byte(addr);
+}
+
+uint16_t ThreadedMemory::read_word(uintptr_t addr) {
+  drain();
+  return m_memory->read_word(addr);
+}
+
+uint32_t ThreadedMemory::read_dword(uintptr_t addr) {
+  drain();
+  return m_memory->read_dword(addr);
+}
+
+void ThreadedMemory::read_data(uintptr_t addr, uint32_t nbytes, uint8_t *data) {
+  drain();
+  m_memory->read_data(addr, nbytes, data);
+}
+
+void ThreadedMemory::write_byte(uintptr_t addr, uint8_t value) {
+  drain();
+  m_memory->write_byte(addr, value);
+}
+
+void ThreadedMemory::write_word(uintptr_t addr, uint16_t value) {
+  drain();
+  m_memory->write_word(addr, value);
+}
+
+void ThreadedMemory::write_dword(uintptr_t addr, uint32_t value) {
+  drain();
+  m_memory->write_dword(addr, value);
+}
+
+void ThreadedMemory::write_data(uintptr_t addr, uint32_t nbytes, const uint8_t *data) {
+  drain();
+  m_memory->write_data(addr, nbytes, data);
+}
+
+void ThreadedMemory::zero_data(uintptr_t addr, uint32_t nbytes) {
+  drain();
+  m_memory->zero_data(addr, nbytes);
+}
+
+void ThreadedMemory::flush() {
+  drain();
+  m_memory->flush();
+}
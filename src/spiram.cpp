@@ -1,8 +1,17 @@
 #include "spiram.hpp"
+#include <string.h>
+#include <algorithm>
+#if !PICO_EXTMEM_HOST
 #include "pico/stdlib.h"
-#include "hardware/spi.h"
+#include "pico_spi_transport.hpp"
+#include "pico_qspi_transport.hpp"
+#endif
 
 enum Command{
+  RESET_ENABLE = 0x66,
+  RESET = 0x99,
+  ENTER_QUAD = 0x35,
+  EXIT_QUAD = 0xf5,
   WRITE = 0x02,
   READ = 0x03,
   READ_FAST = 0x0b,
@@ -51,102 +60,233 @@ uint32_t buf_read_dword(uint8_t *buf) {
 }
 
 
-SpiRam::SpiRam(uint mosi, uint miso, uint sclk, uint cs) : cs{cs} {
-  gpio_set_dir(mosi, GPIO_OUT);
-  gpio_set_dir(miso, GPIO_IN);
-  gpio_set_dir(sclk, GPIO_OUT);
-  gpio_set_dir(cs, GPIO_OUT);
-  gpio_put(cs, 1);
-  gpio_set_function(mosi, GPIO_FUNC_SPI);
-  gpio_set_function(miso, GPIO_FUNC_SPI);
-  gpio_set_function(sclk, GPIO_FUNC_SPI);
-  gpio_set_function(cs, GPIO_FUNC_SIO);
-  spi_init(spi0, 31'250'000);
+SpiRam::SpiRam(ISpiTransport &spi, bool quad)
+: spi{&spi}
+, qpi{false}
+, queue_head{nullptr}
+, queue_tail{nullptr}
+, seg_offset{0}
+, seg_len{0}
+, burst_open{false}
+, burst_len{0}
+, write_buf_len{0}
+{
+  reset(quad && spi.supports_quad());
+}
 
-  sleep_ms(1);
-  gpio_put(cs, 0);
-  spi_write_blocking(spi0, (uint8_t*)"\x66\x99", 2);
-  gpio_put(cs, 1);
+#if !PICO_EXTMEM_HOST
+SpiRam::SpiRam(uint mosi, uint miso, uint sclk, uint cs)
+: SpiRam(*new PicoSpiTransport(spi0, mosi, miso, sclk, cs))
+{
+  owned_spi.reset(spi);
 }
 
-uint8_t * make_cmd(uint8_t cmd, uintptr_t addr, uint8_t *buf) {
-  buf = buf_write_byte(buf, cmd);
-  buf = buf_write_tribyte(buf, addr);
-  return buf;
+SpiRam::SpiRam(uint sio0, uint sclk, uint cs)
+: SpiRam(*new PicoQspiTransport(pio0, sio0, sclk, cs), true)
+{
+  owned_spi.reset(spi);
+}
+#endif
+
+SpiRam::~SpiRam() {
+  drain();
+  flush();
+}
+
+void SpiRam::reset(bool quad) {
+  // A soft reboot leaves the device powered and possibly still in QPI mode,
+  // where it can't parse SPI commands. Leave it first; in SPI mode the
+  // device sees two clocks of a command and drops the frame.
+  if (spi->supports_quad()) {
+    spi->set_quad(true);
+    send_single(EXIT_QUAD);
+    spi->set_quad(false);
+  }
+  // reset enable and reset must be separate commands
+  send_single(RESET_ENABLE);
+  send_single(RESET);
+  if (quad) {
+    send_single(ENTER_QUAD);
+    spi->set_quad(true);
+  }
+  qpi = quad;
+}
+
+void SpiRam::send_single(uint8_t cmd) {
+  spi->select();
+  spi->write(&cmd, 1);
+  spi->deselect();
+}
+
+void SpiRam::send_cmd(MemTransaction::Op op, uintptr_t addr) {
+  // address goes out MSB first; in QPI mode the quad read is followed by 6
+  // wait cycles, 3 bytes at two clocks each
+  uint8_t buf[7] = {
+    0, uint8_t(addr >> 16), uint8_t(addr >> 8), uint8_t(addr), 0, 0, 0,
+  };
+  uint32_t len = 4;
+  if (!qpi) buf[0] = op == MemTransaction::READ ? READ : WRITE;
+  else if (op == MemTransaction::WRITE) buf[0] = WRITE_QUAD;
+  else {
+    buf[0] = READ_FAST_QUAD;
+    len = 7;
+  }
+  spi->write(buf, len);
+}
+
+void SpiRam::transfer(MemTransaction::Op op, uintptr_t addr, uint32_t nbytes, uint8_t *data) {
+  while (nbytes) {
+    uint32_t len = std::min({nbytes, s_page_size - uint32_t(addr % s_page_size), max_burst(qpi)});
+    spi->select();
+    send_cmd(op, addr);
+    if (op == MemTransaction::READ) spi->read(data, len);
+    else spi->write(data, len);
+    spi->deselect();
+    addr += len;
+    data += len;
+    nbytes -= len;
+  }
 }
 
 uint8_t SpiRam::read_byte(uintptr_t addr) {
-  uint8_t buf[5];
-  gpio_put(cs, 0);
-  make_cmd(READ, addr, buf);
-  spi_write_read_blocking(spi0, buf, buf, 5);
-  gpio_put(cs, 1);
-  return buf[4];
+  drain();
+  flush();
+  uint8_t buf[1];
+  transfer(MemTransaction::READ, addr, sizeof(buf), buf);
+  return buf_read_byte(buf);
 }
 
 uint16_t SpiRam::read_word(uintptr_t addr) {
-  uint8_t buf[6];
-  gpio_put(cs, 0);
-  make_cmd(READ, addr, buf);
-  spi_write_read_blocking(spi0, buf, buf, 6);
-  gpio_put(cs, 1);
-  return buf_read_word(&buf[4]);
+  drain();
+  flush();
+  uint8_t buf[2];
+  transfer(MemTransaction::READ, addr, sizeof(buf), buf);
+  return buf_read_word(buf);
 }
 
 uint32_t SpiRam::read_dword(uintptr_t addr) {
-  uint8_t buf[8];
-  gpio_put(cs, 0);
-  make_cmd(READ, addr, buf);
-  spi_write_read_blocking(spi0, buf, buf, 8);
-  gpio_put(cs, 1);
-  return buf_read_dword(&buf[4]);
+  drain();
+  flush();
+  uint8_t buf[4];
+  transfer(MemTransaction::READ, addr, sizeof(buf), buf);
+  return buf_read_dword(buf);
 }
 
 void SpiRam::read_data(uintptr_t addr, uint32_t nbytes, uint8_t *data) {
-  uint8_t buf[4];
-  gpio_put(cs, 0);
-  make_cmd(READ, addr, buf);
-  spi_write_blocking(spi0, buf, 6);
-  spi_read_blocking(spi0, 0, data, nbytes);
-  gpio_put(cs, 1);
+  drain();
+  flush();
+  transfer(MemTransaction::READ, addr, nbytes, data);
 }
 
 void SpiRam::write_byte(uintptr_t addr, uint8_t value) {
-  uint8_t buf[5];
-  uint8_t *p;
-  gpio_put(cs, 0);
-  p = make_cmd(WRITE, addr, buf);
-  p = buf_write_byte(p, value);
-  spi_write_blocking(spi0, buf, 5);
-  sleep_ms(1);
-  gpio_put(cs, 1);
+  uint8_t buf[1];
+  buf_write_byte(buf, value);
+  write_small(addr, buf, sizeof(buf));
 }
 
 void SpiRam::write_word(uintptr_t addr, uint16_t value) {
-  uint8_t buf[6];
-  uint8_t *p;
-  p = make_cmd(WRITE, addr, buf);
-  p = buf_write_word(p, value);
-  gpio_put(cs, 0);
-  spi_write_blocking(spi0, buf, 6);
-  gpio_put(cs, 1);
+  uint8_t buf[2];
+  buf_write_word(buf, value);
+  write_small(addr, buf, sizeof(buf));
 }
 
 void SpiRam::write_dword(uintptr_t addr, uint32_t value) {
-  uint8_t buf[8];
-  uint8_t *p;
-  p = make_cmd(WRITE, addr, buf);
-  p = buf_write_dword(p, value);
-  gpio_put(cs, 0);
-  spi_write_blocking(spi0, buf, 8);
-  gpio_put(cs, 1);
+  uint8_t buf[4];
+  buf_write_dword(buf, value);
+  write_small(addr, buf, sizeof(buf));
 }
 
 void SpiRam::write_data(uintptr_t addr, uint32_t nbytes, const uint8_t *data) {
-  uint8_t buf[4];
-  make_cmd(WRITE, addr, buf);
-  gpio_put(cs, 0);
-  spi_write_blocking(spi0, buf, 4);
-  spi_write_blocking(spi0, data, nbytes);
-  gpio_put(cs, 1);
+  if (nbytes <= s_write_buffer_size) {
+    write_small(addr, data, nbytes);
+    return;
+  }
+  drain();
+  flush();
+  transfer(MemTransaction::WRITE, addr, nbytes, const_cast<uint8_t*>(data));
+}
+
+void SpiRam::write_small(uintptr_t addr, uint8_t const *data, uint32_t nbytes) {
+  // append when it continues the buffered run within the same page and
+  // the run still goes out in one burst
+  uint32_t limit = std::min(s_write_buffer_size, max_burst(qpi));
+  bool append = write_buf_len
+    && addr == write_buf_addr + write_buf_len
+    && write_buf_len + nbytes <= limit
+    && (addr + nbytes - 1) / s_page_size == write_buf_addr / s_page_size;
+  if (!append) {
+    drain();
+    flush();
+    if (addr % s_page_size + nbytes > s_page_size || nbytes > limit) {
+      transfer(MemTransaction::WRITE, addr, nbytes, const_cast<uint8_t*>(data));
+      return;
+    }
+    write_buf_addr = addr;
+  }
+  memcpy(&write_buf[write_buf_len], data, nbytes);
+  write_buf_len += nbytes;
+}
+
+void SpiRam::flush() {
+  if (!write_buf_len) return;
+  drain();
+  transfer(MemTransaction::WRITE, write_buf_addr, write_buf_len, write_buf);
+  write_buf_len = 0;
+}
+
+
+void SpiRam::submit(MemTransaction *t) {
+  // buffered writes were made before t, so go out first
+  flush();
+  t->status = MemTransaction::PENDING;
+  t->next = nullptr;
+  if (queue_tail) queue_tail->next = t;
+  else queue_head = t;
+  queue_tail = t;
+  if (queue_head == t) start_segment();
+}
+
+void SpiRam::start_segment() {
+  MemTransaction *t = queue_head;
+  uintptr_t addr = t->addr + seg_offset;
+  // carry on the open burst unless it would wrap at the page start or is
+  // at its length limit
+  bool merge = burst_open && burst_op == t->op && burst_next == addr && addr % s_page_size != 0
+    && burst_len < max_burst(qpi);
+  if (!merge) {
+    if (burst_open) spi->deselect();
+    spi->select();
+    send_cmd(t->op, addr);
+    burst_open = true;
+    burst_op = t->op;
+    burst_len = 0;
+  }
+  seg_len = std::min({t->nbytes - seg_offset, s_page_size - uint32_t(addr % s_page_size), max_burst(qpi) - burst_len});
+  burst_next = addr + seg_len;
+  burst_len += seg_len;
+  if (t->op == MemTransaction::READ) spi->read_async(t->data + seg_offset, seg_len);
+  else spi->write_async(t->data + seg_offset, seg_len);
+}
+
+bool SpiRam::poll() {
+  MemTransaction *t = queue_head;
+  if (!t) return false;
+  if (spi->busy()) return true;
+  seg_offset += seg_len;
+  if (seg_offset < t->nbytes) {
+    start_segment();
+    return true;
+  }
+  // start the next transfer before completing, the callback may submit more
+  seg_offset = 0;
+  queue_head = t->next;
+  if (queue_head) {
+    start_segment();
+  } else {
+    queue_tail = nullptr;
+    spi->deselect();
+    burst_open = false;
+  }
+  complete(t);
+  return queue_head != nullptr;
 }
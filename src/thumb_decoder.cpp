@@ -0,0 +1,186 @@
+#include "thumb_decoder.hpp"
+#include <array>
+
+struct OpCodeType{
+  const char *type;
+  void (*decode)(uint16_t, DecodedOp&);
+};
+
+static void decode_none(uint16_t, DecodedOp&){}
+
+// ldr/str rt, [rn, rm]
+template<DecodedOp::Kind kind, uint8_t size, bool sign = false>
+static void decode_reg3(uint16_t opcode, DecodedOp &op) {
+  op.kind = kind;
+  op.size = size;
+  op.sign = sign;
+  op.rm = thumb_reg_slot((opcode>>6)&0b111);
+  op.rn = thumb_reg_slot((opcode>>3)&0b111);
+  op.rt = thumb_reg_slot((opcode>>0)&0b111);
+}
+
+// ldr/str rt, [rn, #imm5*size]
+template<DecodedOp::Kind kind, uint8_t size>
+static void decode_imm5_reg2(uint16_t opcode, DecodedOp &op) {
+  op.kind = kind;
+  op.size = size;
+  op.imm = ((opcode>>6)&0b11111) * size;
+  op.rn = thumb_reg_slot((opcode>>3)&0b111);
+  op.rt = thumb_reg_slot((opcode>>0)&0b111);
+}
+
+// ldr/str rt, [sp, #imm8*4]
+template<DecodedOp::Kind kind>
+static void decode_sp_imm8(uint16_t opcode, DecodedOp &op) {
+  op.kind = kind;
+  op.size = 4;
+  op.imm = (opcode&0xff) * 4;
+  op.rn = DecodedOp::SP_SLOT;
+  op.rt = thumb_reg_slot((opcode>>8)&0b111);
+}
+
+// ldm/stm rn!, {reglist}
+template<DecodedOp::Kind kind>
+static void decode_reg_regs(uint16_t opcode, DecodedOp &op) {
+  uint8_t rn = (opcode>>8)&0b111;
+  op.kind = kind;
+  op.rn = thumb_reg_slot(rn);
+  op.reglist = opcode&0xff;
+  op.size = 4 * __builtin_popcount(op.reglist);
+  // ldm leaves the base alone when it loads it
+  op.writeback = kind == DecodedOp::STORE_MULTIPLE || !(op.reglist & (1 << rn));
+}
+
+// lsls/lsrs/asrs rd, rm, #imm5
+template<DecodedOp::Alu alu>
+static void decode_shift_imm5(uint16_t opcode, DecodedOp &op) {
+  op.kind = DecodedOp::ALU;
+  op.alu = alu;
+  op.imm = (opcode>>6)&0b11111;
+  op.rn = thumb_reg_slot((opcode>>3)&0b111);
+  op.rt = thumb_reg_slot((opcode>>0)&0b111);
+  if (op.imm == 0) {
+    // lsls #0 is movs rd, rm; lsrs/asrs #0 shift by 32
+    if (alu == DecodedOp::LSL) {
+      op.alu = DecodedOp::MOV;
+      op.rm = op.rn;
+    } else {
+      op.imm = 32;
+    }
+  }
+}
+
+// adds/subs rd, rn, rm and adds/subs rd, rn, #imm3
+template<DecodedOp::Alu alu, bool imm>
+static void decode_add_sub3(uint16_t opcode, DecodedOp &op) {
+  op.kind = DecodedOp::ALU;
+  op.alu = alu;
+  if (imm) op.imm = (opcode>>6)&0b111;
+  else op.rm = thumb_reg_slot((opcode>>6)&0b111);
+  op.rn = thumb_reg_slot((opcode>>3)&0b111);
+  op.rt = thumb_reg_slot((opcode>>0)&0b111);
+}
+
+// movs/cmp/adds/subs rdn, #imm8
+template<DecodedOp::Alu alu>
+static void decode_reg_imm8(uint16_t opcode, DecodedOp &op) {
+  uint8_t rdn = thumb_reg_slot((opcode>>8)&0b111);
+  op.kind = DecodedOp::ALU;
+  op.alu = alu;
+  op.imm = opcode&0xff;
+  op.rn = rdn;
+  op.rt = alu == DecodedOp::CMP ? DecodedOp::NO_SLOT : rdn;
+}
+
+// <op>s rdn, rm
+static void decode_data_processing(uint16_t opcode, DecodedOp &op) {
+  using A = DecodedOp::Alu;
+  static constexpr A ops[16] = {
+    A::AND, A::EOR, A::LSL, A::LSR, A::ASR, A::ADC, A::SBC, A::ROR,
+    A::TST, A::NEG, A::CMP, A::CMN, A::ORR, A::MUL, A::BIC, A::MVN,
+  };
+  uint8_t rdn = thumb_reg_slot((opcode>>0)&0b111);
+  op.kind = DecodedOp::ALU;
+  op.alu = ops[(opcode>>6)&0xf];
+  op.rm = thumb_reg_slot((opcode>>3)&0b111);
+  op.rn = rdn;
+  op.rt = rdn;
+  if (op.alu == A::TST || op.alu == A::CMP || op.alu == A::CMN) op.rt = DecodedOp::NO_SLOT;
+}
+
+// b<cond> label
+static void decode_branch_cond(uint16_t opcode, DecodedOp &op) {
+  uint8_t cond = (opcode>>8)&0xf;
+  if (cond >= 0xe) return; // udf, svc
+  op.kind = DecodedOp::BRANCH;
+  op.cond = cond;
+  op.imm = int8_t(opcode&0xff) * 2 + 2;
+}
+
+// b label
+static void decode_branch(uint16_t opcode, DecodedOp &op) {
+  op.kind = DecodedOp::BRANCH;
+  op.cond = 0xe;
+  op.imm = int16_t(opcode<<5) / 32 * 2 + 2;
+}
+
+constexpr auto construct_opcode_table(){
+  using K = DecodedOp::Kind;
+  using A = DecodedOp::Alu;
+  std::array<OpCodeType, 128> out{};
+  for (auto &e : out) {
+    e.decode = decode_none;
+    e.type = "NONE";
+  }
+
+  for (int i = 0b0000'000; i <= 0b0000'011; i++) out[i] = OpCodeType{"Logical Shift Left", &decode_shift_imm5<A::LSL>};
+  for (int i = 0b0000'100; i <= 0b0000'111; i++) out[i] = OpCodeType{"Logical Shift Right", &decode_shift_imm5<A::LSR>};
+  for (int i = 0b0001'000; i <= 0b0001'011; i++) out[i] = OpCodeType{"Arithmetic Shift Right", &decode_shift_imm5<A::ASR>};
+  out[0b0001'100] = OpCodeType{"Add Register", &decode_add_sub3<A::ADD, false>};
+  out[0b0001'101] = OpCodeType{"Subtract Register", &decode_add_sub3<A::SUB, false>};
+  out[0b0001'110] = OpCodeType{"Add Immediate", &decode_add_sub3<A::ADD, true>};
+  out[0b0001'111] = OpCodeType{"Subtract Immediate", &decode_add_sub3<A::SUB, true>};
+  for (int i = 0b0010'000; i <= 0b0010'011; i++) out[i] = OpCodeType{"Move Immediate", &decode_reg_imm8<A::MOV>};
+  for (int i = 0b0010'100; i <= 0b0010'111; i++) out[i] = OpCodeType{"Compare Immediate", &decode_reg_imm8<A::CMP>};
+  for (int i = 0b0011'000; i <= 0b0011'011; i++) out[i] = OpCodeType{"Add Immediate", &decode_reg_imm8<A::ADD>};
+  for (int i = 0b0011'100; i <= 0b0011'111; i++) out[i] = OpCodeType{"Subtract Immediate", &decode_reg_imm8<A::SUB>};
+  out[0b0100'000] = OpCodeType{"Data Processing", &decode_data_processing};
+  out[0b0100'001] = OpCodeType{"Data Processing", &decode_data_processing};
+
+  out[0b0101'000] = OpCodeType{"Store Register", &decode_reg3<K::STORE, 4>};
+  out[0b0101'001] = OpCodeType{"Store Register Halfword", &decode_reg3<K::STORE, 2>};
+  out[0b0101'010] = OpCodeType{"Store Register Byte", &decode_reg3<K::STORE, 1>};
+  out[0b0101'011] = OpCodeType{"Load Register Signed Byte", &decode_reg3<K::LOAD, 1, true>};
+  out[0b0101'100] = OpCodeType{"Load Register", &decode_reg3<K::LOAD, 4>};
+  out[0b0101'101] = OpCodeType{"Load Register Halfword", &decode_reg3<K::LOAD, 2>};
+  out[0b0101'110] = OpCodeType{"Load Register Byte", &decode_reg3<K::LOAD, 1>};
+  out[0b0101'111] = OpCodeType{"Load Register Signed Halfword", &decode_reg3<K::LOAD, 2, true>};
+  for (int i = 0b0110'000; i <= 0b0110'011; i++) out[i] = OpCodeType{"Store Register", &decode_imm5_reg2<K::STORE, 4>};
+  for (int i = 0b0110'100; i <= 0b0110'111; i++) out[i] = OpCodeType{"Load Register", &decode_imm5_reg2<K::LOAD, 4>};
+  for (int i = 0b0111'000; i <= 0b0111'011; i++) out[i] = OpCodeType{"Store Register Byte", &decode_imm5_reg2<K::STORE, 1>};
+  for (int i = 0b0111'100; i <= 0b0111'111; i++) out[i] = OpCodeType{"Load Register Byte", &decode_imm5_reg2<K::LOAD, 1>};
+  for (int i = 0b1000'000; i <= 0b1000'011; i++) out[i] = OpCodeType{"Store Register Halfword", &decode_imm5_reg2<K::STORE, 2>};
+  for (int i = 0b1000'100; i <= 0b1000'111; i++) out[i] = OpCodeType{"Load Register Halfword", &decode_imm5_reg2<K::LOAD, 2>};
+  for (int i = 0b1001'000; i <= 0b1001'011; i++) out[i] = OpCodeType{"Store Register", &decode_sp_imm8<K::STORE>};
+  for (int i = 0b1001'100; i <= 0b1001'111; i++) out[i] = OpCodeType{"Load Register", &decode_sp_imm8<K::LOAD>};
+
+  for (int i = 0b1100'000; i <= 0b1100'011; i++) {
+    out[i] = OpCodeType{"Store Multiple", &decode_reg_regs<K::STORE_MULTIPLE>};
+  }
+  for (int i = 0b1100'100; i <= 0b1100'111; i++) {
+    out[i] = OpCodeType{"Load Multiple", &decode_reg_regs<K::LOAD_MULTIPLE>};
+  }
+  for (int i = 0b1101'000; i <= 0b1101'111; i++) out[i] = OpCodeType{"Conditional Branch", &decode_branch_cond};
+  for (int i = 0b1110'000; i <= 0b1110'011; i++) out[i] = OpCodeType{"Branch", &decode_branch};
+  return out;
+}
+
+static const auto opcode_types = construct_opcode_table();
+
+
+DecodedOp thumb_decode(uint16_t opcode) {
+  auto &type = opcode_types[opcode>>9];
+  DecodedOp op{type.type, DecodedOp::NONE, 0, false, false, 0, 0, DecodedOp::NO_SLOT, 0, DecodedOp::MOV, 0, 0};
+  type.decode(opcode, op);
+  return op;
+}
@@ -0,0 +1,139 @@
+#include "zero_eliding_memory.hpp"
+#include <string.h>
+
+ZeroElidingMemory::ZeroElidingMemory(IMemory *memory, uint32_t block_size_pow2)
+: m_memory{memory}
+, m_block_size_pow2{block_size_pow2}
+, m_num_blocks{memory->size_bytes()>>block_size_pow2}
+, m_written{new uint32_t[(m_num_blocks + 31)/32]()}
+, m_block{new uint8_t[1u<<block_size_pow2]}
+, m_stats{}
+{
+}
+
+uint32_t ZeroElidingMemory::blocks_written() const {
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < (m_num_blocks + 31)/32; i++) count += __builtin_popcount(m_written[i]);
+  return count;
+}
+
+bool ZeroElidingMemory::all_written(uintptr_t addr, uint32_t nbytes, bool written) const {
+  if (!nbytes) return true;
+  for (uint32_t block = addr>>m_block_size_pow2, last = (addr + nbytes - 1)>>m_block_size_pow2; block <= last; block++) {
+    if (block_written(block) != written) return false;
+  }
+  return true;
+}
+
+void ZeroElidingMemory::read_data(uintptr_t addr, uint32_t nbytes, uint8_t *data) {
+  while (nbytes) {
+    // the run of blocks from addr that are all written or all zero
+    bool written = block_written(addr>>m_block_size_pow2);
+    uint32_t n = 0;
+    do {
+      uint32_t offset = (addr + n)&(block_size() - 1);
+      n += nbytes - n < block_size() - offset ? nbytes - n : block_size() - offset;
+    } while (n < nbytes && block_written((addr + n)>>m_block_size_pow2) == written);
+
+    if (written) {
+      for (uint32_t done = 0; done < n;) {
+        uint32_t chunk = n - done < m_memory->max_read() ? n - done : m_memory->max_read();
+        m_memory->read_data(addr + done, chunk, data + done);
+        done += chunk;
+      }
+    } else {
+      memset(data, 0, n);
+      EXTMEM_COUNT(m_stats.bytes_read += n);
+    }
+    addr += n;
+    data += n;
+    nbytes -= n;
+  }
+}
+
+void ZeroElidingMemory::write_data(uintptr_t addr, uint32_t nbytes, uint8_t const *data) {
+  // written blocks and zero blocks overwritten in full go out in one burst
+  uintptr_t run_addr = addr;
+  uint32_t run_bytes = 0;
+  auto flush = [&]() {
+    for (uint32_t done = 0; done < run_bytes;) {
+      uint32_t chunk = run_bytes - done < m_memory->max_write() ? run_bytes - done : m_memory->max_write();
+      m_memory->write_data(run_addr + done, chunk, data - run_bytes + done);
+      done += chunk;
+    }
+    run_bytes = 0;
+  };
+
+  while (nbytes) {
+    uint32_t block = addr>>m_block_size_pow2;
+    uint32_t offset = addr&(block_size() - 1);
+    uint32_t n = nbytes < block_size() - offset ? nbytes : block_size() - offset;
+    if (!block_written(block)) {
+      uint32_t i = 0;
+      while (i < n && data[i] == 0) i++;
+      if (i == n) {
+        // zeros over zeros
+        flush();
+        EXTMEM_COUNT(m_stats.bytes_written += n);
+        addr += n;
+        data += n;
+        nbytes -= n;
+        continue;
+      }
+      if (n < block_size()) {
+        flush();
+        memset(m_block.get(), 0, block_size());
+        memcpy(m_block.get() + offset, data, n);
+        m_memory->write_data(addr - offset, block_size(), m_block.get());
+        EXTMEM_COUNT(m_stats.block_fills++);
+        set_written(block, true);
+        addr += n;
+        data += n;
+        nbytes -= n;
+        continue;
+      }
+      set_written(block, true);
+    }
+    if (!run_bytes) run_addr = addr;
+    run_bytes += n;
+    addr += n;
+    data += n;
+    nbytes -= n;
+  }
+  flush();
+}
+
+void ZeroElidingMemory::zero_data(uintptr_t addr, uint32_t nbytes) {
+  while (nbytes) {
+    uint32_t block = addr>>m_block_size_pow2;
+    uint32_t offset = addr&(block_size() - 1);
+    uint32_t n = nbytes < block_size() - offset ? nbytes : block_size() - offset;
+    if (n == block_size()) {
+      set_written(block, false);
+      EXTMEM_COUNT(m_stats.bytes_zeroed += n);
+    } else if (block_written(block)) {
+      m_memory->zero_data(addr, n);
+    }
+    addr += n;
+    nbytes -= n;
+  }
+}
+
+void ZeroElidingMemory::submit(MemTransaction *t) {
+  if (t->op == MemTransaction::READ && all_written(t->addr, t->nbytes, false)) {
+    t->status = MemTransaction::PENDING;
+    memset(t->data, 0, t->nbytes);
+    EXTMEM_COUNT(m_stats.bytes_read += t->nbytes);
+    complete(t);
+    return;
+  }
+  bool whole = ((t->addr | t->nbytes)&(block_size() - 1)) == 0;
+  if (all_written(t->addr, t->nbytes, true) || (t->op == MemTransaction::WRITE && whole)) {
+    if (t->op == MemTransaction::WRITE) {
+      for (uint32_t block = t->addr>>m_block_size_pow2; block < (t->addr + t->nbytes)>>m_block_size_pow2; block++) set_written(block, true);
+    }
+    m_memory->submit(t);
+    return;
+  }
+  IMemory::submit(t);
+}
@@ -0,0 +1,238 @@
+#include "bench.hpp"
+#include "extmem_alloc.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <iterator>
+#if PICO_EXTMEM_HOST
+#include <chrono>
+
+static void watchdog_update() {}
+static uint64_t bench_now_ns() {
+  auto now = std::chrono::steady_clock::now().time_since_epoch();
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+}
+#else
+#include "hardware/watchdog.h"
+
+#include "pico/time.h"
+
+static uint64_t bench_now_ns() { return time_us_64()*1000; }
+#endif
+
+enum Pattern { STREAM_READ, STREAM_WRITE, RANDOM_READ, RANDOM_MIXED, OBJECTS_NAIVE, OBJECTS_POOLED };
+static const char *const s_pattern_names[] = {"stream_read", "stream_write", "random_read", "random_mixed",
+                                              "objects_naive", "objects_pooled"};
+
+// 256 bytes fits a CacheHierarchy L0 and 1K its L1: warm rows there give the
+// hit latency of each level
+static constexpr uint32_t s_working_sets[] = {256, 1024, 4*1024, 16*1024, 64*1024};
+static constexpr uint32_t s_strides[] = {4, 32, 256};
+static constexpr uint32_t s_max_trials = 32;
+
+// Objects of s_object_size visited in random order, all their words read
+// each visit. Naive placement packs them end to end from 0, so half of them
+// straddle two 32 byte lines; pooled placement takes them from an
+// ExtmemPool, which keeps each in one line.
+static constexpr uint32_t s_object_size = 24;
+static constexpr uint32_t s_object_spacing = 32;
+static uint32_t s_objects[64*1024/s_object_spacing];
+
+static void place_objects(Pattern pattern, uint32_t working_set) {
+  uint32_t count = working_set/s_object_spacing;
+  // a whole slab even for small sets; the blocks come from its start
+  ExtmemPool pool{0, std::max(working_set, ExtmemPool::s_slab_size)};
+  for (uint32_t i = 0; i < count; i++) {
+    s_objects[i] = pattern == OBJECTS_NAIVE ? i*s_object_size : pool.allocate(s_object_size);
+  }
+}
+
+// keeps the reads from being optimised out
+static volatile uint32_t s_sink;
+
+static uint32_t lcg(uint32_t &state) {
+  state = state*1664525 + 1013904223;
+  return state;
+}
+
+struct MemifAccess {
+  IMemory *mem;
+  uint32_t read(uint32_t addr) const { return mem->read_dword(addr); }
+  void write(uint32_t addr, uint32_t value) const { mem->write_dword(addr, value); }
+};
+
+// the same loop on SRAM, for its overhead
+struct SramAccess {
+  static constexpr uint32_t s_words = 1024;
+  static volatile uint32_t s_words_[s_words];
+  uint32_t read(uint32_t addr) const { return s_words_[(addr>>2)&(s_words-1)]; }
+  void write(uint32_t addr, uint32_t value) const { s_words_[(addr>>2)&(s_words-1)] = value; }
+};
+volatile uint32_t SramAccess::s_words_[SramAccess::s_words];
+
+#if !PICO_EXTMEM_HOST
+struct FaultAccess {
+  uintptr_t base;
+  uint32_t read(uint32_t addr) const { return *(volatile uint32_t*)(base + addr); }
+  void write(uint32_t addr, uint32_t value) const { *(volatile uint32_t*)(base + addr) = value; }
+};
+#endif
+
+template<class Access>
+static uint32_t run_pattern(Access const &access, Pattern pattern, uint32_t working_set, uint32_t stride, uint32_t ops, uint32_t &rng) {
+  uint32_t mask = working_set - 1, sum = 0, addr = 0;
+  switch (pattern) {
+    case STREAM_READ:
+      for (uint32_t i = 0; i < ops; i++) {
+        sum += access.read(addr);
+        addr = (addr + stride)&mask;
+      }
+      break;
+    case STREAM_WRITE:
+      for (uint32_t i = 0; i < ops; i++) {
+        access.write(addr, i);
+        addr = (addr + stride)&mask;
+      }
+      break;
+    case RANDOM_READ:
+      for (uint32_t i = 0; i < ops; i++) {
+        sum += access.read((lcg(rng)>>8)&mask&~3u);
+      }
+      break;
+    case RANDOM_MIXED:
+      // one write in four
+      for (uint32_t i = 0; i < ops; i++) {
+        uint32_t r = lcg(rng);
+        addr = (r>>8)&mask&~3u;
+        if ((r>>30) == 0) access.write(addr, r);
+        else sum += access.read(addr);
+      }
+      break;
+    case OBJECTS_NAIVE:
+    case OBJECTS_POOLED:
+      for (uint32_t i = 0; i < ops; i++) {
+        uint32_t word = i%(s_object_size/4);
+        if (word == 0) addr = s_objects[(lcg(rng)>>8)&(working_set/s_object_spacing - 1)];
+        sum += access.read(addr + word*4);
+      }
+      break;
+  }
+  return sum;
+}
+
+// linear between the two nearest ranks on sorted samples; with few trials
+// nearest rank alone would give the min and max for p10 and p90
+static float percentile(uint64_t const *sorted, uint32_t n, uint32_t pct) {
+  uint32_t pos = pct*(n-1);
+  uint32_t i = pos/100;
+  if (i + 1 >= n) return sorted[n-1];
+  return sorted[i] + float(sorted[i+1] - sorted[i])*(pos%100)/100;
+}
+
+template<class Access>
+static void bench_case(Access const &access, const char *desc, const char *access_name, CacheStats *stats,
+                       Pattern pattern, uint32_t working_set, uint32_t stride, bool warm, BenchConfig const &config) {
+  uint32_t trials = std::min(std::max(config.trials, 1u), s_max_trials);
+  uint64_t samples[s_max_trials];
+  uint32_t rng = 1, sum = 0;
+
+  // loop overhead, median of the same trials on SRAM
+  for (uint32_t t = 0; t < trials; t++) {
+    uint64_t start = bench_now_ns();
+    sum += run_pattern(SramAccess{}, pattern, working_set, stride, config.ops, rng);
+    samples[t] = bench_now_ns() - start;
+  }
+  std::sort(samples, samples + trials);
+  float overhead = percentile(samples, trials, 50);
+
+  rng = 1;
+  if (warm) sum += run_pattern(access, pattern, working_set, stride, config.ops, rng);
+  uint32_t hits = 0, misses = 0;
+  for (uint32_t t = 0; t < trials; t++) {
+    if (!warm) {
+      for (uint32_t addr = 0; addr < config.cold_sweep; addr += 8) sum += access.read(config.max_working_set + addr);
+    }
+    CacheStats before = stats ? *stats : CacheStats{};
+    uint64_t start = bench_now_ns();
+    sum += run_pattern(access, pattern, working_set, stride, config.ops, rng);
+    samples[t] = bench_now_ns() - start;
+    if (stats) {
+      hits += stats->hits - before.hits;
+      misses += stats->misses - before.misses;
+    }
+    watchdog_update();
+  }
+  s_sink = sum;
+  std::sort(samples, samples + trials);
+
+  auto per_op = [&](float ns) { return ns > overhead ? (ns - overhead)/config.ops : 0.f; };
+  BenchResult result{desc, access_name, s_pattern_names[pattern], warm, working_set, stride, trials, config.ops,
+                     per_op(samples[0]), per_op(percentile(samples, trials, 10)), per_op(percentile(samples, trials, 50)),
+                     per_op(percentile(samples, trials, 90)), per_op(samples[trials-1]),
+                     stats && hits + misses ? 100.f*hits/(hits + misses) : -1.f};
+  bench_print(result, config.format);
+}
+
+template<class Access>
+static void bench_all(Access const &access, const char *desc, const char *access_name, CacheStats *stats, BenchConfig const &config) {
+  for (uint32_t working_set : s_working_sets) {
+    if (working_set > config.max_working_set) break;
+    for (bool warm : {true, false}) {
+      for (Pattern pattern : {STREAM_READ, STREAM_WRITE}) {
+        for (uint32_t stride : s_strides) {
+          if (stride < working_set) bench_case(access, desc, access_name, stats, pattern, working_set, stride, warm, config);
+        }
+      }
+      bench_case(access, desc, access_name, stats, RANDOM_READ, working_set, 0, warm, config);
+      bench_case(access, desc, access_name, stats, RANDOM_MIXED, working_set, 0, warm, config);
+      if (working_set/s_object_spacing > std::size(s_objects)) continue;
+      for (Pattern pattern : {OBJECTS_NAIVE, OBJECTS_POOLED}) {
+        place_objects(pattern, working_set);
+        bench_case(access, desc, access_name, stats, pattern, working_set, 0, warm, config);
+      }
+    }
+  }
+}
+
+void bench_memory(IMemory &mem, const char *desc, CacheStats *stats, BenchConfig const &config) {
+  bench_all(MemifAccess{&mem}, desc, "memif", stats, config);
+}
+
+#if !PICO_EXTMEM_HOST
+void bench_mapped(uintptr_t base, const char *desc, CacheStats *stats, BenchConfig const &config) {
+  bench_all(FaultAccess{base}, desc, "hardfault", stats, config);
+}
+#endif
+
+void bench_begin(BenchConfig const &config) {
+  if (config.format == BENCH_CSV) {
+    printf("memory,access,pattern,state,working_set,stride,trials,ops,min_ns,p10_ns,median_ns,p90_ns,max_ns,hit_rate\n");
+  } else if (config.format == BENCH_TEXT) {
+    printf("%-26s %-9s %-14s %-4s %6s %6s : %9s %9s %9s %9s %9s %8s\n", "memory", "access", "pattern", "", "set", "stride",
+           "min", "p10", "median", "p90", "max", "hit");
+  }
+}
+
+void bench_print(BenchResult const &r, BenchFormat format) {
+  const char *state = r.warm ? "warm" : "cold";
+  switch (format) {
+    case BENCH_TEXT:
+      printf("%-26s %-9s %-14s %-4s %6u %6u : %7.1fns %7.1fns %7.1fns %7.1fns %7.1fns", r.memory, r.access, r.pattern, state,
+             r.working_set, r.stride, r.min_ns, r.p10_ns, r.median_ns, r.p90_ns, r.max_ns);
+      if (r.hit_rate >= 0) printf(" %7.2f%%", r.hit_rate);
+      printf("\n");
+      break;
+    case BENCH_CSV:
+      printf("\"%s\",%s,%s,%s,%u,%u,%u,%u,%.1f,%.1f,%.1f,%.1f,%.1f,%.2f\n", r.memory, r.access, r.pattern, state,
+             r.working_set, r.stride, r.trials, r.ops, r.min_ns, r.p10_ns, r.median_ns, r.p90_ns, r.max_ns, r.hit_rate);
+      break;
+    case BENCH_JSON:
+      // one object per line
+      printf("{\"memory\":\"%s\",\"access\":\"%s\",\"pattern\":\"%s\",\"state\":\"%s\",\"working_set\":%u,\"stride\":%u,"
+             "\"trials\":%u,\"ops\":%u,\"min_ns\":%.1f,\"p10_ns\":%.1f,\"median_ns\":%.1f,\"p90_ns\":%.1f,\"max_ns\":%.1f",
+             r.memory, r.access, r.pattern, state, r.working_set, r.stride, r.trials, r.ops,
+             r.min_ns, r.p10_ns, r.median_ns, r.p90_ns, r.max_ns);
+      if (r.hit_rate >= 0) printf(",\"hit_rate\":%.2f", r.hit_rate);
+      printf("}\n");
+      break;
+  }
+}
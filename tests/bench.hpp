@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include "mem_interface.hpp"
+#include "cached_memory.hpp"
+
+// Benchmark suite, on the Pico and on the host against simulated memories.
+//
+// Each case runs one access pattern over a working set for a number of
+// trials and reports the per-access time distribution across trials, with
+// the loop's own cost (measured on SRAM) taken off. Warm cases run the
+// pattern once untimed before the trials; cold cases sweep a region outside
+// the working set before every trial to push it out of the cache.
+
+enum BenchFormat { BENCH_TEXT, BENCH_CSV, BENCH_JSON };
+
+struct BenchConfig {
+  uint32_t trials;
+  uint32_t ops;            // accesses per trial
+  uint32_t max_working_set;
+  uint32_t cold_sweep;     // bytes read to evict the working set before a cold trial
+  BenchFormat format;
+};
+
+#if PICO_EXTMEM_HOST
+static constexpr BenchConfig s_default_bench_config{5, 256, 16*1024, 8*1024, BENCH_TEXT};
+#else
+// the Pico has no command line: pick the format when building,
+// -DPICO_EXTMEM_BENCH_FORMAT=CSV or JSON
+#ifndef PICO_EXTMEM_BENCH_FORMAT
+#define PICO_EXTMEM_BENCH_FORMAT BENCH_TEXT
+#endif
+static constexpr BenchConfig s_default_bench_config{9, 1024, 64*1024, 32*1024, PICO_EXTMEM_BENCH_FORMAT};
+#endif
+
+struct BenchResult {
+  const char *memory;
+  const char *access;      // "memif" through IMemory calls, "hardfault" through mapped pointers
+  const char *pattern;
+  bool warm;
+  uint32_t working_set;
+  uint32_t stride;         // bytes between accesses, 0 for random patterns
+  uint32_t trials;
+  uint32_t ops;
+  // ns per access across trials
+  float min_ns, p10_ns, median_ns, p90_ns, max_ns;
+  float hit_rate;          // percent of cache lookups, negative without a cache
+};
+
+// CSV header line, when the format has one
+void bench_begin(BenchConfig const &config);
+void bench_print(BenchResult const &result, BenchFormat format);
+
+// All patterns and working sets against mem through its IMemory calls
+void bench_memory(IMemory &mem, const char *desc, CacheStats *stats, BenchConfig const &config);
+#if !PICO_EXTMEM_HOST
+// The same through hardfaults on addresses from base, mapped by the caller
+void bench_mapped(uintptr_t base, const char *desc, CacheStats *stats, BenchConfig const &config);
+#endif
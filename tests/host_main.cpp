@@ -0,0 +1,1597 @@
+#include <cstdio>
+#include <list>
+#include <array>
+#include <tuple>
+#include <cstring>
+#include <vector>
+#include <atomic>
+#include <unistd.h>
+#include <memory_resource>
+
+#include "sim_memory.hpp"
+#include "psram_model.hpp"
+#include "spiram.hpp"
+#include "cached_memory.hpp"
+#include "zero_eliding_memory.hpp"
+#include "cache_hierarchy.hpp"
+#include "extmem_mapper.hpp"
+#include "thumb_decoder.hpp"
+#include "extmem_ptr.hpp"
+#include "extmem_alloc.hpp"
+#include "extmem_containers.hpp"
+#include "trace_replay.hpp"
+#include <chrono>
+#include "bench.hpp"
+#include "host_test.hpp"
+
+static std::list<std::tuple<IMemory*, const char*, CacheStats*>> s_test_memories;
+
+TestFunc *TestFunc::s_all;
+int TestFunc::s_failures;
+
+static uint32_t lcg(uint32_t &state) {
+  state = state*1664525 + 1013904223;
+  return state;
+}
+
+TEST(ram_memory_read_write) {
+  RamMemory mem{4096};
+  mem.write_byte(1, 0xab);
+  mem.write_word(2, 0x1234);
+  mem.write_dword(5, 0xdeadbeef);
+  CHECK(mem.read_byte(1) == 0xab);
+  CHECK(mem.read_word(2) == 0x1234);
+  CHECK(mem.read_dword(5) == 0xdeadbeef);
+
+  uint8_t in[64], out[64];
+  for (unsigned i = 0; i < sizeof(in); i++) in[i] = i*7;
+  mem.write_data(1000, sizeof(in), in);
+  mem.read_data(1000, sizeof(out), out);
+  CHECK(memcmp(in, out, sizeof(in)) == 0);
+}
+
+TEST(mmap_memory_persists) {
+  const char *path = "pico_extmem_mmap_test.bin";
+  {
+    MmapMemory mem{path, 4096};
+    CHECK(mem.ok());
+    mem.write_dword(128, 0xc0decafe);
+  }
+  {
+    MmapMemory mem{path, 4096};
+    CHECK(mem.ok());
+    CHECK(mem.read_dword(128) == 0xc0decafe);
+  }
+  unlink(path);
+}
+
+TEST(latency_memory_charges_cost) {
+  RamMemory ram{4096};
+  LatencyMemory mem{&ram, {1000, 10}};
+  uint8_t buf[32];
+  mem.read_data(0, sizeof(buf), buf);
+  mem.write_dword(0, 1);
+  CHECK(mem.transactions() == 2);
+  CHECK(mem.bytes() == 36);
+  CHECK(mem.elapsed_ns() == 2000 + 36*10);
+  mem.reset_counters();
+  CHECK(mem.elapsed_ns() == 0);
+}
+
+template<class Cache>
+static bool cache_matches_reference(uint32_t span) {
+  RamMemory backing{span}, reference{span};
+  Cache cache{&backing};
+  uint32_t rng = 1;
+  uint8_t buf[Cache::s_cache_line_size], ref[Cache::s_cache_line_size];
+  for (int i = 0; i < 20'000; i++) {
+    uint32_t addr = (lcg(rng) >> 8) % (span - 4) & ~3u;
+    uint32_t value = lcg(rng);
+    uint32_t offset = addr & (Cache::s_cache_line_size-1);
+    uint32_t nbytes = 1 + (value>>8) % (Cache::s_cache_line_size - offset);
+    switch ((lcg(rng) >> 12) % 8) {
+    case 0:
+      cache.write_byte(addr+1, value);
+      reference.write_byte(addr+1, value);
+      break;
+    case 1:
+      cache.write_word(addr+2, value);
+      reference.write_word(addr+2, value);
+      break;
+    case 2:
+      cache.write_dword(addr, value);
+      reference.write_dword(addr, value);
+      break;
+    case 3:
+      for (uint32_t j = 0; j < nbytes; j++) buf[j] = lcg(rng);
+      cache.write_data(addr, nbytes, buf);
+      reference.write_data(addr, nbytes, buf);
+      break;
+    case 4:
+      if (cache.read_byte(addr+3) != reference.read_byte(addr+3)) return false;
+      break;
+    case 5:
+      if (cache.read_word(addr) != reference.read_word(addr)) return false;
+      break;
+    case 6:
+      if (cache.read_dword(addr) != reference.read_dword(addr)) return false;
+      break;
+    case 7:
+      cache.read_data(addr, nbytes, buf);
+      reference.read_data(addr, nbytes, ref);
+      if (memcmp(buf, ref, nbytes) != 0) return false;
+      break;
+    }
+  }
+  return true;
+}
+
+TEST(cached_memory_matches_reference) {
+  CHECK(cache_matches_reference<Cached_8_8>(4096));
+  CHECK(cache_matches_reference<Cached_32_32>(16384));
+  CHECK(cache_matches_reference<Cached_64_1024>(1<<20));
+  CHECK(cache_matches_reference<Cached_32_32_DM>(16384));
+  CHECK(cache_matches_reference<Cached_32_32_FA>(16384));
+  CHECK(cache_matches_reference<Cached_32_32_RR>(16384));
+  CHECK(cache_matches_reference<Cached_32_32_LRU>(16384));
+  CHECK(cache_matches_reference<Cached_32_32_CLOCK>(16384));
+  CHECK(cache_matches_reference<Cached_32_32_RANDOM>(16384));
+}
+
+TEST(cached_memory_pins_lines) {
+  RamMemory ram{1<<16};
+  Cached_32_32 cache{&ram};  // 8 sets of 4 ways, 32 byte lines
+  for (uint32_t i = 0; i < 64; i++) ram.write_byte(0x1000 + i, i);
+
+  CHECK(cache.pin(0x1010, 32) == nullptr); // crosses a line
+  uint8_t *record = cache.pin(0x1008, 16);
+  CHECK(record && record[0] == 8 && record[15] == 23);
+  uint8_t *same = cache.pin(0x1000, 4);
+  CHECK(same == record - 8);
+
+  // thrash the set: the pinned line stays, the other ways turn over
+  for (uint32_t i = 1; i < 64; i++) cache.read_dword(0x1000 + i*256);
+  CHECK(record[0] == 8);
+  record[0] = 0xaa;
+  cache.unpin(0x1008, 16, true);
+  CHECK(cache.read_byte(0x1008) == 0xaa);
+  cache.unpin(0x1000, 4, false);
+
+  // three of the four ways at most
+  uint8_t *pinned[3];
+  for (uint32_t i = 0; i < 3; i++) CHECK((pinned[i] = cache.pin(0x2000 + i*256, 4)) != nullptr);
+  CHECK(cache.pin(0x2300, 4) == nullptr);
+  CHECK(cache.read_dword(0x2300) == 0);
+  for (uint32_t i = 0; i < 3; i++) cache.unpin(0x2000 + i*256, 4, false);
+
+  // unpinned, the written line is evicted and written back like any other
+  for (uint32_t i = 1; i < 64; i++) cache.read_dword(0x1000 + i*256);
+  CHECK(ram.read_byte(0x1008) == 0xaa);
+  CHECK(Cached_32_32_DM{&ram}.pin(0x1000, 4) == nullptr);
+}
+
+TEST(ext_array_walks_lines) {
+  RamMemory ram{1<<16};
+  Cached_32_32 cache{&ram};
+  ExtArray<uint32_t, Cached_32_32> values{&cache, 0x100, 1000};
+  uint32_t next = 0;
+  values.update_lines([&](uint32_t *v, size_t n) {
+    for (size_t i = 0; i < n; i++) v[i] = next++;
+  });
+  cache.stats() = {};
+  uint64_t sum = 0;
+  values.for_each_line([&](uint32_t const *v, size_t n) {
+    for (size_t i = 0; i < n; i++) sum += v[i];
+  });
+  CHECK(sum == 999*1000/2);
+  CHECK(cache.stats().hits + cache.stats().misses == 1000*4/32); // one lookup per line
+
+  // element at a time through the proxies
+  cache.stats() = {};
+  sum = 0;
+  for (uint32_t v : values) sum += v;
+  CHECK(sum == 999*1000/2);
+  CHECK(cache.stats().hits + cache.stats().misses == 1000);
+  values[3] += 10;
+  CHECK(values[3] == 13 && *(values.begin() + 3) == 13);
+  CHECK(values.end() - values.begin() == 1000);
+
+  // elements straddling lines, pinned where they fit and copied through
+  // IMemory
+  struct Record { uint8_t tag; uint8_t bytes[10]; } __attribute__((packed));
+  ExtArray<Record, Cached_32_32> records{&cache, 0x3003, 40};
+  ExtArray<Record> copied{&cache, 0x3003, 40};
+  records.update_lines([](Record *r, size_t n) {
+    for (size_t i = 0; i < n; i++) r[i] = {7, {1, 2, 3}};
+  });
+  Record second = copied[1];
+  CHECK(second.tag == 7 && second.bytes[2] == 3);
+  unsigned count = 0;
+  copied.for_each_line([&](Record const *r, size_t n) {
+    for (size_t i = 0; i < n; i++) count += r[i].tag == 7 && r[i].bytes[1] == 2;
+  });
+  CHECK(count == 40);
+  CHECK(cache.read_byte(0x3003 + 40*sizeof(Record)) == 0);
+}
+
+TEST(extmem_allocators_place_on_lines) {
+  ExtmemPool pool{0x100, 4*ExtmemPool::s_slab_size};
+  uintptr_t a = pool.allocate(24), b = pool.allocate(24), c = pool.allocate(5);
+  CHECK(a == 0x100 && b == 0x120);  // 32 byte class, one line each
+  CHECK(c == 0x100 + ExtmemPool::s_slab_size);  // another class, another slab
+  CHECK(pool.used() == 72);
+  pool.deallocate(a);
+  CHECK(pool.allocate(30) == a);
+  CHECK(pool.allocate(ExtmemPool::s_max_block + 1) == s_extmem_alloc_failed);
+  for (int i = 0; i < 4; i++) CHECK(pool.allocate(512) != s_extmem_alloc_failed);
+  CHECK(pool.allocate(512) == s_extmem_alloc_failed);
+
+  ExtmemArena arena{0x1001, 1024, 32};
+  CHECK(arena.base() == 0x1020 && arena.size() == 992);
+  uintptr_t x = arena.allocate(40), y = arena.allocate(1), z = arena.allocate(64);
+  CHECK(x == 0x1020 && y == 0x1060 && z == 0x1080);
+  CHECK(arena.used() == 64 + 32 + 64);
+  arena.deallocate(x, 40);
+  CHECK(arena.allocate(64) == x);  // first fit into the hole
+  arena.deallocate(y, 1);
+  arena.deallocate(x, 64);
+  arena.deallocate(z, 64);         // top block, takes the coalesced hole with it
+  CHECK(arena.used() == 0 && arena.allocate(992) == 0x1020);
+  CHECK(arena.allocate(1) == s_extmem_alloc_failed);
+
+  ExtmemHeap heap{0x3000'0000, 1<<20, 32, 8*ExtmemPool::s_slab_size};
+  uintptr_t small = heap.allocate(16), big = heap.allocate(4096);
+  CHECK(heap.pool().owns(small) && heap.arena().owns(big));
+  CHECK(big == 0x3000'0000 + 8*ExtmemPool::s_slab_size);
+  heap.deallocate(small, 16);
+  heap.deallocate(big, 4096);
+  CHECK(heap.used() == 0);
+
+  // 24 byte objects visited at random, packed end to end or pooled one per line
+  auto misses = [](auto place) {
+    RamMemory ram{1<<16};
+    Cached_32_32 cache{&ram};
+    uint32_t state = 1;
+    for (int i = 0; i < 2000; i++) {
+      uintptr_t addr = place((lcg(state)>>8)%512);
+      for (int word = 0; word < 6; word++) cache.read_dword(addr + word*4);
+    }
+    return cache.stats().misses;
+  };
+  ExtmemPool objects{0, 512*32};
+  std::vector<uintptr_t> pooled(512);
+  for (auto &addr : pooled) addr = objects.allocate(24);
+  CHECK(misses([&](uint32_t i) { return pooled[i]; }) < misses([](uint32_t i) { return i*24; }));
+}
+
+TEST(extmem_resource_hosts_pmr_containers) {
+  // host memory stands in for the mapped window
+  alignas(32) static uint8_t window[64*1024];
+  ExtmemHeap heap{uintptr_t(window), sizeof(window), 32, 16*1024};
+  ExtmemResource resource{heap};
+  {
+    std::pmr::vector<uint32_t> values{&resource};
+    for (uint32_t i = 0; i < 1000; i++) values.push_back(i);
+    CHECK(heap.arena().owns(uintptr_t(values.data())));
+    uint64_t sum = 0;
+    for (uint32_t v : values) sum += v;
+    CHECK(sum == 999*1000/2);
+    std::pmr::list<uint32_t> nodes{&resource};
+    for (uint32_t i = 0; i < 100; i++) nodes.push_back(i);
+    CHECK(heap.pool().owns(uintptr_t(&nodes.front())));
+  }
+  CHECK(heap.used() == 0);
+  bool threw = false;
+  try {
+    (void)resource.allocate(1<<20);
+  } catch (std::bad_alloc const &) {
+    threw = true;
+  }
+  CHECK(threw);
+}
+
+TEST(extmem_containers_move_chunks) {
+  RamMemory ram{1<<16};
+  Cached_32_32 cache{&ram};
+  ExtmemArena arena{0, 1<<16, Cached_32_32::s_cache_line_size};
+  {
+    ExtVector<uint32_t, Cached_32_32> log{&cache, arena};
+    bool pushed = true;
+    for (uint32_t i = 0; i < 100; i++) pushed &= log.push_back(i);
+    std::vector<uint32_t> more(300);
+    for (uint32_t i = 0; i < 300; i++) more[i] = 100 + i;
+    CHECK(pushed && log.append(more.data(), 300) == 300);
+    CHECK(log.size() == 400 && log[5] == 5 && log[399] == 399);
+    log.set(70, 7);
+    CHECK(log[70] == 7);
+    log.set(70, 70);
+    uint64_t sum = 0;
+    unsigned chunks = 0;
+    log.for_each_chunk([&](uint32_t const *v, uint32_t n) {
+      chunks++;
+      for (uint32_t i = 0; i < n; i++) sum += v[i];
+    });
+    CHECK(sum == 399*400/2 && chunks == 7);
+    uint32_t window[10];
+    log.read(60, window, 10);
+    CHECK(window[0] == 60 && window[9] == 69);
+    // the partly filled last chunk reaches memory on flush
+    log.flush();
+    CHECK(cache.read_dword(6*256 + 15*4) == 399);
+
+    ExtVector<uint8_t, IMemory, 2, 32> small{&cache, arena};
+    for (int i = 0; i < 64; i++) small.push_back(i);
+    CHECK(!small.push_back(0) && small.size() == 64);
+  }
+  CHECK(arena.used() == 0);
+
+  {
+    ExtDeque<uint16_t, Cached_32_32, 8, 64> queue{&cache, arena};
+    for (uint16_t i = 0; i < 100; i++) queue.push_back(i);
+    for (uint16_t i = 0; i < 10; i++) queue.push_front(1000 + i);
+    CHECK(queue.size() == 110 && queue.front() == 1009 && queue.back() == 99 && queue[10] == 0);
+    uint16_t out[50];
+    CHECK(queue.drain(out, 50) == 50);
+    CHECK(out[0] == 1009 && out[10] == 0 && out[49] == 39);
+    CHECK(queue.pop_back() && queue.back() == 98);
+    unsigned count = 0;
+    uint16_t first = 0;
+    queue.for_each_chunk([&](uint16_t const *v, uint32_t n) {
+      if (!count) first = v[0];
+      count += n;
+    });
+    CHECK(count == 59 && first == 40);
+    // as a queue it reuses its chunks
+    uint32_t used = arena.used();
+    uint16_t next = 99, expect = 40;
+    bool in_order = true;
+    for (int round = 0; round < 100; round++) {
+      for (int i = 0; i < 20; i++) queue.push_back(next++);
+      for (int i = 0; i < 20; i++) {
+        in_order &= queue.front() == expect++;
+        queue.pop_front();
+      }
+    }
+    CHECK(in_order && arena.used() <= used + 64);
+    CHECK(queue.drain(nullptr, 1000) == 59 && queue.empty());
+  }
+  CHECK(arena.used() == 0);
+}
+
+TEST(ext_ring_streams_at_burst_rate) {
+  PsramModel psram, raw_psram;
+  SpiRam spiram{psram}, raw{raw_psram};
+  ExtmemArena arena{0, spiram.size_bytes()};
+  ExtRing<uint16_t> ring{&spiram, arena, 32*1024};
+  CHECK(ring.valid() && ring.capacity() == 32*1024);
+
+  // 64K of ADC style blocks through the ring and written raw
+  uint16_t block[256];
+  bool fitted = true;
+  for (uint32_t k = 0; k < 128; k++) {
+    for (uint32_t i = 0; i < 256; i++) block[i] = k*256 + i;
+    fitted &= ring.append(block, 256) == 256;
+    raw.write_data(k*sizeof(block), sizeof(block), (uint8_t const*)block);
+  }
+  CHECK(fitted && ring.space() == 0 && ring.append(block, 1) == 0);
+  CHECK(psram.stats().commands == raw_psram.stats().commands);
+  CHECK(psram.stats().data_bytes == raw_psram.stats().data_bytes);
+
+  // drained and refilled in odd sizes, wrapping
+  uint16_t out[300];
+  uint16_t expect = 0, next = 32*1024;
+  bool in_order = true;
+  for (int round = 0; round < 300; round++) {
+    uint32_t n = ring.drain(out, 37 + round%263);
+    for (uint32_t i = 0; i < n; i++) in_order &= out[i] == expect++;
+    for (uint32_t i = 0; i < n; i++) out[i] = next++;
+    ring.append(out, n);
+  }
+  CHECK(in_order && ring.size() == 32*1024);
+}
+
+TEST(zero_eliding_memory_skips_untouched_blocks) {
+  RamMemory ram{1<<16};
+  memset(ram.data(), 0xa5, 1<<16);  // power-up garbage
+  LatencyMemory bus{&ram};
+  ZeroElidingMemory zero{&bus};
+  uint8_t buffer[3000];
+  zero.read_data(100, sizeof(buffer), buffer);
+  CHECK(buffer[0] == 0 && buffer[2999] == 0 && zero.read_dword(5000) == 0);
+  CHECK(bus.transactions() == 0);
+
+  // the first partial write fills its block
+  zero.write_dword(2048 + 8, 0x12345678);
+  CHECK(bus.transactions() == 1 && bus.bytes() == 1024);
+  CHECK(zero.written(2048) && zero.blocks_written() == 1);
+  CHECK(zero.read_dword(2048 + 8) == 0x12345678 && zero.read_dword(2048) == 0 && ram.data()[2048 + 1023] == 0);
+
+  // zeros over zero blocks are dropped, whole blocks go out with written
+  // ones in one burst
+  uint8_t zeros[2048] = {};
+  bus.reset_counters();
+  zero.write_data(4096, sizeof(zeros), zeros);
+  CHECK(bus.transactions() == 0 && !zero.written(4096));
+  std::vector<uint8_t> sevens(3*1024, 7);
+  zero.write_data(1024, sevens.size(), sevens.data());
+  CHECK(bus.transactions() == 1 && zero.blocks_written() == 3);
+
+  // whole blocks are zeroed in the bitmap, partial ends of written ones on
+  // the bus
+  bus.reset_counters();
+  zero.zero_data(1024 + 512, 2*1024);
+  CHECK(!zero.written(2048) && zero.written(1024) && zero.written(3072));
+  CHECK(bus.bytes() == 2*512);
+  CHECK(zero.read_byte(1535) == 7 && zero.read_byte(1536) == 0 && zero.read_dword(2048 + 8) == 0);
+  CHECK(zero.read_byte(3583) == 0 && zero.read_byte(3584) == 7);
+
+  // reads of zero blocks complete on submit
+  bus.reset_counters();
+  MemTransaction t;
+  t.op = MemTransaction::READ;
+  t.addr = 8192;
+  t.nbytes = 256;
+  t.data = buffer;
+  t.on_complete = nullptr;
+  buffer[0] = 1;
+  zero.submit(&t);
+  CHECK(t.status == MemTransaction::DONE && buffer[0] == 0 && bus.transactions() == 0);
+}
+
+TEST(wrappers_pass_zeroing_down) {
+  RamMemory ram{1<<16};
+  LatencyMemory bus{&ram};
+  ThreadedMemory dma{&bus};
+  ZeroElidingMemory zero{&dma};
+  std::vector<uint8_t> sevens(4*1024, 7);
+  zero.write_data(0, sevens.size(), sevens.data());
+  CHECK(zero.blocks_written() == 4);
+
+  // the partial ends reach the bus as zeroes and are paid for like writes
+  bus.reset_counters();
+  zero.zero_data(1024 + 512, 2*1024);
+  CHECK(zero.blocks_written() == 3 && !zero.written(2048));
+  CHECK(bus.transactions() == 2 && bus.bytes() == 2*512);
+  CHECK(bus.elapsed_ns() == 2*LatencyMemory::s_spiram_cost.ns_per_transaction + 2*512*LatencyMemory::s_spiram_cost.ns_per_byte);
+  CHECK(ram.data()[1535] == 7 && ram.data()[1536] == 0 && ram.data()[3583] == 0 && ram.data()[3584] == 7);
+}
+
+TEST(cached_memory_zeroes_through_tracker) {
+  RamMemory ram{1<<16};
+  memset(ram.data(), 0xa5, 1<<16);
+  LatencyMemory bus{&ram};
+  ZeroElidingMemory zero{&bus};
+  Cached_32_32 cache{&zero};
+
+  // first touch of a large buffer is free
+  uint32_t sum = 0;
+  for (uint32_t addr = 0; addr < 32*1024; addr += 4) sum += cache.read_dword(addr);
+  CHECK(sum == 0 && bus.transactions() == 0 && cache.stats().misses == 32*1024/32);
+
+  // cleared in bulk after being written, partly still in the cache
+  for (uint32_t addr = 0; addr < 8192; addr += 4) cache.write_dword(addr, addr + 1);
+  CHECK(zero.blocks_written() > 0);
+  cache.zero_data(0, 8192);
+  bool zeroed = true;
+  for (uint32_t addr = 0; addr < 8192; addr += 4) zeroed &= cache.read_dword(addr) == 0;
+  CHECK(zeroed && zero.blocks_written() == 0);
+
+  // partly zeroed sectors keep the rest
+  cache.write_dword(100, 0x01020304);
+  cache.write_dword(104, 0x05060708);
+  cache.zero_data(102, 4);
+  CHECK(cache.read_dword(100) == 0x0304 && cache.read_dword(104) == 0x05060000);
+}
+
+TEST(victim_buffer_keeps_conflicting_lines) {
+  RamMemory ram{1<<16};
+  LatencyMemory plain_bus{&ram}, vb_bus{&ram};
+  Cached_32_32 plain{&plain_bus}, l1{&vb_bus};
+  VB_8_Cached_32_32 vb{&l1};
+  // two lines more than a set holds, round robin: L1 alone misses every time
+  constexpr uint32_t stride = Cached_32_32::s_num_sets*32;
+  constexpr uint32_t nhot = Cached_32_32::s_num_ways + 2;
+  for (int round = 0; round < 100; round++) {
+    for (uint32_t k = 0; k < nhot; k++) {
+      plain.read_dword(k*stride);
+      vb.read_dword(k*stride);
+    }
+  }
+  CHECK(plain_bus.transactions() > 50*nhot && vb_bus.transactions() <= nhot);
+  CHECK(l1.stats().misses == nhot && vb.stats().l0_hits > 0 && vb.stats().l0_writebacks == 0);
+}
+
+TEST(cache_hierarchy_writes_back_once) {
+  RamMemory ram{1<<16};
+  auto stored = [&](uint32_t addr) { uint32_t value; memcpy(&value, ram.data() + addr, 4); return value; };
+  constexpr uint32_t stride = Cached_32_32::s_num_sets*32;
+  constexpr uint32_t ways = Cached_32_32::s_num_ways;
+  {
+    // inclusive: the dirty L0 line goes into L1, which writes it back
+    Cached_32_32 l1{&ram};
+    L0_8_Cached_32_32 h{&l1};
+    h.write_dword(0, 0x12345678);
+    CHECK(h.stats().l0_fills == 1 && l1.stats().misses == 1);
+    CHECK(h.read_dword(0) == 0x12345678 && h.stats().l0_hits == 1);
+    for (uint32_t addr = 1024; addr < 1024 + 16*1024; addr += 32) h.read_dword(addr);
+    CHECK(h.stats().l0_writebacks == 1 && l1.stats().writebacks == 1 && stored(0) == 0x12345678);
+
+    // kept hot in L0 while its L1 set turns over: back-invalidated, and
+    // L1's write-back carries L0's data
+    h.write_dword(64, 0xabcdef01);
+    for (int round = 0; round < 4; round++) {
+      for (uint32_t k = 1; k <= ways; k++) {
+        h.read_dword(64);
+        h.read_dword(64 + k*stride);
+      }
+    }
+    CHECK(h.stats().back_invalidations >= 1 && h.stats().l0_writebacks == 1);
+    CHECK(l1.stats().writebacks == 2 && stored(64) == 0xabcdef01 && h.read_dword(64) == 0xabcdef01);
+  }
+  {
+    // exclusive: L1's victim moves to L0 unwritten, L0 writes it back
+    Cached_32_32 l1{&ram};
+    VB_8_Cached_32_32 h{&l1};
+    h.write_dword(128, 0x55aa55aa);
+    for (uint32_t k = 1; k <= ways; k++) h.read_dword(128 + k*stride);
+    CHECK(l1.stats().writebacks == 0 && h.stats().l0_fills == 1);
+    CHECK(h.read_dword(128) == 0x55aa55aa && h.stats().l0_hits == 1);
+    for (uint32_t k = ways + 1; k <= ways + 24; k++) h.read_dword(128 + k*stride);
+    CHECK(h.stats().l0_writebacks == 1 && l1.stats().writebacks == 0 && stored(128) == 0x55aa55aa);
+  }
+}
+
+template<class H>
+static bool hierarchy_matches_reference(H &h) {
+  constexpr uint32_t span = 8192;
+  std::vector<uint8_t> ref(span);
+  h.zero_data(0, span);
+  uint32_t rng = 7;
+  bool ok = true;
+  for (int i = 0; i < 20000; i++) {
+    uint32_t op = lcg(rng) >> 28;
+    uint32_t addr = (lcg(rng) >> 8) % (span - 512);
+    if (op < 5) {
+      uint32_t value = lcg(rng);
+      h.write_dword(addr, value);
+      memcpy(&ref[addr], &value, 4);
+    } else if (op < 7) {
+      h.write_byte(addr, uint8_t(op));
+      ref[addr] = uint8_t(op);
+    } else if (op < 12) {
+      uint32_t expected;
+      memcpy(&expected, &ref[addr], 4);
+      ok &= h.read_dword(addr) == expected;
+    } else if (op < 14) {
+      // long enough now and then to stream through L1
+      uint8_t buf[300];
+      uint32_t n = 1 + (lcg(rng) >> 8) % sizeof(buf);
+      for (uint32_t j = 0; j < n; j++) buf[j] = uint8_t(lcg(rng));
+      h.write_data(addr, n, buf);
+      memcpy(&ref[addr], buf, n);
+    } else if (op < 15) {
+      uint8_t buf[300];
+      uint32_t n = 1 + (lcg(rng) >> 8) % sizeof(buf);
+      h.read_data(addr, n, buf);
+      ok &= memcmp(buf, &ref[addr], n) == 0;
+    } else {
+      uint32_t n = 1 + (lcg(rng) >> 8) % 100;
+      h.zero_data(addr, n);
+      memset(&ref[addr], 0, n);
+    }
+  }
+  h.flush();
+  std::vector<uint8_t> all(span);
+  h.read_data(0, span, all.data());
+  return ok && all == ref;
+}
+
+TEST(cache_hierarchy_matches_reference) {
+  RamMemory ram{1<<16};
+  Cached_32_32 incl_l1{&ram}, excl_l1{&ram};
+  L0_8_Cached_32_32 incl{&incl_l1};
+  VB_8_Cached_32_32 excl{&excl_l1};
+  CHECK(hierarchy_matches_reference(incl));
+  CHECK(hierarchy_matches_reference(excl));
+}
+
+TEST(cached_memory_flushes_and_invalidates_ranges) {
+  RamMemory ram{1<<16};
+  auto stored = [&](uint32_t addr) { uint32_t value; memcpy(&value, ram.data() + addr, 4); return value; };
+  {
+    Cached_32_32 cache{&ram};
+    for (uint32_t addr = 0; addr < 1024; addr += 4) cache.write_dword(addr, addr + 1);
+    CHECK(stored(0) == 0 && stored(512) == 0);
+    cache.flush_range(0, 512);
+    CHECK(stored(0) == 1 && stored(508) == 509 && stored(512) == 0);
+    CHECK(cache.stats().cleans == 512/32);
+    // still cached, now clean: nothing more to write back
+    uint32_t misses = cache.stats().misses;
+    CHECK(cache.read_dword(100) == 101 && cache.stats().misses == misses);
+    cache.flush_range(0, 512);
+    CHECK(cache.stats().cleans == 512/32);
+
+    // written behind the cache's back
+    uint32_t value = 0xdeadbeef;
+    memcpy(ram.data() + 100, &value, 4);
+    CHECK(cache.read_dword(100) == 101);
+    cache.invalidate_range(96, 32);
+    CHECK(cache.read_dword(100) == 0xdeadbeef);
+
+    // a line only partly invalidated keeps its dirty data outside the range
+    cache.write_dword(600, 0x600);
+    cache.write_dword(604, 0x604);
+    cache.invalidate_range(600, 4);
+    CHECK(stored(604) == 0x604 && cache.read_dword(604) == 0x604);
+
+    cache.write_dword(700, 0x700);
+    cache.flush_all();
+    CHECK(stored(700) == 0x700 && stored(1020) == 1021);
+    cache.write_dword(800, 0x800);
+  }
+  // and on destruction
+  CHECK(stored(800) == 0x800);
+}
+
+// Read-modify-write of whole lines at random, so every victim is dirty in
+// full; clean() between updates, as from an idle hook, leaves them clean.
+static uint64_t update_lines_bus_time(bool idle_clean, CacheStats &stats) {
+  RamMemory ram{1<<16};
+  LatencyMemory bus{&ram};
+  Cached_32_32 cache{&bus};
+  uint32_t rng = 3;
+  uint64_t busy = 0;
+  for (int i = 0; i < 2000; i++) {
+    uint32_t line = ((lcg(rng) >> 8) % 512)*32;
+    uint64_t before = bus.elapsed_ns();
+    for (uint32_t word = 0; word < 32; word += 4) cache.write_dword(line + word, cache.read_dword(line + word) + 1);
+    busy += bus.elapsed_ns() - before;
+    if (idle_clean) cache.clean(2);
+  }
+  stats = cache.stats();
+  return busy;
+}
+
+TEST(cached_memory_idle_clean_halves_miss_time) {
+  CacheStats plain, cleaned;
+  uint64_t plain_ns = update_lines_bus_time(false, plain);
+  uint64_t cleaned_ns = update_lines_bus_time(true, cleaned);
+  CHECK(plain.writebacks > plain.misses*9/10);
+  CHECK(cleaned.writebacks < cleaned.misses/10 && cleaned.cleans > 0);
+  CHECK(cleaned_ns*10 < plain_ns*6);
+}
+
+TEST(cached_memory_counts_traffic) {
+  RamMemory ram{1<<16};
+  Cached_32_32_DM cache{&ram};
+  cache.write_dword(0, 1);          // miss, fill the line's other sectors
+  cache.read_dword(4);              // hit
+  cache.read_dword(32*32);          // same set, evicts the dirty line
+  CacheStats snapshot = cache.stats();
+  CHECK(snapshot.hits == 1 && snapshot.misses == 2);
+  CHECK(snapshot.evictions == 1 && snapshot.writebacks == 1);
+  CHECK(snapshot.bytes_read == 28 + 32 && snapshot.bytes_written == 4);
+  uint8_t big[Cached_32_32_DM::s_default_stream_threshold];
+  cache.read_data(4096, sizeof(big), big);
+  CHECK(cache.stats().bytes_read - snapshot.bytes_read == sizeof(big));
+  cache.reset_stats();
+  CHECK(cache.stats().misses == 0 && cache.stats().bytes_read == 0);
+}
+
+TEST(cached_memory_honours_geometry) {
+  CHECK(Cached_8_1024::s_num_cache_lines == 8);
+  CHECK(Cached_8_1024::s_cache_line_size == 1024);
+  CHECK(Cached_64_8::s_num_sets == 16);
+
+  // two lines a cache-size apart share a set: they thrash a direct mapped
+  // cache but coexist in an associative one
+  RamMemory ram{1<<16};
+  LatencyMemory dm_bus{&ram}, fa_bus{&ram};
+  Cached_32_32_DM dm{&dm_bus};
+  Cached_32_32_FA fa{&fa_bus};
+  for (int i = 0; i < 100; i++) {
+    dm.read_dword(0); dm.read_dword(32*32);
+    fa.read_dword(0); fa.read_dword(32*32);
+  }
+  CHECK(dm_bus.transactions() == 200);
+  CHECK(fa_bus.transactions() == 2);
+}
+
+TEST(mapper_emulates_register_offset_access) {
+  RamMemory ram{4096};
+  ExtmemMapper::init(&ram, 0x3000'0000);
+  ExtmemMapper::s_emulate_budget = 1;
+
+  const uint16_t program[] = {
+    0b0101'000'010'001'000, // str  r0, [r1, r2]
+    0b0101'100'010'001'011, // ldr  r3, [r1, r2]
+    0b0101'010'010'001'000, // strb r0, [r1, r2]
+    0b0101'011'010'001'100, // ldrsb r4, [r1, r2]
+  };
+  exception_pushstack ps{};
+  ps.PC = uintptr_t(&program[0]);
+  ps.R0 = 0x1234'5680;
+  ps.R1 = 0x3000'0000;
+  ps.R2 = 0x40;
+
+  ExtmemMapper::emulate(&ps);
+  CHECK(ram.read_dword(0x40) == 0x1234'5680);
+  ExtmemMapper::emulate(&ps);
+  CHECK(uint32_t(ps.R3) == 0x1234'5680);
+  ExtmemMapper::emulate(&ps);
+  ExtmemMapper::emulate(&ps);
+  CHECK(uint32_t(ps.R4) == 0xffff'ff80);
+  CHECK(ps.PC == uintptr_t(&program[4]));
+  ExtmemMapper::s_emulate_budget = 16;
+}
+
+TEST(thumb_decoder_scales_immediates) {
+  DecodedOp op = thumb_decode(0b0110'1'00010'001'000); // ldr r0, [r1, #8]
+  CHECK(op.kind == DecodedOp::LOAD && op.size == 4 && !op.sign);
+  CHECK(op.imm == 8 && op.rm == DecodedOp::NO_SLOT);
+  CHECK(op.rn == thumb_reg_slot(1) && op.rt == thumb_reg_slot(0));
+
+  op = thumb_decode(0b1000'0'00011'010'011); // strh r3, [r2, #6]
+  CHECK(op.kind == DecodedOp::STORE && op.size == 2 && op.imm == 6);
+
+  op = thumb_decode(0b0111'1'00101'000'001); // ldrb r1, [r0, #5]
+  CHECK(op.kind == DecodedOp::LOAD && op.size == 1 && op.imm == 5);
+
+  op = thumb_decode(0b1001'1'101'00000011); // ldr r5, [sp, #12]
+  CHECK(op.kind == DecodedOp::LOAD && op.rn == DecodedOp::SP_SLOT && op.imm == 12);
+  CHECK(op.rt == thumb_reg_slot(5));
+
+  op = thumb_decode(0b0101'111'010'001'000); // ldrsh r0, [r1, r2]
+  CHECK(op.kind == DecodedOp::LOAD && op.size == 2 && op.sign && op.rm == thumb_reg_slot(2));
+
+  op = thumb_decode(0b1100'1'011'00000110); // ldm r3!, {r1, r2}
+  CHECK(op.kind == DecodedOp::LOAD_MULTIPLE && op.reglist == 0b110 && op.rn == thumb_reg_slot(3));
+
+  CHECK(thumb_decode(0x4770).kind == DecodedOp::NONE); // bx lr
+}
+
+TEST(mapper_caches_decoded_instructions) {
+  RamMemory ram{4096};
+  ExtmemMapper::init(&ram, 0x3000'0000);
+  ExtmemMapper::s_emulate_budget = 1;
+  const uint16_t program[] = {
+    0b0110'0'00011'001'000, // str  r0, [r1, #12]
+    0b0110'1'00011'001'010, // ldr  r2, [r1, #12]
+  };
+  exception_pushstack ps{};
+  ps.R0 = 0xcafe'f00d;
+  ps.R1 = 0x3000'0100;
+  MapperStats before = ExtmemMapper::stats();
+  for (int i = 0; i < 10; i++) {
+    ps.PC = uintptr_t(&program[0]);
+    ExtmemMapper::emulate(&ps);
+    ExtmemMapper::emulate(&ps);
+  }
+  CHECK(ram.read_dword(0x10c) == 0xcafe'f00d);
+  CHECK(uint32_t(ps.R2) == 0xcafe'f00d);
+  CHECK(ExtmemMapper::stats().decode_misses - before.decode_misses == 2);
+  CHECK(ExtmemMapper::stats().decode_hits - before.decode_hits == 18);
+  CHECK(ExtmemMapper::stats().ops[DecodedOp::LOAD] - before.ops[DecodedOp::LOAD] == 10);
+
+  // decode path savings, one load faulting over and over
+  ps.PC = uintptr_t(&program[1]);
+  auto time_ns = [&](void (*emulate)(exception_pushstack*)) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 1'000'000; i++) {
+      emulate(&ps);
+      ps.PC -= 2;
+    }
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / 1'000'000;
+  };
+  double uncached = time_ns(ExtmemMapper::emulate_uncached);
+  double cached = time_ns(ExtmemMapper::emulate);
+  printf("decode cache: %.2fns per fault, %.2fns decoding every time\n", cached, uncached);
+  ExtmemMapper::s_emulate_budget = 16;
+}
+
+// Same cache behind both mappers: through IMemory, and bound to Cached_32_32
+// so the hit path inlines into the handlers.
+TEST(mapper_bound_to_cache_type) {
+  RamMemory ram{4096};
+  Cached_32_32 cache{&ram};
+  ExtmemMapper::init(&cache, 0x3000'0000);
+  ExtmemMapper_32_32::init(&cache, 0x3000'0000);
+  ExtmemMapper::s_emulate_budget = 1;
+  ExtmemMapper_32_32::s_emulate_budget = 1;
+  const uint16_t program[] = {
+    0b0110'0'00011'001'000, // str  r0, [r1, #12]
+    0b0110'1'00011'001'010, // ldr  r2, [r1, #12]
+    0b0101'110'011'001'011, // ldrb r3, [r1, r3]
+  };
+  exception_pushstack ps{};
+  ps.R0 = 0x1234'5678;
+  ps.R1 = 0x3000'0200;
+  ps.R3 = 13;
+  ps.PC = uintptr_t(&program[0]);
+  ExtmemMapper_32_32::emulate(&ps);
+  ExtmemMapper_32_32::emulate(&ps);
+  ExtmemMapper_32_32::emulate(&ps);
+  CHECK(uint32_t(ps.R2) == 0x1234'5678);
+  CHECK(uint32_t(ps.R3) == 0x56);
+  CHECK(ps.PC == uintptr_t(&program[3]));
+  CHECK(cache.read_dword(0x20c) == 0x1234'5678);
+
+  // one hitting load faulting over and over
+  auto time_ns = [&](void (*emulate)(exception_pushstack*)) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 1'000'000; i++) {
+      ps.PC = uintptr_t(&program[1]);
+      emulate(&ps);
+    }
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / 1'000'000;
+  };
+  double dynamic = time_ns(ExtmemMapper::emulate);
+  double bound = time_ns(ExtmemMapper_32_32::emulate);
+  CHECK(uint32_t(ps.R2) == 0x1234'5678);
+  printf("mapper: %.2fns per fault through IMemory, %.2fns bound to Cached_32_32\n", dynamic, bound);
+  ExtmemMapper::s_emulate_budget = 16;
+  ExtmemMapper_32_32::s_emulate_budget = 16;
+}
+
+TEST(mapper_dispatches_regions) {
+  RamMemory psram{4096}, fram{1024};
+  Cached_32_32 psram_cache{&psram};
+  ExtmemMapper::init(&psram, 0x3000'0000);
+  CHECK(ExtmemMapper::map(&fram, 0x3100'0000));
+  CHECK(ExtmemMapper::map(&psram_cache, 0x3200'0000));
+  CHECK(!ExtmemMapper::map(&fram, 0x3000'8000)); // window taken
+  CHECK(ExtmemMapper::lookup(0x3100'03ff)->memory == &fram);
+  CHECK(ExtmemMapper::lookup(0x3100'0400) == nullptr);
+  CHECK(ExtmemMapper::lookup(0x3300'0000) == nullptr);
+
+  ExtmemMapper::s_emulate_budget = 1;
+  const uint16_t program[] = {
+    0b0110'0'00001'001'000, // str  r0, [r1, #4]
+    0b0110'0'00001'010'000, // str  r0, [r2, #4]
+    0b0110'1'00001'011'100, // ldr  r4, [r3, #4]
+    0b0110'0'00001'101'000, // str  r0, [r5, #4]
+    0b0110'1'00001'101'110, // ldr  r6, [r5, #4]
+  };
+  exception_pushstack ps{};
+  ps.PC = uintptr_t(&program[0]);
+  ps.R0 = 0x600d'f00d;
+  ps.R1 = 0x3000'0100;
+  ps.R2 = 0x3100'0100;
+  ps.R3 = 0x3200'0100;  // the cached view of psram
+  ps.R5 = 0x3100'03fc;  // just past the end of fram
+  ps.R6 = 1;
+  ExtmemMapper::reset_stats();
+  for (int i = 0; i < 5; i++) ExtmemMapper::emulate(&ps);
+  CHECK(psram.read_dword(0x104) == 0x600d'f00d);
+  CHECK(fram.read_dword(0x104) == 0x600d'f00d);
+  CHECK(uint32_t(ps.R4) == 0x600d'f00d);
+  CHECK(uint32_t(ps.R6) == 0);
+  CHECK(ExtmemMapper::stats().unmapped == 2);
+  CHECK(ExtmemMapper::stats().faults == 5 && ExtmemMapper::stats().ops[DecodedOp::STORE] == 3);
+  CHECK(ps.PC == uintptr_t(&program[5]));
+
+  // back to a single region
+  ExtmemMapper::init(&psram, 0x3000'0000);
+  CHECK(ExtmemMapper::s_num_regions == 1 && ExtmemMapper::lookup(0x3100'0000) == nullptr);
+  ExtmemMapper::s_emulate_budget = 16;
+}
+
+TEST(tracer_records_mapper_accesses) {
+  RamMemory ram{4096};
+  ExtmemMapper::init(&ram, 0x3000'0000);
+  ExtmemMapper::s_emulate_budget = 1;
+  const uint16_t program[] = {
+    0b0110'0'00001'001'000, // str  r0, [r1, #4]
+    0b1000'1'00011'001'010, // ldrh r2, [r1, #6]
+    0b1100'1'001'00000101,  // ldm  r1!, {r0, r2}
+  };
+  exception_pushstack ps{};
+  ps.PC = uintptr_t(&program[0]);
+  ps.R1 = 0x3000'0100;
+  TraceRecord ring[2];
+  ExtmemTracer::start(ring, 2);
+  for (int i = 0; i < 3; i++) ExtmemMapper::emulate(&ps);
+  ExtmemTracer::stop();
+  ExtmemMapper::s_emulate_budget = 16;
+
+  // the ring kept the last two
+  TraceRecord out[4];
+  CHECK(ExtmemTracer::size() == 2 && ExtmemTracer::dropped() == 1);
+  CHECK(ExtmemTracer::read(out, 4) == 2);
+  CHECK(out[0].pc == uint32_t(uintptr_t(&program[1])) && out[0].addr == 0x3000'0106 && out[0].size == 2 && !out[0].write);
+  CHECK(out[1].addr == 0x3000'0100 && out[1].size == 8);
+
+  TraceRecord parsed;
+  CHECK(ExtmemTracer::parse("T 10000200 30000104 4 W\n", parsed));
+  CHECK(parsed.pc == 0x1000'0200 && parsed.addr == 0x3000'0104 && parsed.size == 4 && parsed.write);
+  CHECK(!ExtmemTracer::parse("Hardfault handled\n", parsed));
+}
+
+TEST(trace_replay_sizes_caches) {
+  // two sequential passes over 2KB: fits in Cached_32_32 (1KB) only once
+  std::vector<TraceRecord> trace;
+  for (int pass = 0; pass < 2; pass++) {
+    for (uint32_t addr = 0; addr < 2048; addr += 4) trace.push_back({0, 0x3000'0000 + addr, 4, 0, 0});
+  }
+  trace.push_back({0, 0x2000'0000, 4, 0, 0});
+  ReplayResult small = trace_replay<Cached_32_32>(trace, 0x3000'0000);
+  ReplayResult large = trace_replay<Cached_64_64>(trace, 0x3000'0000);
+  CHECK(small.accesses == 1024 && small.skipped == 1);
+  CHECK(small.cache.misses == 2*2048/32);
+  CHECK(large.cache.misses == 2048/64);
+  CHECK(small.bus_bytes == 2*2048 && large.bus_bytes == 2048);
+  CHECK(large.bus_ns < small.bus_ns);
+  CHECK(small.pages.size() == 2 && small.pages[1].accesses == 512 && small.pages[1].misses == 64);
+}
+
+TEST(mapper_moves_ldm_stm_blocks) {
+  RamMemory ram{4096};
+  LatencyMemory bus{&ram, {0, 0}};
+  ExtmemMapper::init(&bus, 0x3000'0000);
+  for (uint32_t i = 0; i < 8; i++) ram.write_dword(0x100 + i*4, i + 1);
+
+  // memcpy's inner loop: each ldm/stm is one block transfer
+  const uint16_t copy[] = {
+    0b1100'1'001'01111000,   // loop: ldm r1!, {r3-r6}
+    0b1100'0'010'01111000,   // stm r2!, {r3-r6}
+    0b00111'000'00000001,    // subs r0, #1
+    0b1101'0001'11111011,    // bne loop
+    0x4770,                  // bx lr
+  };
+  exception_pushstack ps{};
+  ps.R0 = 2;
+  ps.R1 = 0x3000'0100;
+  ps.R2 = 0x3000'0200;
+  ps.PC = uintptr_t(&copy[0]);
+  bus.reset_counters();
+  ExtmemMapper::emulate(&ps);
+  CHECK(ps.PC == uintptr_t(&copy[4]));
+  CHECK(bus.transactions() == 4);
+  CHECK(uint32_t(ps.R1) == 0x3000'0120 && uint32_t(ps.R2) == 0x3000'0220);
+  for (uint32_t i = 0; i < 8; i++) CHECK(ram.read_dword(0x200 + i*4) == i + 1);
+
+  // no writeback when the base is loaded
+  const uint16_t load_base[] = {
+    0b1100'1'001'00000011,   // ldm r1, {r0, r1}
+    0x4770,
+  };
+  ps.R1 = 0x3000'0100;
+  ps.PC = uintptr_t(&load_base[0]);
+  ExtmemMapper::emulate(&ps);
+  CHECK(uint32_t(ps.R0) == 1 && uint32_t(ps.R1) == 2);
+}
+
+// Reference register states for short Thumb programs run from a single fault.
+struct ThumbTrace {
+  const char *name;
+  std::vector<uint16_t> program;
+  unsigned budget;
+  std::array<uint32_t, 8> regs_in;
+  std::array<uint32_t, 8> regs_out;
+  uint32_t flags_out; // NZCV
+  unsigned end;       // index the PC stops at
+};
+
+static const uint16_t BX_LR = 0x4770;
+static const uint32_t N = 1u<<31, Z = 1u<<30, C = 1u<<29, V = 1u<<28;
+
+static const ThumbTrace s_thumb_traces[] = {
+  {"sum loop", {
+      0b0110'1'00000'001'011,  // loop: ldr r3, [r1, #0]
+      0b0001100'011'000'000,   // adds r0, r0, r3
+      0b00110'001'00000100,    // adds r1, #4
+      0b00111'010'00000001,    // subs r2, #1
+      0b1101'0001'11111010,    // bne loop
+      BX_LR,
+    }, 64,
+    {0, 0x3000'0100, 4, 0, 0, 0, 0, 0},
+    {10, 0x3000'0110, 0, 4, 0, 0, 0, 0}, Z|C, 5},
+  {"sum loop budget", {
+      0b0110'1'00000'001'011,
+      0b0001100'011'000'000,
+      0b00110'001'00000100,
+      0b00111'010'00000001,
+      0b1101'0001'11111010,
+      BX_LR,
+    }, 3,
+    {0, 0x3000'0100, 4, 0, 0, 0, 0, 0},
+    {1, 0x3000'0104, 4, 1, 0, 0, 0, 0}, 0, 3},
+  {"alu flags", {
+      0b00100'000'10000000,    // movs r0, #0x80
+      0b00000'11000'000'001,   // lsls r1, r0, #24
+      0b00010'00100'001'010,   // asrs r2, r1, #4
+      0b00001'11111'001'011,   // lsrs r3, r1, #31
+      0b0001111'010'011'100,   // subs r4, r3, #2
+      0b0001100'011'100'101,   // adds r5, r4, r3
+      0b010000'1111'101'110,   // mvns r6, r5
+      0b010000'0000'011'110,   // ands r6, r3
+      0b010000'0001'011'110,   // eors r6, r3
+      0b010000'1100'001'110,   // orrs r6, r1
+      0b010000'1001'011'111,   // negs r7, r3
+      0b010000'1101'011'111,   // muls r7, r3, r7
+      0b00101'011'00000001,    // cmp r3, #1
+      0b1101'0000'00000000,    // beq skip
+      0b00100'000'00000001,    // movs r0, #1
+      0b010000'0101'011'000,   // skip: adcs r0, r3
+      0b00100'100'01000000,    // movs r4, #0x40
+      0b00000'11000'100'100,   // lsls r4, r4, #24
+      0b0001100'100'100'100,   // adds r4, r4, r4
+      BX_LR,
+    }, 64,
+    {0, 0, 0, 0, 0, 0, 0, 0},
+    {0x82, 0x8000'0000, 0xf800'0000, 1, 0x8000'0000, 0, 0x8000'0000, 0xffff'ffff}, N|V, 19},
+  {"register shifts", {
+      0b00100'000'00000001,    // movs r0, #1
+      0b00100'001'00100001,    // movs r1, #33
+      0b00100'010'00000001,    // movs r2, #1
+      0b010000'0010'001'010,   // lsls r2, r1
+      0b00100'011'00000011,    // movs r3, #3
+      0b010000'0111'000'011,   // rors r3, r0
+      0b010000'0110'000'011,   // sbcs r3, r0
+      0b010000'1110'000'011,   // bics r3, r0
+      0b010000'1000'000'011,   // tst r3, r0
+      0b010000'1011'011'000,   // cmn r0, r3
+      0b00100'101'10000000,    // movs r5, #0x80
+      0b00000'11000'101'101,   // lsls r5, r5, #24
+      0b010000'0100'001'101,   // asrs r5, r1
+      BX_LR,
+    }, 64,
+    {0, 0, 0, 0, 0, 0, 0, 0},
+    {1, 33, 0, 0x8000'0000, 0, 0xffff'ffff, 0, 0}, N|C, 13},
+  {"conditions", {
+      0b00100'000'00000101,    // movs r0, #5
+      0b00101'000'00000111,    // cmp r0, #7
+      0b1101'1010'00000101,    // bge fail
+      0b1101'1000'00000100,    // bhi fail
+      0b1101'1011'00000000,    // blt 1f
+      0b00100'001'00000001,    // movs r1, #1
+      0b1101'0011'00000000,    // 1: bcc 2f
+      0b00100'001'00000010,    // movs r1, #2
+      0b11100'00000000000,     // 2: b 3f
+      0b00100'001'00000011,    // fail: movs r1, #3
+      0b00100'010'00001001,    // 3: movs r2, #9
+      BX_LR,
+    }, 64,
+    {0, 0, 0, 0, 0, 0, 0, 0},
+    {5, 0, 9, 0, 0, 0, 0, 0}, 0, 11},
+  {"stops at unmapped access", {
+      0b0110'1'00000'001'000,  // ldr r0, [r1, #0]
+      0b0110'1'00000'011'010,  // ldr r2, [r3, #0]
+      BX_LR,
+    }, 64,
+    {0, 0x3000'0100, 0, 0x2000'0000, 0, 0, 0, 0},
+    {1, 0x3000'0100, 0, 0x2000'0000, 0, 0, 0, 0}, 0, 1},
+};
+
+TEST(thumb_interpreter_matches_traces) {
+  RamMemory ram{4096};
+  ExtmemMapper::init(&ram, 0x3000'0000);
+  for (uint32_t i = 0; i < 4; i++) ram.write_dword(0x100 + i*4, i + 1);
+
+  for (auto &trace : s_thumb_traces) {
+    exception_pushstack ps{};
+    void *frame = &ps;
+    auto regs = (uintptr_t*)frame;
+    for (uint8_t r = 0; r < 8; r++) regs[thumb_reg_slot(r)] = trace.regs_in[r];
+    ps.PC = uintptr_t(trace.program.data());
+    ExtmemMapper::s_emulate_budget = trace.budget;
+    ExtmemMapper::emulate(&ps);
+
+    bool ok = ps.PC == uintptr_t(&trace.program[trace.end]) && uint32_t(ps.XPSR) == trace.flags_out;
+    for (uint8_t r = 0; r < 8; r++) ok = ok && uint32_t(regs[thumb_reg_slot(r)]) == trace.regs_out[r];
+    if (!ok) printf("trace \"%s\" diverged\n", trace.name);
+    CHECK(ok);
+  }
+  ExtmemMapper::s_emulate_budget = 16;
+}
+
+TEST(cached_memory_writes_back_dirty_sectors) {
+  RamMemory ram{1<<16};
+  LatencyMemory bus{&ram};
+  Cached_8_1024 cache{&bus};
+  cache.write_byte(3, 0x11);
+  cache.write_dword(100, 0x22);
+  cache.write_dword(104, 0x33);
+  cache.write_word(1022, 0x44);
+  // 4 ways per set: filling set 0 then missing once more evicts line 0
+  for (uint32_t i = 1; i <= 3; i++) cache.read_byte(i*2048);
+  bus.reset_counters();
+  cache.read_byte(4*2048);
+
+  // sectors are 32 bytes for 1KiB lines: 0, 3 and 31 are dirty
+  CHECK(bus.transactions() == 1 + 3);
+  CHECK(bus.bytes() == 1024 + 3*32);
+  CHECK(ram.read_byte(3) == 0x11);
+  CHECK(ram.read_dword(100) == 0x22);
+  CHECK(ram.read_dword(104) == 0x33);
+  CHECK(ram.read_word(1022) == 0x44);
+}
+
+TEST(cached_memory_write_allocates_without_fetch) {
+  RamMemory ram{1<<16};
+  LatencyMemory bus{&ram};
+
+  // word sectors: a dword stream never reads, only writes back evictions
+  Cached_32_32 small{&bus};
+  for (uint32_t i = 0; i < 1024; i++) small.write_dword(i*4, i);
+  CHECK(bus.transactions() == 1024*4/32 - 32);
+  CHECK(bus.bytes() == (1024*4/32 - 32)*32);
+
+  // a full line write allocates without a fetch
+  bus.reset_counters();
+  Cached_8_1024 large{&bus};
+  uint8_t line[1024] = {};
+  large.write_data(4096, sizeof(line), line);
+  CHECK(bus.transactions() == 0);
+
+  // a partial sector write fetches just that sector
+  large.write_byte(8192+5, 1);
+  CHECK(bus.transactions() == 1);
+  CHECK(bus.bytes() == 32);
+  CHECK(large.read_dword(4096) == 0);
+  CHECK(large.read_byte(8192+5) == 1);
+}
+
+TEST(cached_memory_spans_lines_and_streams) {
+  RamMemory ram{1<<16}, reference{1<<16};
+  LatencyMemory bus{&ram};
+  Cached_32_32 cache{&bus};
+  static uint8_t buf[2048], ref[2048];
+  uint32_t rng = 7;
+  for (int i = 0; i < 5'000; i++) {
+    uint32_t addr = (lcg(rng) >> 8) % ((1<<16) - sizeof(buf));
+    uint32_t nbytes = 1 + (lcg(rng) >> 8) % (lcg(rng) & 0x1000 ? sizeof(buf) : 96);
+    switch ((lcg(rng) >> 12) % 3) {
+    case 0:
+      for (uint32_t j = 0; j < nbytes; j++) buf[j] = lcg(rng);
+      cache.write_data(addr, nbytes, buf);
+      reference.write_data(addr, nbytes, buf);
+      break;
+    case 1:
+      cache.write_dword(addr & ~3u, i);
+      reference.write_dword(addr & ~3u, i);
+      break;
+    case 2:
+      cache.read_data(addr, nbytes, buf);
+      reference.read_data(addr, nbytes, ref);
+      CHECK(memcmp(buf, ref, nbytes) == 0);
+      break;
+    }
+  }
+
+  // large transfers are one burst and leave the cache alone
+  cache.read_dword(0);
+  cache.stats() = {};
+  bus.reset_counters();
+  cache.read_data(4096, 1024, buf);
+  cache.write_data(8192, 1024, buf);
+  CHECK(bus.transactions() == 2);
+  CHECK(cache.stats().misses == 0);
+  cache.read_dword(0);
+  CHECK(cache.stats().hits == 1);
+}
+
+TEST(stride_prefetcher_predicts_streams) {
+  StridePrefetcher<> pf;
+  pf.configure(2, 1);
+  std::vector<intptr_t> predicted;
+  auto collect = [&](intptr_t line) { predicted.push_back(line); };
+  pf.access(10, collect);
+  pf.access(13, collect);
+  CHECK(predicted.empty());
+  pf.access(16, collect);
+  CHECK((predicted == std::vector<intptr_t>{19, 22}));
+  // an unrelated access far away starts a new stream instead
+  predicted.clear();
+  pf.access(1000, collect);
+  CHECK(predicted.empty());
+  pf.access(19, collect);
+  CHECK((predicted == std::vector<intptr_t>{22, 25}));
+}
+
+TEST(cached_memory_prefetches_streams) {
+  RamMemory ram{1<<17};
+  for (uint32_t i = 0; i < (1<<17)/4; i++) ram.write_dword(i*4, i);
+
+  Cached_32_32 cache{&ram};
+  cache.set_prefetch(4, 1);
+  bool ok = true;
+  for (uint32_t i = 0; i < 4096; i++) ok &= cache.read_dword(i*4) == i;
+  for (uint32_t i = 0; i < 1024; i++) ok &= cache.read_dword(32768 + i*64) == 8192 + i*16;
+  CHECK(ok);
+  auto stats = cache.stats();
+  // streams of 512 and 1024 lines only miss while the stride is learned
+  CHECK(stats.misses < 10);
+  CHECK(stats.prefetch_useful > 1500);
+  CHECK(stats.prefetch_wasted <= 2*4);
+
+  Cached_32_32 plain{&ram};
+  for (uint32_t i = 0; i < 4096; i++) plain.read_dword(i*4);
+  CHECK(plain.stats().misses == 512);
+  CHECK(plain.stats().prefetches == 0);
+}
+
+TEST(memory_transactions_complete) {
+  RamMemory ram{4096};
+  ram.write_dword(16, 0xfeed'f00d);
+  uint32_t value = 0;
+  int completions = 0;
+  MemTransaction t;
+  t.op = MemTransaction::READ;
+  t.addr = 16;
+  t.nbytes = 4;
+  t.data = (uint8_t*)&value;
+  t.on_complete = [](MemTransaction *, void *ctx) { (*(int*)ctx)++; };
+  t.ctx = &completions;
+  ram.submit(&t);
+  CHECK(t.status == MemTransaction::DONE);
+  CHECK(completions == 1);
+  CHECK(value == 0xfeed'f00d);
+}
+
+TEST(threaded_memory_completes_in_order) {
+  RamMemory ram{4096};
+  LatencyMemory slow{&ram, {10'000'000, 0}, true};
+  ThreadedMemory mem{&slow};
+  std::atomic<int> completions{0};
+  uint32_t one = 1, two = 2, seen = 0;
+  MemTransaction t[3];
+  for (auto &e : t) {
+    e.addr = 64;
+    e.nbytes = 4;
+    e.on_complete = [](MemTransaction *, void *ctx) { (*(std::atomic<int>*)ctx)++; };
+    e.ctx = &completions;
+  }
+  t[0].op = MemTransaction::WRITE; t[0].data = (uint8_t*)&one;
+  t[1].op = MemTransaction::READ;  t[1].data = (uint8_t*)&seen;
+  t[2].op = MemTransaction::WRITE; t[2].data = (uint8_t*)&two;
+  for (auto &e : t) mem.submit(&e);
+  // the caller carries on while transfers are in flight
+  CHECK(mem.poll());
+  CHECK(mem.read_dword(64) == 2);
+  CHECK(completions == 3);
+  CHECK(seen == 1);
+  CHECK(!mem.poll());
+}
+
+TEST(cached_memory_over_async_memory) {
+  RamMemory ram{1<<16}, reference{1<<16};
+  ThreadedMemory mem{&ram};
+  uint32_t rng = 3;
+  {
+    Cached_32_32 cache{&mem};
+    cache.set_prefetch(2);
+    for (int i = 0; i < 20'000; i++) {
+      uint32_t addr = (lcg(rng) >> 8) % ((1<<16) - 4) & ~3u;
+      // mostly short sequential runs, so prefetches and write-backs overlap
+      if (lcg(rng) & 0x400) addr = (i*4) % (1<<16);
+      if (lcg(rng) & 0x100) {
+        cache.write_dword(addr, i);
+        reference.write_dword(addr, i);
+      } else {
+        CHECK(cache.read_dword(addr) == reference.read_dword(addr));
+      }
+    }
+    CHECK(cache.stats().prefetches > 0);
+    for (uint32_t addr = 0; addr < (1<<16); addr += 4) {
+      CHECK(cache.read_dword(addr) == reference.read_dword(addr));
+    }
+  }
+}
+
+TEST(cached_memory_prefetches_without_blocking) {
+  RamMemory ram{1<<16};
+  LatencyMemory slow{&ram, {50'000'000, 0}, true};
+  ThreadedMemory mem{&slow};
+  Cached_32_32 cache{&mem};
+  cache.set_prefetch(1, 4);
+  for (uint32_t i = 0; i < 3; i++) cache.read_dword(i*32);
+  // the third line confirmed the stream: a fill for line 6 is in flight
+  CHECK(cache.stats().prefetches == 1);
+  CHECK(mem.poll());
+  cache.read_dword(6*32);
+  CHECK(cache.stats().prefetch_useful == 1);
+}
+
+TEST(cached_memory_abandoned_prefetch_keeps_policy) {
+  RamMemory ram{1<<16};
+  Cached_32_32_RR cache{&ram};
+  cache.set_prefetch(1);
+  constexpr uint32_t stride = Cached_32_32_RR::s_num_sets*32;
+  // set 3 full of dirty lines, round robin back at way 0
+  for (uint32_t k = 1; k <= 4; k++) cache.write_dword(3*32 + k*stride, k);
+  // a read stream over lines 0-2 wants line 3, whose victim is dirty
+  for (uint32_t line = 0; line < 3; line++) cache.read_dword(line*32);
+  CHECK(cache.stats().prefetches == 0);
+  // so a demand miss in set 3 still replaces way 0, the first line written
+  cache.read_dword(3*32 + 5*stride);
+  uint32_t misses = cache.stats().misses;
+  cache.read_dword(3*32 + 2*stride);
+  CHECK(cache.stats().misses == misses);
+  cache.read_dword(3*32 + stride);
+  CHECK(cache.stats().misses == misses + 1);
+}
+
+// read_write_incremental_4: one hot address mixed with a write stream
+template<class Cache>
+static uint32_t hot_plus_stream_misses() {
+  RamMemory ram{1<<16};
+  Cache cache{&ram};
+  for (uint32_t i = 0; i < 8192; i++) {
+    cache.read_dword(0);
+    cache.write_dword(64 + i*4, i);
+  }
+  return cache.stats().misses;
+}
+
+TEST(replacement_keeps_hot_line) {
+  // 1 miss for the hot line plus one per streamed line
+  uint32_t stream_misses = 1 + 8192*4/32;
+  CHECK(hot_plus_stream_misses<Cached_32_32_LRU>() == stream_misses);
+  CHECK(hot_plus_stream_misses<Cached_32_32_PLRU>() == stream_misses);
+  CHECK(hot_plus_stream_misses<Cached_32_32_CLOCK>() < hot_plus_stream_misses<Cached_32_32_RR>());
+  CHECK(hot_plus_stream_misses<Cached_32_32_RR>() > stream_misses);
+}
+
+TEST(replacement_policy_victims) {
+  LruPolicy::Set<4> lru;
+  for (unsigned w : {0, 1, 2, 3, 0, 2}) lru.touch(w);
+  CHECK(lru.victim() == 1);
+
+  TreePlruPolicy::Set<4> plru;
+  for (unsigned w : {0, 1, 2, 3}) plru.touch(w);
+  CHECK(plru.victim() == 0);
+  plru.touch(0);
+  CHECK(plru.victim() == 2);
+
+  ClockPolicy::Set<4> clock;
+  for (unsigned w : {0, 1, 3}) clock.touch(w);
+  CHECK(clock.victim() == 2);
+  CHECK(clock.victim() == 0);
+}
+
+static void spiram_matches_reference(bool quad) {
+  PsramModel psram;
+  RamMemory reference{PsramModel::s_size};
+  SpiRam mem{psram, quad};
+  CHECK(mem.quad() == quad && psram.qpi() == quad);
+  uint32_t rng = 7;
+  uint8_t buf[3000], ref[3000];
+  for (int i = 0; i < 5'000; i++) {
+    // keep near a few page boundaries
+    uint32_t addr = (lcg(rng) >> 8) % 8 * SpiRam::s_page_size + (lcg(rng) >> 8) % 2048;
+    uint32_t value = lcg(rng);
+    uint32_t nbytes = (lcg(rng) >> 8) % sizeof(buf);
+    switch ((lcg(rng) >> 8) % 8) {
+      case 0: mem.write_byte(addr, value); reference.write_byte(addr, value); break;
+      case 1: mem.write_word(addr, value); reference.write_word(addr, value); break;
+      case 2: mem.write_dword(addr, value); reference.write_dword(addr, value); break;
+      case 3:
+        for (uint32_t j = 0; j < nbytes; j++) buf[j] = lcg(rng) >> 24;
+        mem.write_data(addr, nbytes, buf);
+        reference.write_data(addr, nbytes, buf);
+        break;
+      case 4: CHECK(mem.read_byte(addr) == reference.read_byte(addr)); break;
+      case 5: CHECK(mem.read_word(addr) == reference.read_word(addr)); break;
+      case 6: CHECK(mem.read_dword(addr) == reference.read_dword(addr)); break;
+      case 7:
+        mem.read_data(addr, nbytes, buf);
+        reference.read_data(addr, nbytes, ref);
+        CHECK(memcmp(buf, ref, nbytes) == 0);
+        break;
+    }
+  }
+  mem.flush();
+  CHECK(memcmp(psram.data(), reference.data(), PsramModel::s_size) == 0);
+  CHECK(psram.stats().errors == 0);
+  CHECK(psram.stats().page_crossings == 0);
+}
+
+TEST(spiram_matches_reference) {
+  spiram_matches_reference(false);
+  spiram_matches_reference(true);
+}
+
+TEST(spiram_resets_device_left_in_qpi) {
+  // a soft reboot leaves the device powered and in QPI mode
+  PsramModel psram;
+  { SpiRam qpi{psram, true}; }
+  CHECK(psram.qpi());
+  psram.data()[100] = 0x5a;
+  psram.reset_stats();
+  SpiRam spi{psram};
+  CHECK(!psram.qpi() && psram.stats().errors == 0);
+  CHECK(spi.read_byte(100) == 0x5a && psram.stats().errors == 0);
+
+  // and again into QPI
+  SpiRam qpi{psram, true};
+  CHECK(psram.qpi() && qpi.read_byte(100) == 0x5a && psram.stats().errors == 0);
+}
+
+TEST(spiram_quad_line_fill) {
+  // one 32 byte line fill: command, address and data in SPI mode, split in
+  // two to keep CS low within tCEM; quad adds 6 wait cycles but moves
+  // everything 4 bits a clock
+  PsramModel spi_psram, qpi_psram;
+  SpiRam spi{spi_psram}, qpi{qpi_psram, true};
+  uint8_t line[32];
+  spi_psram.reset_stats();
+  qpi_psram.reset_stats();
+  spi.read_data(0, sizeof(line), line);
+  qpi.read_data(0, sizeof(line), line);
+  CHECK(spi_psram.stats().clocks == (2*4 + 32)*8 && spi_psram.stats().selects == 2);
+  CHECK(spi_psram.stats().errors == 0);
+  CHECK(qpi_psram.stats().clocks == (4 + 32)*2 + 6);
+  CHECK(qpi_psram.stats().errors == 0);
+  qpi.write_data(0, sizeof(line), line);
+  CHECK(qpi_psram.stats().errors == 0);
+}
+
+TEST(spiram_combines_small_writes) {
+  PsramModel psram;
+  SpiRam mem{psram};
+  psram.reset_stats();
+  for (uint32_t i = 0; i < 64; i++) mem.write_dword(i*4, i);
+  mem.flush();
+  // a run stops short of a burst's limit, not just the buffer's
+  uint32_t per_run = std::min(SpiRam::s_write_buffer_size, SpiRam::max_burst(false))/4;
+  CHECK(psram.stats().commands == (64 + per_run - 1)/per_run);
+  CHECK(psram.stats().data_bytes == 64*4);
+  CHECK(mem.read_dword(63*4) == 63);
+
+  // a run crossing a page boundary is split rather than wrapped
+  psram.reset_stats();
+  for (uint32_t i = 0; i < 4; i++) mem.write_dword(SpiRam::s_page_size - 8 + i*4, i);
+  mem.flush();
+  CHECK(psram.stats().commands == 2);
+  CHECK(psram.stats().page_crossings == 0);
+  CHECK(mem.read_dword(SpiRam::s_page_size) == 2);
+}
+
+TEST(spiram_merges_queued_transactions) {
+  PsramModel psram;
+  SpiRam mem{psram};
+  for (uint32_t i = 0; i < 4096; i++) psram.data()[i] = i*13;
+
+  // contiguous reads within a page share commands and chip selects, as many
+  // bytes a select as fit in tCEM
+  uint8_t buf[4][64];
+  MemTransaction t[4];
+  psram.reset_stats();
+  for (unsigned i = 0; i < 4; i++) {
+    t[i].op = MemTransaction::READ;
+    t[i].addr = 128 + i*64;
+    t[i].nbytes = 64;
+    t[i].data = buf[i];
+    t[i].on_complete = nullptr;
+    mem.submit(&t[i]);
+  }
+  mem.wait(&t[3]);
+  constexpr uint32_t burst = SpiRam::max_burst(false);
+  CHECK(psram.stats().selects == (4*64 + burst - 1)/burst);
+  CHECK(psram.stats().commands == psram.stats().selects);
+  CHECK(psram.stats().errors == 0);
+  for (unsigned i = 0; i < 4*64; i++) CHECK(buf[i/64][i%64] == uint8_t((128 + i)*13));
+
+  // a transaction spanning a page is split, the next page starts a new
+  // burst rather than continuing one
+  uint8_t span[512];
+  MemTransaction s;
+  s.op = MemTransaction::WRITE;
+  s.addr = SpiRam::s_page_size*2 - 256;
+  s.nbytes = sizeof(span);
+  s.data = span;
+  s.on_complete = nullptr;
+  memset(span, 0x5a, sizeof(span));
+  psram.reset_stats();
+  mem.submit(&s);
+  mem.wait(&s);
+  CHECK(psram.stats().commands == 2*((256 + burst - 1)/burst));
+  CHECK(psram.stats().page_crossings == 0);
+  CHECK(psram.stats().errors == 0);
+  CHECK(mem.read_byte(SpiRam::s_page_size*2 + 255) == 0x5a);
+
+  // the model catches a frame held past tCEM
+  uint8_t frame[4 + 64] = {0x02};
+  psram.reset_stats();
+  psram.select();
+  psram.write(frame, sizeof(frame));
+  psram.deselect();
+  CHECK(psram.stats().long_selects == 1 && psram.stats().errors == 1);
+}
+
+void run_tests() {
+  for (TestFunc *tf = TestFunc::all(); tf; tf = tf->next()) {
+    int failures = TestFunc::s_failures;
+    (*tf->func())();
+    printf("%-40s %s\n", tf->desc(), failures == TestFunc::s_failures ? "ok" : "FAILED");
+  }
+}
+
+void run_benchmarks(BenchConfig const &config) {
+  bench_begin(config);
+  for (auto [mem, desc, stats] : s_test_memories) {
+    ExtmemMapper::init(mem, 0x3000'0000);
+    ExtmemMapper::reset_stats();
+    if (stats) *stats = {};
+    bench_memory(*mem, desc, stats, config);
+    // the next memory may share the device
+    mem->flush();
+#if PICO_EXTMEM_STATS
+    if (config.format != BENCH_TEXT) continue;
+    if (stats) print_cache_stats(desc, *stats);
+    if (ExtmemMapper::stats().faults) print_mapper_stats(desc, ExtmemMapper::stats());
+#endif
+  }
+}
+
+// --csv or --json for machine readable benchmark results
+int main(int argc, char **argv){
+  BenchConfig config = s_default_bench_config;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--csv")) config.format = BENCH_CSV;
+    else if (!strcmp(argv[i], "--json")) config.format = BENCH_JSON;
+    else {
+      fprintf(stderr, "usage: %s [--csv | --json]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  RamMemory ram;
+  LatencyMemory extmem{&ram, LatencyMemory::s_spiram_cost, true};
+  Cached_32_32 cache1{&extmem};
+  Cached_64_32 cache2{&extmem};
+  Cached_64_64 cache3{&extmem};
+  Cached_32_32_RR rr{&extmem};
+  Cached_32_32_LRU lru{&extmem};
+  Cached_32_32_CLOCK clock{&extmem};
+  Cached_32_32_RANDOM random{&extmem};
+  Cached_32_32 prefetch{&extmem};
+  prefetch.set_prefetch(2);
+  ZeroElidingMemory zero_extmem{&extmem};
+  Cached_32_32 zero_cache{&zero_extmem};
+  Cached_32_32 l0_l1{&extmem}, vb_l1{&extmem};
+  L0_8_Cached_32_32 l0{&l0_l1};
+  VB_8_Cached_32_32 vb{&vb_l1};
+  PsramModel psram, qpi_psram;
+  SpiRam spiram{psram}, qpi_spiram{qpi_psram, true};
+  Cached_32_32 spiram_cache{&spiram}, qpi_cache{&qpi_spiram};
+
+  s_test_memories.push_back({&extmem, "LatencyMemory", nullptr});
+  s_test_memories.push_back({&cache1, "Cached_32_32", &cache1.stats()});
+  s_test_memories.push_back({&cache2, "Cached_64_32", &cache2.stats()});
+  s_test_memories.push_back({&cache3, "Cached_64_64", &cache3.stats()});
+  s_test_memories.push_back({&rr, "Cached_32_32_RR", &rr.stats()});
+  s_test_memories.push_back({&lru, "Cached_32_32_LRU", &lru.stats()});
+  s_test_memories.push_back({&clock, "Cached_32_32_CLOCK", &clock.stats()});
+  s_test_memories.push_back({&random, "Cached_32_32_RANDOM", &random.stats()});
+  s_test_memories.push_back({&prefetch, "Cached_32_32_PF", &prefetch.stats()});
+  s_test_memories.push_back({&zero_cache, "Cached_32_32(zero)", &zero_cache.stats()});
+  // no single hit rate: L0 and L1 counters are printed after the run
+  s_test_memories.push_back({&l0, "L0_8_Cached_32_32", nullptr});
+  s_test_memories.push_back({&vb, "VB_8_Cached_32_32", nullptr});
+  s_test_memories.push_back({&spiram, "SpiRam(PsramModel)", nullptr});
+  s_test_memories.push_back({&spiram_cache, "Cached_32_32(PsramModel)", &spiram_cache.stats()});
+  s_test_memories.push_back({&qpi_cache, "Cached_32_32(QPI)", &qpi_cache.stats()});
+
+  if (config.format == BENCH_TEXT) run_tests();
+
+  run_benchmarks(config);
+
+  if (config.format != BENCH_TEXT) return TestFunc::s_failures ? 1 : 0;
+  printf("\n");
+#if PICO_EXTMEM_STATS
+  print_hierarchy_stats("L0_8_Cached_32_32", l0.stats());
+  print_cache_stats("L0_8_Cached_32_32 L1", l0_l1.stats());
+  print_hierarchy_stats("VB_8_Cached_32_32", vb.stats());
+  print_cache_stats("VB_8_Cached_32_32 L1", vb_l1.stats());
+#endif
+  for (auto [model, desc] : {std::pair{&psram, "SPI"}, std::pair{&qpi_psram, "QPI"}}) {
+    auto &bus = model->stats();
+    printf("PSRAM bus (%s): %u selects, %u commands, %u command bytes, %u data bytes, %llu clocks, %u page crossings, %u over tCEM, %u errors\n",
+           desc, bus.selects, bus.commands, bus.command_bytes, bus.data_bytes, (unsigned long long)bus.clocks, bus.page_crossings, bus.long_selects, bus.errors);
+  }
+
+  printf("Testing and Profiling complete!\n");
+  return TestFunc::s_failures ? 1 : 0;
+}
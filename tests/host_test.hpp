@@ -0,0 +1,30 @@
+#include <cstdio>
+
+typedef void(*tester)();
+class TestFunc{
+public:
+  TestFunc(tester t, const char *desc)
+  {
+    m_next = s_all;
+    m_fn = t;
+    m_desc = desc;
+    s_all = this;
+  }
+  static TestFunc *all() { return s_all; }
+  TestFunc *next() const { return m_next; }
+  tester func() const { return m_fn; }
+  const char *desc() const { return m_desc; }
+  static int s_failures;
+private:
+  const char *m_desc;
+  tester m_fn;
+  TestFunc *m_next;
+  static TestFunc *s_all;
+};
+
+#define TEST(name) \
+static void name();\
+static TestFunc tf_##name{&name, #name};\
+static void name()
+
+#define CHECK(cond) if(!(cond)){printf("Check failed: %s\n%s:%d\n", #cond, __FILE__, __LINE__); TestFunc::s_failures++; return;}
@@ -9,11 +9,12 @@
 
 #include "spiram.hpp"
 #include "cached_memory.hpp"
+#include "zero_eliding_memory.hpp"
+#include "cache_hierarchy.hpp"
 #include "extmem_mapper.hpp"
-#include "profile.hpp"
+#include "bench.hpp"
 
-static std::list<std::tuple<IMemory*, const char*>> s_test_memories;
-std::array<uint32_t, 4> g_num_iters = {500, 1'000, 5'000, 10'000};
+static std::list<std::tuple<IMemory*, const char*, CacheStats*>> s_test_memories;
 
 void test_register_imemory(IMemory *mem) {
 
@@ -23,30 +24,34 @@ void run_tests() {
 
 }
 
-void run_profiles() {
-  int w = 40, wint=11;
-  printf("Num Iterations %*s ", w+9, "");
-  for (unsigned i = 0; i < g_num_iters.size(); i++){
-    if (i) printf(" :");
-    printf("% *d", wint, g_num_iters[i]);
-  }
-  printf("\n");
-  for (auto [mem, desc] : s_test_memories) {
-    profile_init(*mem);
-    printf("\n");
-    for (ProfileFunc *pf = ProfileFunc::all(); pf; pf = pf->next()) {
-      printf("CPS (%16s:%*.*s): ", desc, w,w, pf->desc());
-      for (unsigned i = 0; i < g_num_iters.size(); i++){
-        if (i) printf(" :");
-        uint32_t cps = profile_cps(pf->func(), g_num_iters[i]);
-        printf("% *d", wint, cps);
-      }
-      printf("\n");
-    }
+void run_benchmarks(BenchConfig const &config) {
+  bench_begin(config);
+  for (auto [mem, desc, stats] : s_test_memories) {
+    ExtmemMapper::init(mem, 0x3000'0000);
+    ExtmemMapper::reset_stats();
+    if (stats) *stats = {};
+    bench_memory(*mem, desc, stats, config);
+    bench_mapped(0x3000'0000, desc, stats, config);
+    // the next memory may share the device
+    mem->flush();
+#if PICO_EXTMEM_STATS
+    if (config.format != BENCH_TEXT) continue;
+    if (stats) print_cache_stats(desc, *stats);
+    if (ExtmemMapper::stats().faults) print_mapper_stats(desc, ExtmemMapper::stats());
+#endif
   }
 }
 
 
+// Faulting accesses with the mapper going through IMemory and bound to
+// Cached_32_32, same cache underneath.
+void run_mapper_comparison(Cached_32_32 &cache, BenchConfig const &config) {
+  ExtmemMapper::init(&cache, 0x3000'0000);
+  bench_mapped(0x3000'0000, "ExtmemMapper", &cache.stats(), config);
+  ExtmemMapper_32_32::init(&cache, 0x3000'0000);
+  bench_mapped(0x3000'0000, "ExtmemMapper_32_32", &cache.stats(), config);
+}
+
 int main(){
   stdio_init_all();
   
@@ -56,15 +61,37 @@ int main(){
 
   watchdog_enable(4000, 1);
 
-  SpiRam extmem{19, 16, 18, 3};
-  Cached_32_32 cache1{&extmem};
-  Cached_64_32 cache2{&extmem};
-  Cached_64_64 cache3{&extmem};
+  // static: together the caches are far more than the stack can hold
+  static SpiRam extmem{19, 16, 18, 3};
+  static Cached_32_32 cache1{&extmem};
+  static Cached_64_32 cache2{&extmem};
+  static Cached_64_64 cache3{&extmem};
 
-  s_test_memories.push_back({&extmem, "SpiRam"});
-  s_test_memories.push_back({&cache1, "Cached_32_32"});
-  s_test_memories.push_back({&cache2, "Cached_64_32"});
-  s_test_memories.push_back({&cache3, "Cached_64_64"});
+  static Cached_32_32_RR rr{&extmem};
+  static Cached_32_32_LRU lru{&extmem};
+  static Cached_32_32_CLOCK clock{&extmem};
+  static Cached_32_32_RANDOM random{&extmem};
+  static Cached_32_32 prefetch{&extmem};
+  prefetch.set_prefetch(2);
+  static ZeroElidingMemory zero_extmem{&extmem};
+  static Cached_32_32 zero_cache{&zero_extmem};
+  static Cached_32_32 l0_l1{&extmem}, vb_l1{&extmem};
+  static L0_8_Cached_32_32 l0{&l0_l1};
+  static VB_8_Cached_32_32 vb{&vb_l1};
+
+  s_test_memories.push_back({&extmem, "SpiRam", nullptr});
+  s_test_memories.push_back({&cache1, "Cached_32_32", &cache1.stats()});
+  s_test_memories.push_back({&cache2, "Cached_64_32", &cache2.stats()});
+  s_test_memories.push_back({&cache3, "Cached_64_64", &cache3.stats()});
+  s_test_memories.push_back({&rr, "Cached_32_32_RR", &rr.stats()});
+  s_test_memories.push_back({&lru, "Cached_32_32_LRU", &lru.stats()});
+  s_test_memories.push_back({&clock, "Cached_32_32_CLOCK", &clock.stats()});
+  s_test_memories.push_back({&random, "Cached_32_32_RANDOM", &random.stats()});
+  s_test_memories.push_back({&prefetch, "Cached_32_32_PF", &prefetch.stats()});
+  s_test_memories.push_back({&zero_cache, "Cached_32_32(zero)", &zero_cache.stats()});
+  // no single hit rate: L0 and L1 counters are printed after the run
+  s_test_memories.push_back({&l0, "L0_8_Cached_32_32", nullptr});
+  s_test_memories.push_back({&vb, "VB_8_Cached_32_32", nullptr});
 
   while(!stdio_usb_connected()){
     sleep_ms(1000);
@@ -75,7 +102,18 @@ int main(){
   
   run_tests();
 
-  run_profiles();
+  BenchConfig config = s_default_bench_config;
+  run_benchmarks(config);
+#if PICO_EXTMEM_STATS
+  if (config.format == BENCH_TEXT) {
+    print_hierarchy_stats("L0_8_Cached_32_32", l0.stats());
+    print_cache_stats("L0_8_Cached_32_32 L1", l0_l1.stats());
+    print_hierarchy_stats("VB_8_Cached_32_32", vb.stats());
+    print_cache_stats("VB_8_Cached_32_32 L1", vb_l1.stats());
+  }
+#endif
+
+  run_mapper_comparison(cache1, config);
 
   printf("Testing and Profiling complete!\n");
   while(true);
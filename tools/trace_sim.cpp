@@ -0,0 +1,106 @@
+// Replays an access trace printed by ExtmemTracer::print() against cache
+// geometries and policies, to size a cache from a real workload.
+//
+//   pico_extmem_trace_sim [options] [trace file, default stdin]
+//     --cache NAME     replay only this geometry (repeatable), default all
+//     --base HEX       address the memory is mapped at, default 30000000
+//     --cost NS,NS     bus cost per transaction and per byte, default SpiRam's
+//     --heatmap N      show the N most accessed pages of each replay
+//     --page BYTES     heatmap page size, default 1024
+//
+// Lines that aren't trace records are ignored, so a raw serial log works.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+
+#include "trace_replay.hpp"
+
+typedef ReplayResult (*Replay)(std::vector<TraceRecord> const&, uintptr_t, LatencyMemory::Cost, uint32_t, uint32_t);
+
+#define REPLAY(name) {#name, &trace_replay<name>}
+static const struct {
+  const char *name;
+  Replay replay;
+} s_caches[] = {
+  REPLAY(Cached_8_8), REPLAY(Cached_8_16), REPLAY(Cached_8_32), REPLAY(Cached_8_64),
+  REPLAY(Cached_8_128), REPLAY(Cached_8_256), REPLAY(Cached_8_512), REPLAY(Cached_8_1024),
+  REPLAY(Cached_16_8), REPLAY(Cached_16_16), REPLAY(Cached_16_32), REPLAY(Cached_16_64),
+  REPLAY(Cached_16_128), REPLAY(Cached_16_256), REPLAY(Cached_16_512), REPLAY(Cached_16_1024),
+  REPLAY(Cached_32_8), REPLAY(Cached_32_16), REPLAY(Cached_32_32), REPLAY(Cached_32_64),
+  REPLAY(Cached_32_128), REPLAY(Cached_32_256), REPLAY(Cached_32_512), REPLAY(Cached_32_1024),
+  REPLAY(Cached_64_8), REPLAY(Cached_64_16), REPLAY(Cached_64_32), REPLAY(Cached_64_64),
+  REPLAY(Cached_64_128), REPLAY(Cached_64_256), REPLAY(Cached_64_512), REPLAY(Cached_64_1024),
+  REPLAY(Cached_32_32_DM), REPLAY(Cached_32_32_FA),
+  REPLAY(Cached_32_32_RR), REPLAY(Cached_32_32_LRU), REPLAY(Cached_32_32_CLOCK), REPLAY(Cached_32_32_RANDOM),
+};
+
+static void print_heatmap(ReplayResult const &result, unsigned top, uint32_t page_size) {
+  std::vector<std::pair<uint32_t, ReplayResult::Page>> pages(result.pages.begin(), result.pages.end());
+  std::sort(pages.begin(), pages.end(), [](auto const &a, auto const &b) { return a.second.accesses > b.second.accesses; });
+  if (pages.size() > top) pages.resize(top);
+  uint32_t most = pages.empty() ? 1 : pages[0].second.accesses;
+  for (auto const &[index, page] : pages) {
+    int width = 40*uint64_t(page.accesses)/most;
+    printf("  %08x %9u accesses %9u misses |%.*s\n", index*page_size, page.accesses, page.misses,
+           width, "########################################");
+  }
+}
+
+int main(int argc, char **argv) {
+  std::vector<const char*> names;
+  uintptr_t base = 0x3000'0000;
+  LatencyMemory::Cost cost = LatencyMemory::s_spiram_cost;
+  unsigned heatmap = 0;
+  uint32_t page_size = 1024;
+  const char *path = nullptr;
+  for (int i = 1; i < argc; i++) {
+    bool more = i + 1 < argc;
+    if (!strcmp(argv[i], "--cache") && more) names.push_back(argv[++i]);
+    else if (!strcmp(argv[i], "--base") && more) base = strtoul(argv[++i], nullptr, 16);
+    else if (!strcmp(argv[i], "--cost") && more) {
+      if (sscanf(argv[++i], "%u,%u", &cost.ns_per_transaction, &cost.ns_per_byte) != 2) {
+        fprintf(stderr, "--cost takes NS_PER_TRANSACTION,NS_PER_BYTE\n");
+        return 1;
+      }
+    }
+    else if (!strcmp(argv[i], "--heatmap") && more) heatmap = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--page") && more) page_size = atoi(argv[++i]);
+    else if (argv[i][0] != '-' && !path) path = argv[i];
+    else {
+      fprintf(stderr, "usage: %s [--cache NAME]... [--base HEX] [--cost NS,NS] [--heatmap N] [--page BYTES] [trace]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (page_size == 0) page_size = 1024;
+
+  FILE *in = path ? fopen(path, "r") : stdin;
+  if (!in) {
+    perror(path);
+    return 1;
+  }
+  std::vector<TraceRecord> trace;
+  char line[256];
+  while (fgets(line, sizeof(line), in)) {
+    TraceRecord record;
+    if (ExtmemTracer::parse(line, record)) trace.push_back(record);
+  }
+  if (path) fclose(in);
+  printf("%zu accesses, bus cost %uns + %uns/byte\n\n", trace.size(), cost.ns_per_transaction, cost.ns_per_byte);
+
+  printf("%-20s %8s %10s %10s %12s %12s %10s\n", "cache", "hit", "misses", "evictions", "bus bytes", "bus ms", "ns/access");
+  for (auto const &c : s_caches) {
+    if (!names.empty() && std::none_of(names.begin(), names.end(), [&](const char *n) { return !strcmp(n, c.name); })) continue;
+    ReplayResult result = c.replay(trace, base, cost, page_size, 0x0080'0000);
+    uint32_t lookups = result.cache.hits + result.cache.misses;
+    printf("%-20s %7.2f%% %10u %10u %12llu %12.3f %10.1f\n", c.name,
+           lookups ? 100.f*result.cache.hits/lookups : 0.f, result.cache.misses, result.cache.evictions,
+           (unsigned long long)result.bus_bytes, result.bus_ns/1e6,
+           result.accesses ? double(result.bus_ns)/result.accesses : 0.);
+    if (result.skipped) printf("  %u accesses outside the memory skipped\n", result.skipped);
+    if (heatmap) print_heatmap(result, heatmap, page_size);
+  }
+  return 0;
+}